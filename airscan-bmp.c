@@ -0,0 +1,281 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * BMP (DIB) image decoder
+ *
+ * Uncompressed images are decoded almost for free: each line is a row
+ * copy (with BGR->RGB swap, for color images). Bottom-up images are
+ * walked from the last row to the first, without flipping the buffer
+ */
+
+#include "airscan.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* BMP image decoder
+ */
+typedef struct {
+    image_decoder  decoder;       /* Base class */
+    int            wid, hei;      /* Image size, in pixels */
+    int            bits;          /* Bits per pixel: 8, 24 or 32 */
+    bool           gray;          /* Grayscale image */
+    uint8_t        palette[256][3]; /* RGB palette, for 8-bit images */
+    const uint8_t  *row;          /* Next row to read */
+    long           step;          /* Offset to the next row; negative
+                                     for bottom-up images */
+    int            x_off;         /* Window offset within row */
+    int            num_lines;     /* Num of lines left to read */
+} image_decoder_bmp;
+
+/* Get little-endian 16-bit integer
+ */
+static uint32_t
+bmp_le16 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/* Get little-endian 32-bit integer
+ */
+static uint32_t
+bmp_le32 (const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/* Free BMP decoder
+ */
+static void
+image_decoder_bmp_free (image_decoder *decoder)
+{
+    g_free(decoder);
+}
+
+/* Begin BMP decoding
+ *
+ * Both BMP files (with "BM" file header) and bare DIBs (starting
+ * with BITMAPINFOHEADER or its later versions) are accepted
+ */
+static error
+image_decoder_bmp_begin (image_decoder *decoder, const void *data,
+        size_t size)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+    const uint8_t     *beg = data, *hdr = data;
+    size_t            hdr_size, off, stride, colors, pal_off;
+    int32_t           hei;
+    uint32_t          i;
+
+    /* Parse headers */
+    if (size >= 14 && beg[0] == 'B' && beg[1] == 'M') {
+        hdr = beg + 14;
+        off = bmp_le32(beg + 10);
+    } else {
+        off = 0;
+    }
+
+    if ((size_t) (hdr - beg) + 40 > size) {
+        return ERROR("BMP: truncated header");
+    }
+
+    hdr_size = bmp_le32(hdr);
+    if (hdr_size < 40 || (size_t) (hdr - beg) + hdr_size > size) {
+        return ERROR("BMP: invalid header");
+    }
+
+    bmp->wid = (int32_t) bmp_le32(hdr + 4);
+    hei = (int32_t) bmp_le32(hdr + 8);
+    bmp->bits = bmp_le16(hdr + 14);
+
+    if (bmp_le32(hdr + 16) != 0) {
+        return ERROR("BMP: compressed images not supported");
+    }
+
+    if (bmp->bits != 8 && bmp->bits != 24 && bmp->bits != 32) {
+        return ERROR("BMP: unsupported color depth");
+    }
+
+    if (bmp->wid <= 0 || hei == 0) {
+        return ERROR("BMP: invalid image size");
+    }
+
+    bmp->hei = hei > 0 ? hei : -hei;
+
+    /* Load palette */
+    pal_off = (hdr - beg) + hdr_size;
+    colors = 0;
+    if (bmp->bits == 8) {
+        colors = bmp_le32(hdr + 32);
+        if (colors == 0 || colors > 256) {
+            colors = 256;
+        }
+
+        if (pal_off + colors * 4 > size) {
+            return ERROR("BMP: truncated palette");
+        }
+
+        bmp->gray = true;
+        memset(bmp->palette, 0, sizeof(bmp->palette));
+        for (i = 0; i < colors; i ++) {
+            const uint8_t *p = beg + pal_off + i * 4;
+
+            bmp->palette[i][0] = p[2];
+            bmp->palette[i][1] = p[1];
+            bmp->palette[i][2] = p[0];
+
+            if (p[0] != i || p[1] != i || p[2] != i) {
+                bmp->gray = false;
+            }
+        }
+    } else {
+        bmp->gray = false;
+    }
+
+    if (off == 0) {
+        off = pal_off + colors * 4;
+    }
+
+    /* Validate image size */
+    stride = (((size_t) bmp->wid * bmp->bits + 31) / 32) * 4;
+    if (off > size || stride * bmp->hei > size - off) {
+        return ERROR("BMP: truncated image");
+    }
+
+    /* Setup row iterator */
+    if (hei < 0) {
+        bmp->row = beg + off;
+        bmp->step = stride;
+    } else {
+        bmp->row = beg + off + stride * (bmp->hei - 1);
+        bmp->step = - (long) stride;
+    }
+
+    bmp->x_off = 0;
+    bmp->num_lines = bmp->hei;
+
+    return NULL;
+}
+
+/* Reset BMP decoder
+ */
+static void
+image_decoder_bmp_reset (image_decoder *decoder)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+
+    bmp->row = NULL;
+    bmp->num_lines = 0;
+}
+
+/* Get bytes count per pixel
+ */
+static int
+image_decoder_bmp_get_bytes_per_pixel (image_decoder *decoder)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+
+    return bmp->gray ? 1 : 3;
+}
+
+/* Get image parameters
+ */
+static void
+image_decoder_bmp_get_params (image_decoder *decoder, SANE_Parameters *params)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+
+    params->last_frame = SANE_TRUE;
+    params->pixels_per_line = bmp->wid;
+    params->lines = bmp->hei;
+    params->depth = 8;
+
+    if (bmp->gray) {
+        params->format = SANE_FRAME_GRAY;
+        params->bytes_per_line = params->pixels_per_line;
+    } else {
+        params->format = SANE_FRAME_RGB;
+        params->bytes_per_line = params->pixels_per_line * 3;
+    }
+}
+
+/* Set clipping window
+ */
+static error
+image_decoder_bmp_set_window (image_decoder *decoder, image_window *win)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+
+    bmp->row += bmp->step * win->y_off;
+    bmp->x_off = win->x_off;
+    bmp->num_lines = win->hei;
+
+    return NULL;
+}
+
+/* Read next line of image
+ */
+static error
+image_decoder_bmp_read_line (image_decoder *decoder, void *buffer)
+{
+    image_decoder_bmp *bmp = (image_decoder_bmp*) decoder;
+    uint8_t           *out = buffer;
+    const uint8_t     *in;
+    int               i, wid = bmp->wid - bmp->x_off;
+
+    if (!bmp->num_lines) {
+        return ERROR("BMP: end of file");
+    }
+
+    in = bmp->row + bmp->x_off * (bmp->bits / 8);
+
+    switch (bmp->bits) {
+    case 8:
+        if (bmp->gray) {
+            memcpy(out, in, wid);
+        } else {
+            for (i = 0; i < wid; i ++, out += 3) {
+                memcpy(out, bmp->palette[in[i]], 3);
+            }
+        }
+        break;
+
+    case 24:
+    case 32:
+        for (i = 0; i < wid; i ++, out += 3, in += bmp->bits / 8) {
+            out[0] = in[2];
+            out[1] = in[1];
+            out[2] = in[0];
+        }
+        break;
+    }
+
+    bmp->row += bmp->step;
+    bmp->num_lines --;
+
+    return NULL;
+}
+
+/* Create BMP image decoder
+ */
+image_decoder*
+image_decoder_bmp_new (void)
+{
+    image_decoder_bmp *bmp = g_new0(image_decoder_bmp, 1);
+
+    bmp->decoder.content_type = "image/bmp";
+    bmp->decoder.free = image_decoder_bmp_free;
+    bmp->decoder.begin = image_decoder_bmp_begin;
+    bmp->decoder.reset = image_decoder_bmp_reset;
+    bmp->decoder.get_bytes_per_pixel = image_decoder_bmp_get_bytes_per_pixel;
+    bmp->decoder.get_params = image_decoder_bmp_get_params;
+    bmp->decoder.set_window = image_decoder_bmp_set_window;
+    bmp->decoder.read_line = image_decoder_bmp_read_line;
+
+    return &bmp->decoder;
+}
+
+/* vim:ts=8:sw=4:et
+ */
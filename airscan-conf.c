@@ -8,9 +8,20 @@
 
 #include "airscan.h"
 
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+/* Max count of decode pool threads
+ */
+#define CONF_DECODE_THREADS_MAX 64
+
+/* Max value of the retry-after-max option, in seconds
+ */
+#define CONF_RETRY_AFTER_MAX    3600
+
 /******************** .INI-file parser ********************/
 /* Types of .INI file records
  */
@@ -647,6 +658,39 @@ conf_device_list_lookup (const char *name) {
     return dev;
 }
 
+/* Free conf.profiles list
+ */
+static void
+conf_profile_list_free (void)
+{
+    conf_profile *list = conf.profiles, *next;
+
+    while (list != NULL) {
+        next = list->next;
+        g_free((char*) list->model);
+        g_free(list);
+        list = next;
+    }
+}
+
+/* Find performance profile by device model
+ */
+const conf_profile*
+conf_profile_lookup (const char *model)
+{
+    conf_profile *profile = conf.profiles;
+
+    if (model == NULL) {
+        return NULL;
+    }
+
+    while (profile != NULL && strcmp(profile->model, model)) {
+        profile = profile->next;
+    }
+
+    return profile;
+}
+
 /* Expand path name. The returned string must be eventually
  * released with g_free()
  */
@@ -672,6 +716,22 @@ conf_expand_path (const char *path)
     return path;
 }
 
+/* Expand file name. The returned string must be eventually
+ * released with g_free()
+ */
+static const char*
+conf_expand_file (const char *path)
+{
+    const char *home;
+
+    if (path[0] == '~' && path[1] == '/') {
+        home = g_get_home_dir();
+        return home != NULL ? g_strconcat(home, path + 1, NULL) : NULL;
+    }
+
+    return g_strdup(path);
+}
+
 /* Report configuration file error
  */
 static void
@@ -680,6 +740,85 @@ conf_perror (const inifile_record *rec, const char *err)
     log_debug(NULL, "%s:%d: %s", rec->file, rec->line, err);
 }
 
+/* Parse transfer format: jpeg | pdf | bmp | auto. Auto is returned
+ * as ID_FORMAT_UNKNOWN. Returns false on error
+ */
+static bool
+conf_parse_transfer_format (const char *value, ID_FORMAT *fmt)
+{
+    if (inifile_match_name(value, "jpeg")) {
+        *fmt = ID_FORMAT_JPEG;
+    } else if (inifile_match_name(value, "pdf")) {
+        *fmt = ID_FORMAT_PDF;
+    } else if (inifile_match_name(value, "bmp")) {
+        *fmt = ID_FORMAT_BMP;
+    } else if (inifile_match_name(value, "auto")) {
+        *fmt = ID_FORMAT_UNKNOWN;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+/* Parse bandwidth limit: N[k|M|G], in bits per second, and set *rate
+ * in bytes per second. Errors are reported by conf_perror, and *rate
+ * is left unchanged
+ */
+static void
+conf_parse_bandwidth (const inifile_record *rec, uint64_t *rate,
+        const char *usage)
+{
+    const char         *value = rec->value;
+    char               *end;
+    unsigned long long v;
+    uint64_t           mult = 1;
+
+    if (inifile_match_name(value, "unlimited")) {
+        *rate = 0;
+        return;
+    }
+
+    /* strtoull() accepts sign, and negative values wrap around */
+    if (!isdigit((unsigned char) value[0])) {
+        goto USAGE;
+    }
+
+    errno = 0;
+    v = strtoull(value, &end, 10);
+    if (errno == ERANGE) {
+        conf_perror(rec, "bandwidth limit is too large");
+        return;
+    }
+
+    switch (*end) {
+    case 'k': case 'K': mult = 1000; end ++; break;
+    case 'm': case 'M': mult = 1000 * 1000; end ++; break;
+    case 'g': case 'G': mult = 1000 * 1000 * 1000; end ++; break;
+    }
+
+    if (*end != '\0') {
+        goto USAGE;
+    }
+
+    if (v > UINT64_MAX / mult) {
+        conf_perror(rec, "bandwidth limit is too large");
+        return;
+    }
+
+    /* Zero rate means unlimited, so don't round down to it */
+    if ((uint64_t) v * mult < 8) {
+        conf_perror(rec, "bandwidth limit must be at least 8 bits per second");
+        return;
+    }
+
+    *rate = (uint64_t) v * mult / 8;
+    return;
+
+USAGE:
+    conf_perror(rec, usage);
+}
+
 /* Decode a device configuration
  */
 static void
@@ -695,7 +834,7 @@ conf_decode_device (const inifile_record *rec) {
         conf_device_list_prepend(rec->variable, NULL, ID_PROTO_UNKNOWN);
     } else if (rec->tokc != 1 && rec->tokc != 2) {
         conf_perror(rec, "usage: \"device name\" = URL[,protocol]");
-    } else if ((uri = http_uri_new(uri_name, true)) == NULL) {
+    } else if ((uri = http_uri_new_local(uri_name, true)) == NULL) {
         conf_perror(rec, "invalid URL");
     } else if (proto_name != NULL&&
                (proto = id_proto_by_name(proto_name)) == ID_PROTO_UNKNOWN) {
@@ -709,21 +848,70 @@ conf_decode_device (const inifile_record *rec) {
     }
 }
 
+/* Decode a [profile] section variable. The model variable
+ * starts a new profile, following variables apply to it
+ */
+static void
+conf_decode_profile (const inifile_record *rec, conf_profile **current)
+{
+    conf_profile *profile = *current;
+
+    if (inifile_match_name(rec->variable, "model")) {
+        profile = (conf_profile*) conf_profile_lookup(rec->value);
+        if (profile == NULL) {
+            profile = g_new0(conf_profile, 1);
+            profile->model = g_strdup(rec->value);
+            profile->decode_profile = ID_DECODE_PROFILE_UNKNOWN;
+            profile->next = conf.profiles;
+            conf.profiles = profile;
+        }
+        *current = profile;
+    } else if (profile == NULL) {
+        conf_perror(rec, "profile model must be set first");
+    } else if (inifile_match_name(rec->variable, "transfer-format")) {
+        ID_FORMAT fmt;
+
+        if (conf_parse_transfer_format(rec->value, &fmt)) {
+            profile->transfer_format_set = true;
+            profile->transfer_format = fmt;
+        } else {
+            conf_perror(rec,
+                    "usage: transfer-format = jpeg | pdf | bmp | auto");
+        }
+    } else if (inifile_match_name(rec->variable, "decode-profile")) {
+        ID_DECODE_PROFILE prof = id_decode_profile_by_sane_name(rec->value);
+
+        if (prof != ID_DECODE_PROFILE_UNKNOWN) {
+            profile->decode_profile = prof;
+        } else {
+            conf_perror(rec, "usage: decode-profile = accurate | fast");
+        }
+    }
+}
+
 /* Load configuration from opened inifile
  */
 static void
 conf_load_from_ini (inifile *ini)
 {
     const inifile_record *rec;
+    conf_profile         *profile = NULL;
+
     while ((rec = inifile_read(ini)) != NULL) {
         switch (rec->type) {
         case INIFILE_SYNTAX:
             conf_perror(rec, "syntax error");
             break;
 
+        case INIFILE_SECTION:
+            profile = NULL;
+            break;
+
         case INIFILE_VARIABLE:
             if (inifile_match_name(rec->section, "devices")) {
                 conf_decode_device(rec);
+            } else if (inifile_match_name(rec->section, "profile")) {
+                conf_decode_profile(rec, &profile);
             } else if (inifile_match_name(rec->section, "options")) {
                 if (inifile_match_name(rec->variable, "discovery")) {
                     if (inifile_match_name(rec->value, "enable")) {
@@ -741,6 +929,91 @@ conf_load_from_ini (inifile *ini)
                     } else {
                         conf_perror(rec, "usage: model = network | hardware");
                     }
+                } else if (inifile_match_name(rec->variable, "decode-profile")) {
+                    if (inifile_match_name(rec->value, "accurate")) {
+                        conf.decode_profile = ID_DECODE_PROFILE_ACCURATE;
+                    } else if (inifile_match_name(rec->value, "fast")) {
+                        conf.decode_profile = ID_DECODE_PROFILE_FAST;
+                    } else {
+                        conf_perror(rec,
+                                "usage: decode-profile = accurate | fast");
+                    }
+                } else if (inifile_match_name(rec->variable, "continuous-adf")) {
+                    if (inifile_match_name(rec->value, "enable")) {
+                        conf.continuous_adf = true;
+                    } else if (inifile_match_name(rec->value, "disable")) {
+                        conf.continuous_adf = false;
+                    } else {
+                        conf_perror(rec,
+                                "usage: continuous-adf = enable | disable");
+                    }
+                } else if (inifile_match_name(rec->variable, "transfer-format")) {
+                    if (!conf_parse_transfer_format(rec->value,
+                            &conf.transfer_format)) {
+                        conf_perror(rec,
+                                "usage: transfer-format = jpeg | pdf | bmp | auto");
+                    }
+                } else if (inifile_match_name(rec->variable, "decode-threads")) {
+                    char          *end;
+                    unsigned long v = strtoul(rec->value, &end, 10);
+
+                    if (inifile_match_name(rec->value, "auto")) {
+                        conf.decode_threads = -1;
+                    } else if (end != rec->value && *end == '\0' &&
+                               v <= CONF_DECODE_THREADS_MAX) {
+                        conf.decode_threads = (int) v;
+                    } else {
+                        conf_perror(rec,
+                                "usage: decode-threads = N | auto");
+                    }
+                } else if (inifile_match_name(rec->variable, "bandwidth-total")) {
+                    conf_parse_bandwidth(rec, &conf.bandwidth_total,
+                            "usage: bandwidth-total = N[k|M|G] | unlimited");
+                } else if (inifile_match_name(rec->variable,
+                        "bandwidth-per-device")) {
+                    conf_parse_bandwidth(rec, &conf.bandwidth_device,
+                            "usage: bandwidth-per-device = N[k|M|G] | unlimited");
+                } else if (inifile_match_name(rec->variable,
+                        "retry-after-max")) {
+                    char          *end;
+                    unsigned long v = strtoul(rec->value, &end, 10);
+
+                    if (inifile_match_name(rec->value, "ignore")) {
+                        conf.retry_after_max = 0;
+                    } else if (end != rec->value && *end == '\0' &&
+                               v > 0 && v <= CONF_RETRY_AFTER_MAX) {
+                        conf.retry_after_max = (int) v * 1000;
+                    } else {
+                        conf_perror(rec,
+                                "usage: retry-after-max = N | ignore");
+                    }
+                } else if (inifile_match_name(rec->variable, "protocol")) {
+                    if (inifile_match_name(rec->value, "auto")) {
+                        conf.protocol = ID_PROTO_UNKNOWN;
+                    } else if (inifile_match_name(rec->value, "escl")) {
+                        conf.protocol = ID_PROTO_ESCL;
+                    } else if (inifile_match_name(rec->value, "wsd")) {
+                        conf.protocol = ID_PROTO_WSD;
+                    } else {
+                        conf_perror(rec,
+                                "usage: protocol = auto | escl | wsd");
+                    }
+                } else if (inifile_match_name(rec->variable, "socket-dir")) {
+                    g_free((char*) conf.socket_dir);
+                    conf.socket_dir = conf_expand_path(rec->value);
+                    if (conf.socket_dir == NULL) {
+                        conf_perror(rec, "failed to expand path");
+                    }
+                } else if (inifile_match_name(rec->variable, "perf-history")) {
+                    g_free((char*) conf.perf_history);
+                    if (inifile_match_name(rec->value, "disable")) {
+                        conf.perf_history = g_strdup("");
+                    } else {
+                        conf.perf_history = conf_expand_file(rec->value);
+                        if (conf.perf_history == NULL) {
+                            conf_perror(rec, "failed to expand path");
+                        }
+                    }
                 }
             } else if (inifile_match_name(rec->section, "debug")) {
                 if (inifile_match_name(rec->variable, "trace")) {
@@ -905,7 +1178,10 @@ void
 conf_unload (void)
 {
     conf_device_list_free();
+    conf_profile_list_free();
     g_free((char*) conf.dbg_trace);
+    g_free((char*) conf.socket_dir);
+    g_free((char*) conf.perf_history);
     memset(&conf, 0, sizeof(conf));
 }
 
@@ -0,0 +1,626 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Decode thread pool
+ *
+ * The pool is shared by all open devices. Each device has its own
+ * queue of decode tasks (one task per received page), and idle pool
+ * threads take tasks from these queues in round-robin order, so
+ * every device with pending work gets its turn, and a single device
+ * with a large job cannot monopolize the pool. Note, there is no work
+ * stealing: fairness comes only from the round-robin order.
+ *
+ * Each task decodes the whole page into memory. To bound memory usage,
+ * amount of pages, decoded ahead of the reader, is limited per device,
+ * and total size of decoded pages is limited per pool. Tasks, dropped
+ * while being decoded, stop at the next line.
+ *
+ * If reader needs a page, which is not taken by the pool yet, it takes
+ * the task back and decodes it by itself, so reader never waits for
+ * the pool to reach it
+ */
+
+#include "airscan.h"
+
+#include <string.h>
+
+/* Max count of pages, decoded ahead of reader, per device
+ */
+#define DECPOOL_AHEAD   2
+
+/* Pool doesn't start decoding of the next page, while total size of
+ * decoded pages exceeds this limit, in bytes. Note, 600 DPI A4 color
+ * page takes about 100 MB
+ */
+#define DECPOOL_MAX_BYTES       (256 * 1024 * 1024)
+
+/* Decode task state
+ */
+typedef enum {
+    DECPOOL_TASK_PENDING,       /* Waiting for decoding */
+    DECPOOL_TASK_RUNNING,       /* Decoding in progress */
+    DECPOOL_TASK_DONE           /* Decoding finished */
+} DECPOOL_TASK_STATE;
+
+/* Decoded image, as passed to the raw image decoder
+ */
+typedef struct {
+    SANE_Parameters params;     /* Image parameters */
+    uint8_t         pixels[];   /* Image pixels */
+} decpool_image;
+
+/* Decode task
+ */
+struct decpool_task {
+    ll_node            node;         /* In decpool_queue::tasks */
+    decpool_queue      *queue;       /* Owning queue, NULL if detached */
+    http_data          *image;       /* Image to decode */
+    ID_DECODE_PROFILE  profile;      /* Decoding profile */
+    DECPOOL_TASK_STATE state;        /* Task state */
+    bool               orphan;       /* Released while running */
+    decpool_image      *result;      /* Decoded image */
+    size_t             result_size;  /* Its size, in bytes */
+    error              err;          /* Decoding error, if any */
+    char               errbuf[256];  /* Buffer for the error message */
+};
+
+/* Per-device queue of decode tasks
+ */
+struct decpool_queue {
+    ll_node            node;    /* In decpool.queues */
+    ll_head            tasks;   /* Tasks, in order of submission */
+    int                ahead;   /* Tasks, decoded (or being decoded)
+                                   ahead of reader */
+};
+
+/* Static variables
+ */
+static struct {
+    GMutex             lock;           /* Access lock */
+    GCond              cond_work;      /* Signalled when work available */
+    GCond              cond_done;      /* Signalled when task done */
+    GThread            **threads;      /* Pool threads */
+    int                nthreads;       /* Count of threads */
+    ll_head            queues;         /* Device queues, round robin */
+    bool               stop;           /* Pool is being stopped */
+    gint64             start_time;     /* When pool was started */
+    gint64             busy_time;      /* Total busy time of threads */
+    size_t             bytes;          /* Total size of decoded pages */
+    unsigned int       pages_pool;     /* Pages, decoded by pool */
+    unsigned int       pages_inline;   /* Pages, decoded by readers */
+} decpool;
+
+/* Decode the page. Called without lock held
+ */
+static void
+decpool_task_decode (decpool_task *task)
+{
+    image_decoder   *decoder;
+    SANE_Parameters params;
+    error           err;
+    int             i;
+
+    switch (id_format_detect(task->image->bytes, task->image->size)) {
+    case ID_FORMAT_PDF:
+        decoder = image_decoder_pdf_new();
+        break;
+
+    case ID_FORMAT_BMP:
+        decoder = image_decoder_bmp_new();
+        break;
+
+    default:
+        decoder = image_decoder_jpeg_new();
+        break;
+    }
+
+    image_decoder_set_profile(decoder, task->profile);
+    err = image_decoder_begin(decoder, task->image->bytes, task->image->size);
+    if (err != NULL) {
+        goto DONE;
+    }
+
+    image_decoder_get_params(decoder, &params);
+    task->result_size = sizeof(decpool_image) +
+        (size_t) params.bytes_per_line * params.lines;
+    task->result = g_malloc(task->result_size);
+    task->result->params = params;
+    memstat_alloc(MEMSTAT_DEVICE, task->result_size);
+
+    g_mutex_lock(&decpool.lock);
+    decpool.bytes += task->result_size;
+    g_mutex_unlock(&decpool.lock);
+
+    for (i = 0; err == NULL && i < params.lines; i ++) {
+        if (__atomic_load_n(&task->orphan, __ATOMIC_RELAXED)) {
+            err = ERROR("decoding cancelled");
+            break;
+        }
+
+        err = image_decoder_read_line(decoder,
+            task->result->pixels + (size_t) i * params.bytes_per_line);
+    }
+
+    image_decoder_reset(decoder);
+
+DONE:
+    if (err != NULL) {
+        snprintf(task->errbuf, sizeof(task->errbuf), "%s", ESTRING(err));
+        task->err = ERROR(task->errbuf);
+    }
+
+    image_decoder_free(decoder);
+}
+
+/* Free the task. Called with lock held
+ */
+static void
+decpool_task_free_locked (decpool_task *task)
+{
+    if (task->state == DECPOOL_TASK_RUNNING) {
+        __atomic_store_n(&task->orphan, true, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (task->result != NULL) {
+        memstat_free(MEMSTAT_DEVICE, task->result_size);
+        g_free(task->result);
+        decpool.bytes -= task->result_size;
+        g_cond_signal(&decpool.cond_work);
+    }
+
+    http_data_unref(task->image);
+    g_free(task);
+}
+
+/* Find the next task to decode, and rotate queues, so the next
+ * device will be served next time. Called with lock held
+ */
+static decpool_task*
+decpool_next_task (void)
+{
+    ll_node *node;
+
+    if (decpool.bytes >= DECPOOL_MAX_BYTES) {
+        return NULL;
+    }
+
+    for (LL_FOR_EACH(node, &decpool.queues)) {
+        decpool_queue *q = OUTER_STRUCT(node, decpool_queue, node);
+        ll_node       *tnode;
+
+        if (q->ahead >= DECPOOL_AHEAD) {
+            continue;
+        }
+
+        for (LL_FOR_EACH(tnode, &q->tasks)) {
+            decpool_task *task = OUTER_STRUCT(tnode, decpool_task, node);
+
+            if (task->state == DECPOOL_TASK_PENDING) {
+                ll_del(&q->node);
+                ll_push_end(&decpool.queues, &q->node);
+                q->ahead ++;
+                return task;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Pool thread
+ */
+static gpointer
+decpool_thread_func (gpointer data)
+{
+    (void) data;
+
+    g_mutex_lock(&decpool.lock);
+
+    while (!decpool.stop) {
+        decpool_task *task = decpool_next_task();
+        gint64       start;
+
+        if (task == NULL) {
+            g_cond_wait(&decpool.cond_work, &decpool.lock);
+            continue;
+        }
+
+        task->state = DECPOOL_TASK_RUNNING;
+        g_mutex_unlock(&decpool.lock);
+
+        start = g_get_monotonic_time();
+        decpool_task_decode(task);
+
+        g_mutex_lock(&decpool.lock);
+        decpool.busy_time += g_get_monotonic_time() - start;
+        decpool.pages_pool ++;
+
+        task->state = DECPOOL_TASK_DONE;
+        if (task->orphan) {
+            decpool_task_free_locked(task);
+        }
+
+        g_cond_broadcast(&decpool.cond_done);
+    }
+
+    g_mutex_unlock(&decpool.lock);
+
+    return NULL;
+}
+
+/* Create per-device queue of decode tasks. Returns NULL, if
+ * decode pool is disabled
+ */
+decpool_queue*
+decpool_queue_new (void)
+{
+    decpool_queue *q;
+
+    if (decpool.nthreads == 0) {
+        return NULL;
+    }
+
+    q = g_new0(decpool_queue, 1);
+    ll_init(&q->tasks);
+
+    g_mutex_lock(&decpool.lock);
+    ll_push_end(&decpool.queues, &q->node);
+    g_mutex_unlock(&decpool.lock);
+
+    return q;
+}
+
+/* Free the queue. Pending tasks are dropped
+ */
+void
+decpool_queue_free (decpool_queue *q)
+{
+    decpool_queue_purge(q);
+
+    g_mutex_lock(&decpool.lock);
+    ll_del(&q->node);
+    g_mutex_unlock(&decpool.lock);
+
+    g_free(q);
+}
+
+/* Submit page for decoding. The image is referenced by the task
+ */
+void
+decpool_queue_submit (decpool_queue *q, http_data *image,
+        ID_DECODE_PROFILE profile)
+{
+    decpool_task *task = g_new0(decpool_task, 1);
+
+    task->queue = q;
+    task->image = http_data_ref(image);
+    task->profile = profile;
+
+    g_mutex_lock(&decpool.lock);
+    ll_push_end(&q->tasks, &task->node);
+    g_cond_signal(&decpool.cond_work);
+    g_mutex_unlock(&decpool.lock);
+}
+
+/* Drop all tasks from the queue
+ */
+void
+decpool_queue_purge (decpool_queue *q)
+{
+    ll_node *node;
+
+    g_mutex_lock(&decpool.lock);
+
+    while ((node = ll_pop_beg(&q->tasks)) != NULL) {
+        decpool_task *task = OUTER_STRUCT(node, decpool_task, node);
+        task->queue = NULL;
+        decpool_task_free_locked(task);
+    }
+
+    q->ahead = 0;
+    g_cond_signal(&decpool.cond_work);
+
+    g_mutex_unlock(&decpool.lock);
+}
+
+/* Detach task for the image from the queue. Returns NULL, if
+ * there is no task for this image
+ */
+decpool_task*
+decpool_queue_take (decpool_queue *q, http_data *image)
+{
+    ll_node      *node;
+    decpool_task *task = NULL;
+
+    g_mutex_lock(&decpool.lock);
+
+    for (LL_FOR_EACH(node, &q->tasks)) {
+        decpool_task *t = OUTER_STRUCT(node, decpool_task, node);
+        if (t->image == image) {
+            task = t;
+            break;
+        }
+    }
+
+    if (task != NULL) {
+        ll_del(&task->node);
+        task->queue = NULL;
+
+        if (task->state != DECPOOL_TASK_PENDING) {
+            q->ahead --;
+            g_cond_signal(&decpool.cond_work);
+        }
+    }
+
+    g_mutex_unlock(&decpool.lock);
+
+    return task;
+}
+
+/* Wait for the task completion. If task is not taken by the pool
+ * yet, it is decoded by the calling thread
+ *
+ * On success, data and size are set to the decoded image, suitable
+ * for the raw image decoder. Data remains valid until the task is freed
+ */
+error
+decpool_task_wait (decpool_task *task, const void **data, size_t *size)
+{
+    bool inline_decode = false;
+
+    g_mutex_lock(&decpool.lock);
+
+    if (task->state == DECPOOL_TASK_PENDING) {
+        task->state = DECPOOL_TASK_RUNNING;
+        inline_decode = true;
+    } else {
+        while (task->state != DECPOOL_TASK_DONE) {
+            g_cond_wait(&decpool.cond_done, &decpool.lock);
+        }
+    }
+
+    g_mutex_unlock(&decpool.lock);
+
+    if (inline_decode) {
+        decpool_task_decode(task);
+
+        g_mutex_lock(&decpool.lock);
+        task->state = DECPOOL_TASK_DONE;
+        decpool.pages_inline ++;
+        g_mutex_unlock(&decpool.lock);
+    }
+
+    if (task->err == NULL) {
+        *data = task->result;
+        *size = task->result_size;
+    }
+
+    return task->err;
+}
+
+/* Free the task, detached by decpool_queue_take()
+ */
+void
+decpool_task_free (decpool_task *task)
+{
+    g_mutex_lock(&decpool.lock);
+    decpool_task_free_locked(task);
+    g_mutex_unlock(&decpool.lock);
+}
+
+/* Dump pool statistics
+ */
+void
+decpool_stats_dump (log_ctx *log)
+{
+    gint64 elapsed, busy;
+    unsigned int pages_pool, pages_inline;
+
+    if (decpool.nthreads == 0) {
+        return;
+    }
+
+    g_mutex_lock(&decpool.lock);
+    elapsed = g_get_monotonic_time() - decpool.start_time;
+    busy = decpool.busy_time;
+    pages_pool = decpool.pages_pool;
+    pages_inline = decpool.pages_inline;
+    g_mutex_unlock(&decpool.lock);
+
+    elapsed *= decpool.nthreads;
+    log_debug(log, "decode pool: %d threads, %u pages by pool, %u inline, "
+        "utilization %d%%", decpool.nthreads, pages_pool, pages_inline,
+        elapsed ? (int) (busy * 100 / elapsed) : 0);
+}
+
+/* Initialize decode pool
+ */
+void
+decpool_init (void)
+{
+    int i, n = conf.decode_threads;
+
+    if (n < 0) {
+        n = g_get_num_processors();
+    }
+
+    g_mutex_init(&decpool.lock);
+    g_cond_init(&decpool.cond_work);
+    g_cond_init(&decpool.cond_done);
+    ll_init(&decpool.queues);
+    decpool.stop = false;
+    decpool.start_time = g_get_monotonic_time();
+    decpool.busy_time = 0;
+    decpool.bytes = 0;
+    decpool.pages_pool = decpool.pages_inline = 0;
+
+    decpool.nthreads = n;
+    decpool.threads = g_new0(GThread*, n + 1);
+    for (i = 0; i < n; i ++) {
+        decpool.threads[i] = g_thread_new("airscan-decode",
+            decpool_thread_func, NULL);
+    }
+
+    if (n != 0) {
+        log_debug(NULL, "decode pool: %d threads started", n);
+    }
+}
+
+/* Cleanup decode pool
+ */
+void
+decpool_cleanup (void)
+{
+    int i;
+
+    if (decpool.threads == NULL) {
+        return;
+    }
+
+    decpool_stats_dump(NULL);
+
+    g_mutex_lock(&decpool.lock);
+    decpool.stop = true;
+    g_cond_broadcast(&decpool.cond_work);
+    g_mutex_unlock(&decpool.lock);
+
+    for (i = 0; i < decpool.nthreads; i ++) {
+        g_thread_join(decpool.threads[i]);
+    }
+
+    g_free(decpool.threads);
+    decpool.threads = NULL;
+    decpool.nthreads = 0;
+
+    g_cond_clear(&decpool.cond_done);
+    g_cond_clear(&decpool.cond_work);
+    g_mutex_clear(&decpool.lock);
+}
+
+/******************** Raw image decoder ********************/
+/* Raw image decoder, for images, decoded by the pool
+ */
+typedef struct {
+    image_decoder       decoder;   /* Base class */
+    const decpool_image *image;    /* Decoded image */
+    const uint8_t       *row;      /* Next row to read */
+    int                 x_off;     /* Window offset, in bytes */
+    int                 num_lines; /* Num of lines left to read */
+} image_decoder_raw;
+
+/* Free raw decoder
+ */
+static void
+image_decoder_raw_free (image_decoder *decoder)
+{
+    g_free(decoder);
+}
+
+/* Begin raw image decoding
+ */
+static error
+image_decoder_raw_begin (image_decoder *decoder, const void *data,
+        size_t size)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+
+    (void) size;
+
+    raw->image = data;
+    raw->row = raw->image->pixels;
+    raw->x_off = 0;
+    raw->num_lines = raw->image->params.lines;
+
+    return NULL;
+}
+
+/* Reset raw decoder
+ */
+static void
+image_decoder_raw_reset (image_decoder *decoder)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+
+    raw->image = NULL;
+    raw->row = NULL;
+    raw->num_lines = 0;
+}
+
+/* Get bytes count per pixel
+ */
+static int
+image_decoder_raw_get_bytes_per_pixel (image_decoder *decoder)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+
+    return raw->image->params.format == SANE_FRAME_RGB ? 3 : 1;
+}
+
+/* Get image parameters
+ */
+static void
+image_decoder_raw_get_params (image_decoder *decoder, SANE_Parameters *params)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+
+    *params = raw->image->params;
+}
+
+/* Set clipping window
+ */
+static error
+image_decoder_raw_set_window (image_decoder *decoder, image_window *win)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+    int               bpp = image_decoder_raw_get_bytes_per_pixel(decoder);
+
+    raw->row += (size_t) win->y_off * raw->image->params.bytes_per_line;
+    raw->x_off = win->x_off * bpp;
+    raw->num_lines = win->hei;
+
+    return NULL;
+}
+
+/* Read next line of image
+ */
+static error
+image_decoder_raw_read_line (image_decoder *decoder, void *buffer)
+{
+    image_decoder_raw *raw = (image_decoder_raw*) decoder;
+    int               bpl = raw->image->params.bytes_per_line;
+
+    if (!raw->num_lines) {
+        return ERROR("RAW: end of file");
+    }
+
+    memcpy(buffer, raw->row + raw->x_off, bpl - raw->x_off);
+    raw->row += bpl;
+    raw->num_lines --;
+
+    return NULL;
+}
+
+/* Create raw image decoder
+ */
+image_decoder*
+image_decoder_raw_new (void)
+{
+    image_decoder_raw *raw = g_new0(image_decoder_raw, 1);
+
+    raw->decoder.content_type = "image/x-raw";
+    raw->decoder.free = image_decoder_raw_free;
+    raw->decoder.begin = image_decoder_raw_begin;
+    raw->decoder.reset = image_decoder_raw_reset;
+    raw->decoder.get_bytes_per_pixel = image_decoder_raw_get_bytes_per_pixel;
+    raw->decoder.get_params = image_decoder_raw_get_params;
+    raw->decoder.set_window = image_decoder_raw_set_window;
+    raw->decoder.read_line = image_decoder_raw_read_line;
+
+    return &raw->decoder;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -239,6 +239,30 @@ devcaps_dump (log_ctx *log, devcaps *caps)
         }
 
         log_trace(log, "    Color modes: %s", buf->str);
+
+        if ((src->flags & DEVCAPS_SOURCE_INTENT_ALL) != 0) {
+            static const struct {
+                unsigned int flag;
+                ID_SCANINTENT id;
+            } intents[] = {
+                {DEVCAPS_SOURCE_INTENT_DOCUMENT, ID_SCANINTENT_DOCUMENT},
+                {DEVCAPS_SOURCE_INTENT_TXT_AND_GRAPH, ID_SCANINTENT_TXT_AND_GRAPH},
+                {DEVCAPS_SOURCE_INTENT_PHOTO, ID_SCANINTENT_PHOTO},
+                {DEVCAPS_SOURCE_INTENT_PREVIEW, ID_SCANINTENT_PREVIEW}
+            };
+
+            g_string_truncate(buf, 0);
+            for (i = 0; i < (int) (sizeof(intents)/sizeof(intents[0])); i ++) {
+                if ((src->flags & intents[i].flag) != 0) {
+                    if (buf->len != 0) {
+                        g_string_append(buf, ", ");
+                    }
+                    g_string_append(buf, id_scanintent_sane_name(intents[i].id));
+                }
+            }
+
+            log_trace(log, "    Intents:     %s", buf->str);
+        }
     }
 
     g_string_free(buf, TRUE);
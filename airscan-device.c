@@ -5,11 +5,16 @@
  *
  * Device management
  */
+#define _GNU_SOURCE
+#include <string.h>
 
 #include "airscan.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
-#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 /******************** Device management ********************/
 /* Device flags
@@ -20,7 +25,33 @@ enum {
     DEVICE_READING          = (1 << 1)  /* sane_read() can be called */
 };
 
+/* Pause between device status requests in the continuous
+ * ADF mode, in milliseconds
+ */
+#define DEVICE_ADF_WATCH_PAUSE          1000
+
+/* Pause between device status requests, while the next job waits
+ * for the device to become idle, in milliseconds
+ */
+#define DEVICE_IDLE_WAIT_PAUSE          250
+
+/* Minimal link speed, in Mbit/s, for automatic choice of
+ * uncompressed image transfer
+ */
+#define DEVICE_BMP_LINK_SPEED           1000
+
+/* Maximum size of the page thumbnail (its longest side), in pixels
+ */
+#define DEVICE_THUMB_SIZE               160
+
 /* Device state diagram
+ *
+ * Note, PROTO_OP_CLEANUP normally runs in background, after the job
+ * enters the DONE state, so the next job may start without waiting for
+ * it (see device_stm_cleanup_async()). If protocol supports it, the
+ * next job, started while cleanup is in progress, is submitted as soon
+ * as device reports idle. The CLEANUP state is used only for devices
+ * that reject new jobs while cleanup is in progress
  *
  *       OPENED
  *          |
@@ -90,6 +121,29 @@ struct device {
     eloop_event          *stm_cancel_event; /* Signalled to initiate cancel */
     http_query           *stm_cancel_query; /* CANCEL query */
     eloop_timer          *stm_timer;        /* Delay timer */
+    http_client          *stm_cleanup_http; /* Client for background
+                                               PROTO_OP_CLEANUP */
+    bool                 stm_cleanup_sync;  /* Device rejects jobs while
+                                               cleanup is in progress */
+    bool                 stm_idle_wait;     /* Job waits for device to
+                                               become idle */
+    gint64               stm_perf_mark;     /* Probe start, job start or
+                                               last page time, for
+                                               performance statistics */
+    gint64               stm_perf_start;    /* Job start time, the same */
+    pollable             *stm_open_pollable;/* Signalled when probing
+                                               is finished */
+    char                 *stm_open_ident;   /* Ident, being looked up */
+    eloop_event          *stm_open_event;   /* Signalled when device
+                                               lookup may proceed */
+    SANE_Status          stm_open_status;   /* Status of failed open */
+
+    /* Continuous ADF mode */
+    eloop_timer          *adf_watch_timer;  /* Pause between requests */
+    http_query           *adf_watch_query;  /* Pending status request */
+    bool                 adf_watch_job;     /* Job is started by ADF watch
+                                               and not claimed by
+                                               sane_start() yet */
 
     /* Protocol handling */
     proto_ctx            proto_ctx;        /* Protocol handler context */
@@ -106,18 +160,43 @@ struct device {
     /* Read machinery */
     SANE_Bool            read_non_blocking;  /* Non-blocking I/O mode */
     image_decoder        *read_decoder_jpeg; /* JPEG decoder */
+    image_decoder        *read_decoder_pdf;  /* PDF decoder */
+    image_decoder        *read_decoder_bmp;  /* BMP decoder */
+    image_decoder        *read_decoder_raw;  /* Decoder for images,
+                                                decoded by the pool */
+    image_decoder        *read_decoder;      /* Decoder of current image */
+    filter               *read_filters;      /* Line filters of current
+                                                image */
+    decpool_queue        *read_decpool;      /* Decode pool queue, NULL
+                                                if pool is disabled */
+    decpool_task         *read_task;         /* Decode task of current
+                                                image, if any */
     pollable             *read_pollable;     /* Signalled when read won't
                                                 block */
     http_data_queue      *read_queue;        /* Queue of received images */
     http_data            *read_image;        /* Current image */
     SANE_Byte            *read_line_buf;     /* Single-line buffer */
+    size_t               read_line_cap;      /* read_line_buf capacity */
     SANE_Int             read_line_num;      /* Current image line 0-based */
     SANE_Int             read_line_end;      /* If read_line_num>read_line_end
                                                 no more lines left in image */
     SANE_Int             read_line_off;      /* Current offset in the line */
+    size_t               read_line_len;      /* Bytes, written by decoder
+                                                into the line */
     SANE_Int             read_skip_lines;    /* How many lines to skip */
     SANE_Int             read_skip_bytes;    /* How many bytes to skip at line
                                                 beginning */
+
+    /* Page thumbnail */
+    SANE_Parameters      thumb_params;       /* Thumbnail parameters */
+    SANE_Byte            *thumb_buf;         /* Thumbnail image */
+    uint32_t             *thumb_acc;         /* Box filter accumulator */
+    size_t               thumb_mem;          /* Memory used by thumbnail */
+    int                  thumb_scale;        /* Box filter size */
+    SANE_Int             thumb_line_num;     /* Lines, fed into thumbnail */
+    SANE_Int             thumb_lines;        /* Lines, the decoder delivers */
+    bool                 thumb_enabled;      /* Thumbnails were requested */
+    bool                 thumb_ready;        /* Thumbnail is complete */
 };
 
 /* Static variables
@@ -162,6 +241,27 @@ device_stm_op_callback (void *ptr, http_query *q);
 static void
 device_stm_cancel_event_callback (void *data);
 
+static void
+device_stm_idle_wait_done (device *dev);
+
+static void
+device_stm_idle_wait_timer_callback (void *data);
+
+static void
+device_adf_watch_start (device *dev);
+
+static void
+device_adf_watch_stop (device *dev);
+
+static SANE_Status
+device_read_finish (device *dev, SANE_Status status);
+
+static void
+device_thumb_free (device *dev);
+
+static void
+device_read_queue_purge (device *dev);
+
 static void
 device_management_start_stop (bool start);
 
@@ -177,6 +277,7 @@ device_new (zeroconf_devinfo *devinfo)
 
     /* Create device */
     dev = g_new0(device, 1);
+    memstat_alloc(MEMSTAT_DEVICE, sizeof(device));
 
     dev->devinfo = devinfo;
     dev->log = log_ctx_new(dev->devinfo->name);
@@ -189,10 +290,18 @@ device_new (zeroconf_devinfo *devinfo)
     devopt_init(&dev->opt);
 
     dev->proto_ctx.http = http_client_new(dev->log, dev);
+    dev->stm_cleanup_http = http_client_new(dev->log, dev);
 
     g_cond_init(&dev->stm_cond);
+    dev->stm_open_pollable = pollable_new();
+    dev->stm_open_status = SANE_STATUS_IO_ERROR;
 
     dev->read_decoder_jpeg = image_decoder_jpeg_new();
+    dev->read_decoder_pdf = image_decoder_pdf_new();
+    dev->read_decoder_bmp = image_decoder_bmp_new();
+    dev->read_decoder_raw = image_decoder_raw_new();
+    dev->read_decoder = dev->read_decoder_jpeg;
+    dev->read_decpool = decpool_queue_new();
     dev->read_pollable = pollable_new();
     dev->read_queue = http_data_queue_new();
 
@@ -212,12 +321,20 @@ device_free (device *dev)
     g_ptr_array_remove(device_table, dev);
 
     /* Stop all pending I/O activity */
+    device_adf_watch_stop(dev);
     device_http_cancel(dev);
+    http_client_cancel(dev->stm_cleanup_http);
 
     if (dev->stm_cancel_event != NULL) {
         eloop_event_free(dev->stm_cancel_event);
     }
 
+    if (dev->stm_open_event != NULL) {
+        zeroconf_initscan_notify_cancel(dev->stm_open_event);
+        eloop_event_free(dev->stm_open_event);
+    }
+    g_free(dev->stm_open_ident);
+
     if (dev->stm_timer != NULL) {
         eloop_timer_cancel(dev->stm_timer);
     }
@@ -228,13 +345,26 @@ device_free (device *dev)
     devopt_cleanup(&dev->opt);
 
     http_client_free(dev->proto_ctx.http);
+    http_client_free(dev->stm_cleanup_http);
     g_free((char*) dev->proto_ctx.location);
 
     g_cond_clear(&dev->stm_cond);
+    pollable_free(dev->stm_open_pollable);
 
     image_decoder_free(dev->read_decoder_jpeg);
+    image_decoder_free(dev->read_decoder_pdf);
+    image_decoder_free(dev->read_decoder_bmp);
+    image_decoder_free(dev->read_decoder_raw);
+    filter_chain_free(dev->read_filters);
+    if (dev->read_decpool != NULL) {
+        decpool_queue_free(dev->read_decpool);
+    }
     http_data_queue_free(dev->read_queue);
     pollable_free(dev->read_pollable);
+    device_thumb_free(dev);
+
+    memstat_free(MEMSTAT_DEVICE, sizeof(device));
+    memstat_dump(dev->log);
 
     log_debug(dev->log, "device destroyed");
     log_ctx_free(dev->log);
@@ -242,32 +372,34 @@ device_free (device *dev)
     g_free(dev);
 }
 
-/* Start probing. Called via eloop_call
+/* Start probing. Called via stm_timer, so if device is closed
+ * before probing is started, the call is cancelled by device_free()
  */
-static gboolean
-device_start_probing (gpointer data)
+static void
+device_start_probing (void *data)
 {
     device      *dev = data;
 
+    dev->stm_timer = NULL;
     device_probe_endpoint(dev, dev->devinfo->endpoints);
-
-    return FALSE;
 }
 
-/* Start device I/O. Called via eloop_call
- * device_start_do
+/* Start device I/O
  */
 static SANE_Status
 device_io_start (device *dev)
 {
+    if (dev->stm_open_pollable == NULL) {
+        return SANE_STATUS_NO_MEM;
+    }
+
     dev->stm_cancel_event = eloop_event_new(device_stm_cancel_event_callback, dev);
     if (dev->stm_cancel_event == NULL) {
-        device_close(dev);
         return SANE_STATUS_NO_MEM;
     }
 
     device_stm_state_set(dev, DEVICE_STM_PROBING);
-    eloop_call(device_start_probing, dev);
+    dev->stm_timer = eloop_timer_new(0, device_start_probing, dev);
 
     return SANE_STATUS_GOOD;
 }
@@ -328,6 +460,7 @@ device_proto_devcaps_submit (device *dev, void (*callback) (void*, http_query*))
     http_query *q;
 
     q = dev->proto_ctx.proto->devcaps_query(&dev->proto_ctx);
+    http_query_set_priority(q, HTTP_PRIORITY_STATUS);
     http_query_submit(q, callback);
     dev->proto_ctx.query = q;
 }
@@ -359,6 +492,18 @@ device_proto_op_name (device *dev, PROTO_OP op)
     return NULL;
 }
 
+/* Get operation priority class
+ */
+static HTTP_PRIORITY
+device_proto_op_priority (PROTO_OP op)
+{
+    switch (op) {
+    case PROTO_OP_LOAD:  return HTTP_PRIORITY_IMAGE;
+    case PROTO_OP_CHECK: return HTTP_PRIORITY_STATUS;
+    default:             return HTTP_PRIORITY_CONTROL;
+    }
+}
+
 /* Submit operation request
  */
 static void
@@ -384,6 +529,7 @@ device_proto_op_submit (device *dev, PROTO_OP op,
         device_proto_op_name(dev, op), dev->proto_ctx.failed_attempt);
     dev->proto_op_current = op;
     q = func(&dev->proto_ctx);
+    http_query_set_priority(q, device_proto_op_priority(op));
     http_query_submit(q, callback);
     dev->proto_ctx.query = q;
 }
@@ -434,10 +580,16 @@ device_proto_op_decode (device *dev, PROTO_OP op)
 
         dev->proto_ctx.failed_op = op;
         dev->proto_ctx.failed_http_status = http_status;
+        dev->proto_ctx.failed_retry_after =
+            http_query_retry_after(dev->proto_ctx.query);
     }
 
-    if (op == PROTO_OP_CHECK) {
+    /* Operation, retried without status check, counts as
+     * failed attempt as well
+     */
+    if (op == PROTO_OP_CHECK || (result.next == op && result.delay != 0)) {
         dev->proto_ctx.failed_attempt ++;
+        perfstat_retry(dev->devinfo->uuid, dev->endpoint_current->proto);
     }
 
     return result;
@@ -455,6 +607,8 @@ device_http_cancel (device *dev)
         eloop_timer_cancel(dev->stm_timer);
         dev->stm_timer = NULL;
     }
+
+    dev->stm_idle_wait = false;
 }
 
 /* http_client onerror callback
@@ -465,6 +619,13 @@ device_http_onerror (void *ptr, error err) {
 
     log_debug(dev->log, ESTRING(err));
 
+    /* In the IDLE state, only ADF watch may fail. Just keep watching */
+    if (device_stm_state_get(dev) == DEVICE_STM_IDLE) {
+        dev->adf_watch_query = NULL;
+        device_adf_watch_start(dev);
+        return;
+    }
+
     if (!device_stm_cancel_perform(dev, SANE_STATUS_IO_ERROR)) {
         device_stm_state_set(dev, DEVICE_STM_DONE);
     }
@@ -486,6 +647,7 @@ device_probe_endpoint (device *dev, zeroconf_endpoint *endpoint)
     dev->proto_ctx.base_uri = endpoint->uri;
 
     /* Fetch device capabilities */
+    dev->stm_perf_mark = g_get_monotonic_time();
     device_proto_devcaps_submit (dev, device_scanner_capabilities_callback);
 }
 
@@ -511,17 +673,27 @@ device_scanner_capabilities_callback (void *ptr, http_query *q)
         goto DONE;
     }
 
+    perfstat_probe(dev->devinfo->uuid, dev->endpoint_current->proto,
+        (int) ((g_get_monotonic_time() - dev->stm_perf_mark) / 1000));
+
     devcaps_dump(dev->log, &dev->opt.caps);
-    devopt_set_defaults(&dev->opt);
+    devopt_set_defaults(&dev->opt, conf_profile_lookup(dev->devinfo->model));
 
     /* Cleanup and exit */
 DONE:
     if (err != NULL) {
+        zeroconf_endpoint *next = dev->endpoint_current->next;
+
         log_debug(dev->log, ESTRING(err));
 
-        if (dev->endpoint_current != NULL &&
-            dev->endpoint_current->next != NULL) {
-            device_probe_endpoint(dev, dev->endpoint_current->next);
+        /* Protocol fails, if all its endpoints fail */
+        if (next == NULL || next->proto != dev->endpoint_current->proto) {
+            perfstat_failure(dev->devinfo->uuid,
+                dev->endpoint_current->proto);
+        }
+
+        if (next != NULL) {
+            device_probe_endpoint(dev, next);
         } else {
             device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
         }
@@ -601,6 +773,16 @@ device_stm_state_set (device *dev, DEVICE_STM_STATE state)
         if (!device_stm_state_working(dev)) {
             pollable_signal(dev->read_pollable);
         }
+
+        if (state == DEVICE_STM_IDLE || state == DEVICE_STM_PROBING_FAILED) {
+            pollable_signal(dev->stm_open_pollable);
+        }
+
+        /* Dump statistics once per job */
+        if (state == DEVICE_STM_DONE) {
+            memstat_dump(dev->log);
+            decpool_stats_dump(dev->log);
+        }
     }
 }
 
@@ -634,6 +816,7 @@ device_stm_cancel_perform (device *dev, SANE_Status status)
         device_stm_state_set(dev, DEVICE_STM_CANCEL_SENT);
         log_assert(dev->log, dev->stm_cancel_query == NULL);
         dev->stm_cancel_query = ctx->proto->cancel_query(ctx);
+        http_query_set_priority(dev->stm_cancel_query, HTTP_PRIORITY_CONTROL);
         http_query_submit(dev->stm_cancel_query, device_stm_cancel_callback);
 
         return true;
@@ -669,6 +852,105 @@ device_stm_cancel_req (device *dev)
     }
 }
 
+/* Background cleanup query callback
+ */
+static void
+device_stm_cleanup_callback (void *ptr, http_query *q)
+{
+    device *dev = ptr;
+    error  err = http_query_error(q);
+
+    if (err != NULL) {
+        log_debug(dev->log, "background cleanup: %s", ESTRING(err));
+    } else {
+        log_debug(dev->log, "background cleanup: done");
+    }
+
+    /* If the next job waits between status requests, start it now */
+    if (dev->stm_idle_wait && dev->stm_timer != NULL) {
+        eloop_timer_cancel(dev->stm_timer);
+        dev->stm_timer = NULL;
+        device_stm_idle_wait_done(dev);
+    }
+
+    g_cond_broadcast(&dev->stm_cond);
+}
+
+/* Perform PROTO_OP_CLEANUP in background, so the job can be finished
+ * and the next job started without waiting for it.
+ *
+ * Cleanup uses its own http_client, so it survives cancellation
+ * of the device's queries and its errors don't affect the next job
+ */
+static void
+device_stm_cleanup_async (device *dev)
+{
+    proto_ctx  ctx = dev->proto_ctx;
+    http_query *q;
+
+    log_debug(dev->log, "PROTO_OP_CLEANUP: submitting in background");
+
+    ctx.http = dev->stm_cleanup_http;
+    q = ctx.proto->cleanup_query(&ctx);
+    http_query_set_priority(q, HTTP_PRIORITY_CONTROL);
+    http_query_submit(q, device_stm_cleanup_callback);
+}
+
+/* Device became idle, or background cleanup is done, so submit
+ * the job, waiting for it
+ */
+static void
+device_stm_idle_wait_done (device *dev)
+{
+    dev->stm_idle_wait = false;
+
+    /* Job was cancelled while waiting, and it was not created yet */
+    if (device_stm_state_get(dev) == DEVICE_STM_CANCEL_DELAYED) {
+        device_stm_state_set(dev, DEVICE_STM_DONE);
+        return;
+    }
+
+    device_proto_op_submit(dev, PROTO_OP_SCAN, device_stm_op_callback);
+}
+
+/* Idle wait status request callback
+ */
+static void
+device_stm_idle_wait_callback (void *ptr, http_query *q)
+{
+    device      *dev = ptr;
+    SANE_Status status;
+
+    dev->proto_ctx.query = q;
+    status = dev->proto_ctx.proto->idle_status_decode(&dev->proto_ctx);
+
+    if (status == SANE_STATUS_GOOD) {
+        log_debug(dev->log, "device is idle, starting job");
+        device_stm_idle_wait_done(dev);
+    } else if (http_client_num_pending(dev->stm_cleanup_http) == 0) {
+        log_debug(dev->log, "background cleanup done, starting job");
+        device_stm_idle_wait_done(dev);
+    } else {
+        dev->stm_timer = eloop_timer_new(DEVICE_IDLE_WAIT_PAUSE,
+            device_stm_idle_wait_timer_callback, dev);
+    }
+}
+
+/* Request device status, while the next job waits for the
+ * device to become idle
+ */
+static void
+device_stm_idle_wait_timer_callback (void *data)
+{
+    device     *dev = data;
+    http_query *q;
+
+    dev->stm_timer = NULL;
+    q = dev->proto_ctx.proto->status_query(&dev->proto_ctx);
+    http_query_set_priority(q, HTTP_PRIORITY_STATUS);
+    http_query_submit(q, device_stm_idle_wait_callback);
+}
+
 /* stm_timer callback
  */
 static void
@@ -679,6 +961,32 @@ device_stm_timer_callback (void *data)
     device_proto_op_submit(dev, dev->proto_op_current, device_stm_op_callback);
 }
 
+/* Update performance statistics, when job is created (op is
+ * PROTO_OP_SCAN) or page is received (op is PROTO_OP_LOAD)
+ */
+static void
+device_perfstat_update (device *dev, PROTO_OP op, size_t bytes)
+{
+    gint64            now = g_get_monotonic_time();
+    int               ms = (int) ((now - dev->stm_perf_mark) / 1000);
+    ID_PROTO          proto = dev->endpoint_current->proto;
+    proto_scan_params *params = &dev->proto_ctx.params;
+
+    if (op == PROTO_OP_SCAN) {
+        perfstat_job_setup(dev->devinfo->uuid, proto, ms);
+    } else {
+        if (dev->proto_ctx.images_received == 0) {
+            perfstat_first_page(dev->devinfo->uuid, proto,
+                (int) ((now - dev->stm_perf_start) / 1000));
+        }
+
+        perfstat_page(dev->devinfo->uuid, proto, params->colormode,
+            params->format, bytes, ms);
+    }
+
+    dev->stm_perf_mark = now;
+}
+
 /* Operation callback
  */
 static void
@@ -693,9 +1001,23 @@ device_stm_op_callback (void *ptr, http_query *q)
         log_debug(dev->log, "%s", ESTRING(result.err));
     }
 
+    /* If device rejects the job, while cleanup of the previous one
+     * is still in progress, don't overlap cleanup with the next job
+     * anymore
+     */
+    if (dev->proto_op_current == PROTO_OP_SCAN &&
+        result.next == PROTO_OP_CHECK &&
+        !dev->stm_cleanup_sync &&
+        http_client_num_pending(dev->stm_cleanup_http) != 0) {
+        log_debug(dev->log, "job rejected while cleanup in progress; "
+            "switching to synchronous cleanup");
+        dev->stm_cleanup_sync = true;
+    }
+
     /* Save useful result, if any */
     if (dev->proto_op_current == PROTO_OP_SCAN) {
         if (result.data.location != NULL) {
+            device_perfstat_update(dev, PROTO_OP_SCAN, 0);
             g_free((char*) dev->proto_ctx.location); /* Just in case */
             dev->proto_ctx.location = result.data.location;
             dev->proto_ctx.failed_attempt = 0;
@@ -703,7 +1025,13 @@ device_stm_op_callback (void *ptr, http_query *q)
         }
     } else if (dev->proto_op_current == PROTO_OP_LOAD) {
         if (result.data.image != NULL) {
+            device_perfstat_update(dev, PROTO_OP_LOAD,
+                result.data.image->size);
             http_data_queue_push(dev->read_queue, result.data.image);
+            if (dev->read_decpool != NULL) {
+                decpool_queue_submit(dev->read_decpool, result.data.image,
+                    dev->opt.decode_profile);
+            }
             dev->proto_ctx.images_received ++;
             pollable_signal(dev->read_pollable);
 
@@ -716,15 +1044,23 @@ device_stm_op_callback (void *ptr, http_query *q)
     device_job_set_status(dev, result.status);
 
     /* If CANCEL was sent, and next operation is cleanup or
-     * current operation is CHECK, finish the job
+     * current operation is CHECK or delayed retry, finish the job
      */
     if (device_stm_state_cancel_sent(dev)) {
         if (result.next == PROTO_OP_CLEANUP ||
-            dev->proto_op_current == PROTO_OP_CHECK) {
+            dev->proto_op_current == PROTO_OP_CHECK ||
+            (result.next == dev->proto_op_current && result.delay != 0)) {
             result.next = PROTO_OP_FINISH;
         }
     }
 
+    /* Run cleanup in background, if possible */
+    if (result.next == PROTO_OP_CLEANUP && !dev->stm_cleanup_sync &&
+        device_stm_state_get(dev) == DEVICE_STM_SCANNING) {
+        device_stm_cleanup_async(dev);
+        result.next = PROTO_OP_FINISH;
+    }
+
     /* Check for FINISH */
     if (result.next == PROTO_OP_FINISH) {
         if (dev->proto_ctx.images_received == 0) {
@@ -733,6 +1069,11 @@ device_stm_op_callback (void *ptr, http_query *q)
              * error code
              */
             device_job_set_status(dev, SANE_STATUS_IO_ERROR);
+
+            if (dev->job_status == SANE_STATUS_IO_ERROR) {
+                perfstat_failure(dev->devinfo->uuid,
+                    dev->endpoint_current->proto);
+            }
         }
 
         if (device_stm_state_get(dev) == DEVICE_STM_CANCEL_SENT) {
@@ -835,6 +1176,45 @@ device_geom_compute (SANE_Fixed tl, SANE_Fixed br,
     return geom;
 }
 
+/* Choose image format for the scan job
+ *
+ * Format, chosen by the transfer-format option, is used if supported
+ * by the source. In the auto mode, uncompressed BMP is preferred,
+ * if device is reachable via fast link, so decoding will cost
+ * almost nothing. Otherwise, JPEG is used
+ */
+static ID_FORMAT
+device_choose_format (device *dev, devcaps_source *src)
+{
+    unsigned int          formats = src->formats & DEVCAPS_FORMATS_SUPPORTED;
+    ID_FORMAT             fmt = dev->opt.transfer_format;
+    const struct sockaddr *addr;
+
+    if (fmt == ID_FORMAT_UNKNOWN && (formats & (1 << ID_FORMAT_BMP)) != 0) {
+        int speed = -1;
+
+        addr = http_uri_addr(dev->proto_ctx.base_uri);
+        if (addr != NULL) {
+            speed = netif_link_speed(addr);
+        }
+
+        log_debug(dev->log, "link speed: %d Mbit/s", speed);
+        if (speed >= DEVICE_BMP_LINK_SPEED) {
+            fmt = ID_FORMAT_BMP;
+        }
+    }
+
+    if (fmt != ID_FORMAT_UNKNOWN && (formats & (1 << fmt)) != 0) {
+        return fmt;
+    }
+
+    if ((formats & (1 << ID_FORMAT_JPEG)) != 0) {
+        return ID_FORMAT_JPEG;
+    }
+
+    return ID_FORMAT_PDF;
+}
+
 /* Request scan
  */
 static void
@@ -868,12 +1248,16 @@ device_stm_start_scan (device *dev)
     params->y_res = y_resolution;
     params->src = dev->opt.src;
     params->colormode = dev->opt.colormode;
+    params->format = device_choose_format(dev, src);
+    params->scanintent = dev->opt.scanintent;
 
     /* Dump parameters */
     log_trace(dev->log, "==============================");
     log_trace(dev->log, "Starting scan, using the following parameters:");
     log_trace(dev->log, "  source:         %s", id_source_sane_name(params->src));
     log_trace(dev->log, "  colormode:      %s", id_colormode_sane_name(params->colormode));
+    log_trace(dev->log, "  format:         %s", id_format_mime_name(params->format));
+    log_trace(dev->log, "  scan intent:    %s", id_scanintent_sane_name(params->scanintent));
     log_trace(dev->log, "  tl_x:           %s mm", math_fmt_mm(dev->opt.tl_x, buf));
     log_trace(dev->log, "  tl_y:           %s mm", math_fmt_mm(dev->opt.tl_y, buf));
     log_trace(dev->log, "  br_x:           %s mm", math_fmt_mm(dev->opt.br_x, buf));
@@ -886,8 +1270,21 @@ device_stm_start_scan (device *dev)
     log_trace(dev->log, "");
 
     /* Submit a request */
+    dev->stm_perf_mark = dev->stm_perf_start = g_get_monotonic_time();
     device_stm_state_set(dev, DEVICE_STM_SCANNING);
-    device_proto_op_submit(dev, PROTO_OP_SCAN, device_stm_op_callback);
+
+    /* If cleanup of the previous job is still in progress, and
+     * protocol allows, start the job as soon as device reports idle
+     */
+    if (http_client_num_pending(dev->stm_cleanup_http) != 0 &&
+        dev->proto_ctx.proto->idle_status_decode != NULL) {
+        log_debug(dev->log, "background cleanup pending, "
+            "waiting for device to become idle");
+        dev->stm_idle_wait = true;
+        device_stm_idle_wait_timer_callback(dev);
+    } else {
+        device_proto_op_submit(dev, PROTO_OP_SCAN, device_stm_op_callback);
+    }
 }
 
 /* Wait until device leaves the working state
@@ -940,8 +1337,115 @@ device_job_set_status (device *dev, SANE_Status status)
         dev->job_status = status;
 
         if (status == SANE_STATUS_CANCELLED) {
-            http_data_queue_purge(dev->read_queue);
+            device_read_queue_purge(dev);
+        }
+    }
+}
+
+/* Reset job state before starting a new job
+ */
+static void
+device_job_reset (device *dev)
+{
+    dev->job_status = SANE_STATUS_GOOD;
+    g_free((char*) dev->proto_ctx.location);
+    dev->proto_ctx.location = NULL;
+    dev->proto_ctx.failed_op = PROTO_OP_NONE;
+    dev->proto_ctx.failed_retry_after = -1;
+    dev->proto_ctx.failed_attempt = 0;
+    dev->proto_ctx.images_received = 0;
+}
+
+/******************** Continuous ADF mode ********************/
+/* In the continuous ADF mode, when ADF job ends because documents
+ * are exhausted, device keeps polling scanner status while IDLE,
+ * and starts a new job as soon as documents are loaded into ADF
+ * again. Next sane_start() then finds this job already running,
+ * and synchronizes with it, as with the previous job
+ */
+
+/* Check if ADF watch is applicable to the device with current options
+ */
+static bool
+device_adf_watch_enabled (device *dev)
+{
+    return conf.continuous_adf &&
+        dev->opt.src != ID_SOURCE_PLATEN &&
+        dev->opt.params.lines != 0 &&
+        dev->opt.params.pixels_per_line != 0 &&
+        dev->proto_ctx.proto->adf_status_decode != NULL;
+}
+
+/* ADF status request callback
+ */
+static void
+device_adf_watch_callback (void *ptr, http_query *q)
+{
+    device      *dev = ptr;
+    SANE_Status status;
+
+    dev->adf_watch_query = NULL;
+    dev->proto_ctx.query = q;
+    status = dev->proto_ctx.proto->adf_status_decode(&dev->proto_ctx);
+
+    switch (status) {
+    case SANE_STATUS_GOOD:
+        if (device_adf_watch_enabled(dev)) {
+            log_debug(dev->log, "ADF watch: documents loaded, starting job");
+            device_job_reset(dev);
+            dev->adf_watch_job = true;
+            device_stm_start_scan(dev);
         }
+        break;
+
+    case SANE_STATUS_UNSUPPORTED:
+        log_debug(dev->log, "ADF watch: ADF state not reported, stopped");
+        break;
+
+    default:
+        device_adf_watch_start(dev);
+    }
+}
+
+/* ADF watch timer callback
+ */
+static void
+device_adf_watch_timer_callback (void *data)
+{
+    device *dev = data;
+
+    dev->adf_watch_timer = NULL;
+    dev->adf_watch_query = dev->proto_ctx.proto->status_query(&dev->proto_ctx);
+    http_query_set_priority(dev->adf_watch_query, HTTP_PRIORITY_STATUS);
+    http_query_submit(dev->adf_watch_query, device_adf_watch_callback);
+}
+
+/* Start watching the ADF, if continuous ADF mode is enabled
+ */
+static void
+device_adf_watch_start (device *dev)
+{
+    if (device_adf_watch_enabled(dev) &&
+        dev->adf_watch_timer == NULL && dev->adf_watch_query == NULL) {
+        dev->adf_watch_timer = eloop_timer_new(DEVICE_ADF_WATCH_PAUSE,
+            device_adf_watch_timer_callback, dev);
+    }
+}
+
+/* Stop watching the ADF
+ */
+static void
+device_adf_watch_stop (device *dev)
+{
+    if (dev->adf_watch_timer != NULL) {
+        eloop_timer_cancel(dev->adf_watch_timer);
+        dev->adf_watch_timer = NULL;
+    }
+
+    /* Device is IDLE, so it is the only pending query */
+    if (dev->adf_watch_query != NULL) {
+        http_client_cancel(dev->proto_ctx.http);
+        dev->adf_watch_query = NULL;
     }
 }
 
@@ -954,21 +1458,113 @@ device_log_ctx (device *dev)
     return dev ? dev->log : NULL;
 }
 
-/* Open a device
+/* Finish device lookup, deferred by device_open_start() until
+ * initial scan is done. Called by stm_open_event
+ */
+static void
+device_open_lookup_callback (void *data)
+{
+    device           *dev = data;
+    zeroconf_devinfo *devinfo = NULL, *old = dev->devinfo;
+    char             *ident = dev->stm_open_ident, *first = NULL;
+    SANE_Status      status = SANE_STATUS_INVAL;
+    bool             pending;
+
+    if (ident == NULL) {
+        return;
+    }
+
+    /* Empty ident means the first device */
+    if (*ident == '\0') {
+        ident = first = zeroconf_device_first_ident();
+    }
+
+    if (ident == NULL) {
+        log_debug(dev->log, "device_open: no devices found");
+    } else if (device_find_by_ident(ident) != NULL) {
+        status = SANE_STATUS_DEVICE_BUSY;
+    } else {
+        devinfo = zeroconf_devinfo_lookup_nowait(ident, &pending);
+        if (devinfo == NULL) {
+            log_debug(dev->log, "device_open(%s): device not found", ident);
+        }
+    }
+
+    g_free(first);
+    g_free(dev->stm_open_ident);
+    dev->stm_open_ident = NULL;
+
+    /* Replace placeholder device info and start probing */
+    if (devinfo != NULL) {
+        dev->devinfo = devinfo;
+        log_ctx_set_name(dev->log, devinfo->name);
+        zeroconf_devinfo_free(old);
+
+        status = device_io_start(dev);
+    }
+
+    if (status != SANE_STATUS_GOOD) {
+        dev->stm_open_status = status;
+        device_stm_state_set(dev, DEVICE_STM_PROBING_FAILED);
+    }
+}
+
+/* Create a device, which lookup is deferred until initial scan
+ * is done. The device is created in the probing state with the
+ * placeholder device info, and device_open_lookup_callback()
+ * finishes the job
+ */
+static device*
+device_open_deferred (const char *ident, SANE_Status *status)
+{
+    device           *dev;
+    zeroconf_devinfo *devinfo;
+
+    devinfo = g_new0(zeroconf_devinfo, 1);
+    memstat_alloc(MEMSTAT_ZEROCONF, sizeof(zeroconf_devinfo));
+    devinfo->name = g_strdup(*ident ? ident : "default");
+    devinfo->model = g_strdup(devinfo->name);
+
+    dev = device_new(devinfo);
+    dev->stm_open_ident = g_strdup(ident);
+    dev->stm_open_event = eloop_event_new(device_open_lookup_callback, dev);
+
+    if (dev->stm_open_pollable == NULL || dev->stm_open_event == NULL) {
+        device_free(dev);
+        *status = SANE_STATUS_NO_MEM;
+        return NULL;
+    }
+
+    log_debug(dev->log, "device lookup deferred until initial scan is done");
+
+    device_stm_state_set(dev, DEVICE_STM_PROBING);
+    zeroconf_initscan_notify(dev->stm_open_event);
+
+    return dev;
+}
+
+/* Start opening a device. If ident is NULL or empty, the first
+ * device is opened
+ *
+ * On success, returns device in the probing state. Use
+ * device_open_finish() to wait for completion of probing
+ *
+ * This function never waits for the initial scan for devices:
+ * if device cannot be found yet, its lookup is deferred and
+ * performed by the event loop, when the initial scan is done
  */
 device*
-device_open (const char *ident, SANE_Status *status)
+device_open_start (const char *ident, SANE_Status *status)
 {
     device           *dev = NULL;
     zeroconf_devinfo *devinfo;
+    bool             pending;
 
     *status = SANE_STATUS_GOOD;
 
-    /* Validate arguments */
+    /* The first device can only be chosen, when list is complete */
     if (ident == NULL || *ident == '\0') {
-        log_debug(dev->log, "device_open: invalid name");
-        *status = SANE_STATUS_INVAL;
-        return NULL;
+        return device_open_deferred("", status);
     }
 
     /* Already opened? */
@@ -979,8 +1575,12 @@ device_open (const char *ident, SANE_Status *status)
     }
 
     /* Obtain device endpoints */
-    devinfo = zeroconf_devinfo_lookup(ident);
+    devinfo = zeroconf_devinfo_lookup_nowait(ident, &pending);
     if (devinfo == NULL) {
+        if (pending) {
+            return device_open_deferred(ident, status);
+        }
+
         log_debug(NULL, "device_open(%s): device not found", ident);
         *status = SANE_STATUS_INVAL;
         return NULL;
@@ -994,18 +1594,44 @@ device_open (const char *ident, SANE_Status *status)
         dev = NULL;
     }
 
-    /* Wait until device is initialized */
+    return dev;
+}
+
+/* Get file descriptor, that becomes readable when probing,
+ * started by device_open_start(), is finished
+ */
+int
+device_open_get_fd (device *dev)
+{
+    return pollable_get_fd(dev->stm_open_pollable);
+}
+
+/* Finish opening a device
+ *
+ * If wait is true, waits until probing is finished. Otherwise,
+ * returns SANE_STATUS_DEVICE_BUSY if it is still in progress.
+ * If lookup or probing has failed, device is destroyed and error
+ * status is returned
+ */
+SANE_Status
+device_open_finish (device *dev, bool wait)
+{
+    /* Wait until device is initialized */
     while (device_stm_state_get(dev) == DEVICE_STM_PROBING) {
+        if (!wait) {
+            return SANE_STATUS_DEVICE_BUSY;
+        }
+
         eloop_cond_wait(&dev->stm_cond);
     }
 
     if (device_stm_state_get(dev) == DEVICE_STM_PROBING_FAILED) {
+        SANE_Status status = dev->stm_open_status;
         device_free(dev);
-        dev = NULL;
-        *status = SANE_STATUS_IO_ERROR;
+        return status;
     }
 
-    return dev;
+    return SANE_STATUS_GOOD;
 }
 
 /* Close the device
@@ -1018,6 +1644,11 @@ device_close (device *dev)
         device_stm_cancel_wait(dev);
     }
 
+    /* Let background cleanup to finish */
+    while (http_client_num_pending(dev->stm_cleanup_http) != 0) {
+        eloop_cond_wait(&dev->stm_cond);
+    }
+
     /* Close the device */
     device_stm_state_set(dev, DEVICE_STM_CLOSED);
     device_free(dev);
@@ -1043,6 +1674,32 @@ device_get_option (device *dev, SANE_Int option, void *value)
     return devopt_get_option(&dev->opt, option, value);
 }
 
+/* Check if option value, being set, equals its current value
+ */
+static bool
+device_option_unchanged (device *dev, SANE_Int option, const void *value)
+{
+    const SANE_Option_Descriptor *desc = &dev->opt.desc[option];
+    void                         *current;
+    bool                         unchanged = false;
+
+    if (desc->size <= 0) {
+        return false;
+    }
+
+    current = g_malloc0(desc->size);
+    if (devopt_get_option(&dev->opt, option, current) == SANE_STATUS_GOOD) {
+        if (desc->type == SANE_TYPE_STRING) {
+            unchanged = !strncmp(current, value, desc->size);
+        } else {
+            unchanged = !memcmp(current, value, desc->size);
+        }
+    }
+    g_free(current);
+
+    return unchanged;
+}
+
 /* Set device option
  */
 SANE_Status
@@ -1053,6 +1710,15 @@ device_set_option (device *dev, SANE_Int option, void *value, SANE_Word *info)
         return SANE_STATUS_INVAL;
     }
 
+    /* Job, started by ADF watch, uses current options, and feeder
+     * may already have pulled the paper, so these options cannot be
+     * changed until its pages are read
+     */
+    if (dev->adf_watch_job && !device_option_unchanged(dev, option, value)) {
+        log_debug(dev->log, "device_set_option: ADF watch job is active");
+        return SANE_STATUS_DEVICE_BUSY;
+    }
+
     return devopt_set_option(&dev->opt, option, value, info);
 }
 
@@ -1082,12 +1748,8 @@ device_start_do (gpointer data)
 static SANE_Status
 device_start_new_job (device *dev)
 {
-    dev->job_status = SANE_STATUS_GOOD;
-    g_free((char*) dev->proto_ctx.location);
-    dev->proto_ctx.location = NULL;
-    dev->proto_ctx.failed_op = PROTO_OP_NONE;
-    dev->proto_ctx.failed_attempt = 0;
-    dev->proto_ctx.images_received = 0;
+    device_adf_watch_stop(dev);
+    device_job_reset(dev);
 
     eloop_call(device_start_do, dev);
 
@@ -1117,6 +1779,7 @@ device_start (device *dev)
     }
 
     /* Update state */
+    dev->adf_watch_job = false;
     dev->flags |= DEVICE_SCANNING;
     pollable_reset(dev->read_pollable);
     dev->read_non_blocking = SANE_FALSE;
@@ -1152,6 +1815,9 @@ device_start (device *dev)
     if (dev->job_status != SANE_STATUS_GOOD &&
         dev->job_status != SANE_STATUS_CANCELLED) {
         dev->flags &= ~DEVICE_SCANNING;
+        if (dev->job_status == SANE_STATUS_NO_DOCS) {
+            device_adf_watch_start(dev);
+        }
         return dev->job_status;
     }
 
@@ -1196,7 +1862,191 @@ device_get_select_fd (device *dev, SANE_Int *fd)
 }
 
 
+/******************** Page thumbnails ********************/
+/* Release thumbnail buffers
+ */
+static void
+device_thumb_free (device *dev)
+{
+    if (dev->thumb_buf != NULL) {
+        memstat_free(MEMSTAT_DEVICE, dev->thumb_mem);
+        g_free(dev->thumb_buf);
+        g_free(dev->thumb_acc);
+        dev->thumb_buf = NULL;
+        dev->thumb_acc = NULL;
+    }
+
+    dev->thumb_ready = false;
+}
+
+/* Prepare thumbnail generation for the new page
+ *
+ * Thumbnail is box-filtered from the decoded lines as they pass
+ * through the line filter chain, so it comes at almost no cost
+ * and is ready as soon as the last line of the page is decoded
+ */
+static void
+device_thumb_begin (device *dev)
+{
+    const SANE_Parameters *params = &dev->opt.params;
+    int                   bpp, wid, hei, scale;
+    size_t                acc_len;
+
+    device_thumb_free(dev);
+
+    /* Thumbnails are made only if requested, and only 8-bit
+     * images are supported
+     */
+    if (!dev->thumb_enabled || params->depth != 8 || params->pixels_per_line <= 0 ||
+        params->lines <= 0) {
+        return;
+    }
+
+    bpp = params->format == SANE_FRAME_RGB ? 3 : 1;
+    scale = math_max(params->pixels_per_line, params->lines);
+    scale = (scale + DEVICE_THUMB_SIZE - 1) / DEVICE_THUMB_SIZE;
+    wid = (params->pixels_per_line + scale - 1) / scale;
+    hei = (params->lines + scale - 1) / scale;
+
+    dev->thumb_params = *params;
+    dev->thumb_params.last_frame = SANE_TRUE;
+    dev->thumb_params.pixels_per_line = wid;
+    dev->thumb_params.lines = hei;
+    dev->thumb_params.bytes_per_line = wid * bpp;
+    dev->thumb_scale = scale;
+
+    acc_len = wid * bpp;
+    dev->thumb_buf = g_malloc((size_t) acc_len * hei);
+    memset(dev->thumb_buf, 0xff, (size_t) acc_len * hei);
+    dev->thumb_acc = g_new0(uint32_t, acc_len);
+    dev->thumb_mem = acc_len * hei + acc_len * sizeof(uint32_t);
+    dev->thumb_line_num = 0;
+    dev->thumb_lines = params->lines;
+    memstat_alloc(MEMSTAT_DEVICE, dev->thumb_mem);
+}
+
+/* Feed decoded image line into the thumbnail box filter. Called
+ * by the tap filter at the end of the line filter chain
+ *
+ * The line may be shorter than bytes_per_line, missing
+ * pixels are considered white. White lines, added by clipping
+ * rather than delivered by the decoder, are not counted, and
+ * the rest of thumbnail remains white
+ */
+static void
+device_thumb_line (void *ptr, const uint8_t *line, size_t len)
+{
+    device                *dev = ptr;
+    const SANE_Parameters *tp = &dev->thumb_params;
+    int                   ppl = dev->opt.params.pixels_per_line;
+    int                   n = dev->thumb_line_num;
+    int                   scale = dev->thumb_scale;
+    int                   bpp, avail, x, tx, c, rows;
+    uint32_t              *acc = dev->thumb_acc;
+    SANE_Byte             *out;
+
+    if (dev->thumb_buf == NULL ||
+        dev->read_line_num < dev->read_skip_lines ||
+        dev->read_line_num >= dev->read_line_end ||
+        n >= dev->thumb_lines) {
+        return;
+    }
+
+    dev->thumb_line_num ++;
+
+    bpp = tp->bytes_per_line / tp->pixels_per_line;
+    avail = math_min(ppl, len / bpp);
+
+    /* Accumulate the line */
+    for (x = 0, tx = 0; tx < tp->pixels_per_line; tx ++) {
+        int end = math_min(x + scale, ppl);
+
+        for (; x < end; x ++) {
+            for (c = 0; c < bpp; c ++) {
+                acc[tx * bpp + c] += x < avail ? line[x * bpp + c] : 0xff;
+            }
+        }
+    }
+
+    /* Flush accumulated row, if complete */
+    if ((n + 1) % scale != 0 && n + 1 != dev->thumb_lines) {
+        return;
+    }
+
+    rows = n % scale + 1;
+    out = dev->thumb_buf + (n / scale) * tp->bytes_per_line;
+
+    for (tx = 0; tx < tp->pixels_per_line; tx ++) {
+        uint32_t div = rows * math_min(scale, ppl - tx * scale);
+
+        for (c = 0; c < bpp; c ++) {
+            out[tx * bpp + c] = (acc[tx * bpp + c] + div / 2) / div;
+        }
+    }
+
+    memset(acc, 0, tp->bytes_per_line * sizeof(uint32_t));
+
+    if (n + 1 == dev->thumb_lines) {
+        dev->thumb_ready = true;
+    }
+}
+
+/* Get thumbnail of the last page
+ */
+SANE_Status
+device_get_thumbnail (device *dev, SANE_Parameters *params,
+        SANE_Byte *data, SANE_Int max_len)
+{
+    SANE_Int len;
+
+    /* The first call enables thumbnails for subsequent pages */
+    dev->thumb_enabled = true;
+
+    if (!dev->thumb_ready) {
+        log_debug(dev->log, "device_get_thumbnail: thumbnail not ready");
+        return SANE_STATUS_INVAL;
+    }
+
+    *params = dev->thumb_params;
+    len = params->bytes_per_line * params->lines;
+    if (max_len < len) {
+        return SANE_STATUS_NO_MEM;
+    }
+
+    memcpy(data, dev->thumb_buf, len);
+
+    return SANE_STATUS_GOOD;
+}
+
 /******************** Read machinery ********************/
+/* Purge queue of received images
+ */
+static void
+device_read_queue_purge (device *dev)
+{
+    http_data_queue_purge(dev->read_queue);
+    if (dev->read_decpool != NULL) {
+        decpool_queue_purge(dev->read_decpool);
+    }
+}
+
+/* Choose decoder for the image
+ */
+static image_decoder*
+device_read_decoder_choose (device *dev, const http_data *image)
+{
+    switch (id_format_detect(image->bytes, image->size)) {
+    case ID_FORMAT_PDF:
+        return dev->read_decoder_pdf;
+
+    case ID_FORMAT_BMP:
+        return dev->read_decoder_bmp;
+
+    default:
+        return dev->read_decoder_jpeg;
+    }
+}
+
 /* Pull next image from the read queue and start decoding
  */
 static SANE_Status
@@ -1204,18 +2054,46 @@ device_read_next (device *dev)
 {
     error           err;
     size_t          line_capacity;
-    SANE_Parameters params;
-    image_decoder   *decoder = dev->read_decoder_jpeg;
-    int             wid, hei;
+    SANE_Parameters params, fparams;
+    image_decoder   *decoder;
+    int             wid, hei, bpp;
+    const void      *data;
+    size_t          size;
 
     dev->read_image = http_data_queue_pull(dev->read_queue);
     if (dev->read_image == NULL) {
         return SANE_STATUS_EOF;
     }
 
+    data = dev->read_image->bytes;
+    size = dev->read_image->size;
+
+    /* Choose decoder. Recognize PDF and BMP by signature, as
+     * scanners are not always accurate with Content-Type
+     *
+     * If image was submitted to the decode pool, use its
+     * result instead
+     */
+    decoder = device_read_decoder_choose(dev, dev->read_image);
+
+    if (dev->read_decpool != NULL) {
+        dev->read_task = decpool_queue_take(dev->read_decpool,
+            dev->read_image);
+    }
+
+    if (dev->read_task != NULL) {
+        decoder = dev->read_decoder_raw;
+        err = decpool_task_wait(dev->read_task, &data, &size);
+        if (err != NULL) {
+            goto DONE;
+        }
+    }
+
+    dev->read_decoder = decoder;
+
     /* Start new image decoding */
-    err = image_decoder_begin(decoder,
-            dev->read_image->bytes, dev->read_image->size);
+    image_decoder_set_profile(decoder, dev->opt.decode_profile);
+    err = image_decoder_begin(decoder, data, size);
 
     if (err != NULL) {
         goto DONE;
@@ -1223,12 +2101,35 @@ device_read_next (device *dev)
 
     /* Obtain and validate image parameters */
     image_decoder_get_params(decoder, &params);
+    bpp = image_decoder_get_bytes_per_pixel(decoder);
+
+    /* Setup line filters. Some scanners return color image,
+     * when asked for grayscale, so convert it here
+     */
+    dev->read_filters = filter_chain_free(dev->read_filters);
     if (params.format != dev->opt.params.format) {
-        /* This is what we cannot handle */
-        err = ERROR("Unexpected image format");
-        goto DONE;
+        if (params.format == SANE_FRAME_RGB &&
+            dev->opt.params.format == SANE_FRAME_GRAY) {
+            dev->read_filters = filter_chain_push(dev->read_filters,
+                filter_gray_new());
+        } else {
+            /* This is what we cannot handle */
+            err = ERROR("Unexpected image format");
+            goto DONE;
+        }
+    }
+
+    device_thumb_begin(dev);
+    if (dev->thumb_buf != NULL) {
+        dev->read_filters = filter_chain_push(dev->read_filters,
+            filter_tap_new(device_thumb_line, dev));
     }
 
+    fparams = params;
+    fparams.pixels_per_line = dev->opt.params.pixels_per_line;
+    fparams.bytes_per_line = fparams.pixels_per_line * bpp;
+    filter_chain_begin(dev->read_filters, &fparams);
+
     wid = params.pixels_per_line;
     hei = params.lines;
 
@@ -1248,10 +2149,10 @@ device_read_next (device *dev)
         /* Trivial case - just skip everything */
         dev->read_skip_lines = hei;
         dev->read_skip_bytes = 0;
+        dev->read_line_len = 0;
         line_capacity = dev->opt.params.bytes_per_line;
     } else {
         image_window win;
-        int          bpp = image_decoder_get_bytes_per_pixel(decoder);
 
         win.x_off = dev->job_skip_x;
         win.y_off = dev->job_skip_y;
@@ -1273,17 +2174,29 @@ device_read_next (device *dev)
             dev->read_skip_lines = dev->job_skip_y - win.y_off;
         }
 
+        dev->read_line_len = win.wid * bpp;
         line_capacity = math_max(dev->opt.params.bytes_per_line, wid * bpp);
     }
 
+    /* Filters see a full line of the decoded image format */
+    if (dev->read_filters != NULL) {
+        line_capacity = math_max(line_capacity,
+            dev->read_skip_bytes + fparams.bytes_per_line);
+    }
+
     /* Initialize image decoding */
     dev->read_line_buf = g_malloc(line_capacity);
+    dev->read_line_cap = line_capacity;
     memset(dev->read_line_buf, 0xff, line_capacity);
+    memstat_alloc(MEMSTAT_DEVICE, line_capacity);
 
     dev->read_line_num = 0;
     dev->read_line_off = dev->opt.params.bytes_per_line;
     dev->read_line_end = hei - dev->read_skip_lines;
 
+    dev->thumb_lines = math_min(dev->read_line_end, dev->opt.params.lines);
+    dev->thumb_lines = math_max(dev->thumb_lines - dev->read_skip_lines, 0);
+
     /* Wake up reader */
     pollable_signal(dev->read_pollable);
 
@@ -1322,23 +2235,68 @@ device_read_decode_line (device *dev)
     }
 
     if (n < dev->read_skip_lines || n >= dev->read_line_end) {
-        memset(dev->read_line_buf, 0xff, dev->opt.params.bytes_per_line);
+        memset(dev->read_line_buf, 0xff, dev->read_filters != NULL ?
+            dev->read_line_cap : (size_t) dev->opt.params.bytes_per_line);
     } else {
-        error err = image_decoder_read_line(dev->read_decoder_jpeg,
+        error err = image_decoder_read_line(dev->read_decoder,
                 dev->read_line_buf);
 
         if (err != NULL) {
             log_debug(dev->log, ESTRING(err));
             return SANE_STATUS_IO_ERROR;
         }
+
+        /* Filters work in place, so the line tail, not covered by
+         * the image, may contain garbage from the previous line
+         */
+        if (dev->read_filters != NULL &&
+            dev->read_line_len < dev->read_line_cap) {
+            memset(dev->read_line_buf + dev->read_line_len, 0xff,
+                dev->read_line_cap - dev->read_line_len);
+        }
     }
 
+    /* Pass the line through filters, in a single pass */
+    filter_chain_apply(dev->read_filters,
+        dev->read_line_buf + dev->read_skip_bytes,
+        dev->opt.params.pixels_per_line);
+
     dev->read_line_off = dev->read_skip_bytes;
     dev->read_line_num ++;
 
     return SANE_STATUS_GOOD;
 }
 
+/* Wait for the next image
+ *
+ * Returns SANE_STATUS_GOOD, if image is available in the read queue,
+ * or final status of the job. In non-blocking mode may also return
+ * SANE_STATUS_GOOD with empty queue, if image is not available yet
+ */
+static SANE_Status
+device_read_wait (device *dev, bool non_blocking)
+{
+    while (device_stm_state_working(dev) &&
+           http_data_queue_empty(dev->read_queue)) {
+        if (non_blocking) {
+            return SANE_STATUS_GOOD;
+        }
+
+        eloop_cond_wait(&dev->stm_cond);
+    }
+
+    if (dev->job_status == SANE_STATUS_CANCELLED) {
+        return SANE_STATUS_CANCELLED;
+    }
+
+    if (http_data_queue_empty(dev->read_queue)) {
+        log_assert(dev->log, dev->job_status != SANE_STATUS_GOOD);
+        return dev->job_status;
+    }
+
+    return SANE_STATUS_GOOD;
+}
+
 /* Read scanned image
  */
 SANE_Status
@@ -1363,30 +2321,19 @@ device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len_out)
 
     /* Wait until device is ready */
     if (dev->read_image == NULL) {
-        while (device_stm_state_working(dev) &&
-               http_data_queue_empty(dev->read_queue)) {
-            if (dev->read_non_blocking) {
-                *len_out = 0;
-                return SANE_STATUS_GOOD;
-            }
-
-            eloop_cond_wait(&dev->stm_cond);
+        status = device_read_wait(dev, dev->read_non_blocking);
+        if (status == SANE_STATUS_GOOD &&
+            !http_data_queue_empty(dev->read_queue)) {
+            status = device_read_next(dev);
         }
 
-        if (dev->job_status == SANE_STATUS_CANCELLED) {
-            status = SANE_STATUS_CANCELLED;
+        if (status != SANE_STATUS_GOOD) {
             goto DONE;
         }
 
-        if (http_data_queue_empty(dev->read_queue)) {
-            status = dev->job_status;
-            log_assert(dev->log, status != SANE_STATUS_GOOD);
-            goto DONE;
-        }
-
-        status = device_read_next(dev);
-        if (status != SANE_STATUS_GOOD) {
-            goto DONE;
+        if (dev->read_image == NULL) {
+            *len_out = 0;
+            return SANE_STATUS_GOOD;
         }
     }
 
@@ -1421,19 +2368,237 @@ DONE:
         return SANE_STATUS_GOOD;
     }
 
-    /* Scan and read finished - cleanup device */
+    return device_read_finish(dev, status);
+}
+
+/******************** Zero-copy page delivery ********************/
+/* Create memfd of the given size and map it for writing
+ */
+static int
+device_page_memfd_create (device *dev, size_t size, unsigned char **mem)
+{
+    int fd = memfd_create("airscan-page", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+    if (fd < 0) {
+        log_debug(dev->log, "memfd_create: %s", strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        log_debug(dev->log, "memfd: ftruncate: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    *mem = NULL;
+    if (size != 0) {
+        *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (*mem == MAP_FAILED) {
+            log_debug(dev->log, "memfd: mmap: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    return fd;
+}
+
+/* Unmap memfd and seal it, so frontend will get immutable page
+ */
+static int
+device_page_memfd_seal (device *dev, int fd, unsigned char *mem, size_t size)
+{
+    int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+    if (mem != NULL) {
+        munmap(mem, size);
+    }
+
+    if (fcntl(fd, F_ADD_SEALS, seals) < 0) {
+        log_debug(dev->log, "memfd: F_ADD_SEALS: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Decode page lines directly into the memfd mapping
+ *
+ * Lines, that don't need clipping, padding or filtering, are written
+ * by decoder directly into the mapping, others go through the
+ * read_line_buf, as in device_read()
+ */
+static SANE_Status
+device_read_page_decode (device *dev, unsigned char *mem, size_t size)
+{
+    size_t      bpl = dev->opt.params.bytes_per_line;
+    size_t      sz = math_min(bpl, dev->read_line_cap - dev->read_skip_bytes);
+    bool        direct;
+    size_t      off;
+    SANE_Status status = SANE_STATUS_GOOD;
+
+    direct = dev->read_filters == NULL && dev->read_skip_bytes == 0 &&
+             dev->read_line_len <= bpl;
+
+    for (off = 0; off < size && status == SANE_STATUS_GOOD; off += bpl) {
+        SANE_Int n = dev->read_line_num;
+
+        if (direct && n >= dev->read_skip_lines && n < dev->read_line_end) {
+            error err = image_decoder_read_line(dev->read_decoder, mem + off);
+
+            if (err != NULL) {
+                log_debug(dev->log, ESTRING(err));
+                status = SANE_STATUS_IO_ERROR;
+                break;
+            }
+
+            memset(mem + off + dev->read_line_len, 0xff,
+                bpl - dev->read_line_len);
+            dev->read_line_num ++;
+        } else {
+            status = device_read_decode_line(dev);
+            if (status == SANE_STATUS_GOOD) {
+                memcpy(mem + off, dev->read_line_buf + dev->read_skip_bytes,
+                    sz);
+                memset(mem + off + sz, 0xff, bpl - sz);
+            }
+        }
+    }
+
+    return status;
+}
+
+/* Read the whole next page into the sealed memfd
+ *
+ * If compressed is true, page is delivered as it was received from
+ * the device, without decoding it. Otherwise, page is decoded and
+ * clipped exactly the same way as sane_read() would do it. In both
+ * cases, params are the same as returned by sane_get_parameters(),
+ * but geometry of the compressed image may slightly differ from them
+ *
+ * This function always blocks, regardless of I/O mode, and finishes
+ * the page, so sane_start() needs to be called to get the next one.
+ * It cannot be mixed with device_read() within the same page
+ */
+SANE_Status
+device_read_page_memfd (device *dev, SANE_Bool compressed,
+        int *fd_out, SANE_Parameters *params)
+{
+    SANE_Status   status;
+    size_t        size;
+    unsigned char *mem;
+    int           fd;
+
+    *fd_out = -1;
+
+    /* Check device state */
+    if ((dev->flags & DEVICE_READING) == 0) {
+        log_debug(dev->log, "device_read_page_memfd: not scanning");
+        return SANE_STATUS_INVAL;
+    }
+
+    if (dev->read_image != NULL) {
+        log_debug(dev->log, "device_read_page_memfd: page already being read");
+        return SANE_STATUS_INVAL;
+    }
+
+    /* Wait until device is ready */
+    status = device_read_wait(dev, false);
+    if (status == SANE_STATUS_GOOD && !compressed) {
+        status = device_read_next(dev);
+    }
+
+    if (status != SANE_STATUS_GOOD) {
+        return device_read_finish(dev, status);
+    }
+
+    /* Compressed page is not decoded, so drop its decode pool
+     * task, if any
+     */
+    *params = dev->opt.params;
+    if (compressed) {
+        dev->read_image = http_data_queue_pull(dev->read_queue);
+        if (dev->read_decpool != NULL) {
+            dev->read_task = decpool_queue_take(dev->read_decpool,
+                dev->read_image);
+        }
+
+        size = dev->read_image->size;
+    } else {
+        size = (size_t) params->bytes_per_line * params->lines;
+    }
+
+    /* Create and fill the memfd */
+
+    fd = device_page_memfd_create(dev, size, &mem);
+    if (fd < 0) {
+        status = SANE_STATUS_NO_MEM;
+        goto FAIL;
+    }
+
+    if (compressed) {
+        memcpy(mem, dev->read_image->bytes, size);
+    } else {
+        status = device_read_page_decode(dev, mem, size);
+        if (status != SANE_STATUS_GOOD) {
+            munmap(mem, size);
+            close(fd);
+            goto FAIL;
+        }
+    }
+
+    fd = device_page_memfd_seal(dev, fd, mem, size);
+    if (fd < 0) {
+        status = SANE_STATUS_IO_ERROR;
+        goto FAIL;
+    }
+
+    log_debug(dev->log, "page delivered via memfd: %zu bytes, %s",
+        size, compressed ? "compressed" : "decoded");
+
+    *fd_out = fd;
+    device_read_finish(dev, SANE_STATUS_EOF);
+
+    return SANE_STATUS_GOOD;
+
+FAIL:
+    if (status == SANE_STATUS_IO_ERROR) {
+        device_job_set_status(dev, SANE_STATUS_IO_ERROR);
+        device_cancel(dev);
+    }
+
+    return device_read_finish(dev, status);
+}
+
+/* Finish reading - cleanup device. Returns status
+ */
+static SANE_Status
+device_read_finish (device *dev, SANE_Status status)
+{
     dev->flags &= ~(DEVICE_SCANNING | DEVICE_READING);
-    image_decoder_reset(dev->read_decoder_jpeg);
+    image_decoder_reset(dev->read_decoder);
+    if (dev->read_task != NULL) {
+        decpool_task_free(dev->read_task);
+        dev->read_task = NULL;
+    }
     if (dev->read_image != NULL) {
         http_data_unref(dev->read_image);
         dev->read_image = NULL;
     }
-    g_free(dev->read_line_buf);
-    dev->read_line_buf = NULL;
+    dev->read_filters = filter_chain_free(dev->read_filters);
+    if (dev->read_line_buf != NULL) {
+        memstat_free(MEMSTAT_DEVICE, dev->read_line_cap);
+        g_free(dev->read_line_buf);
+        dev->read_line_buf = NULL;
+    }
 
     if (device_stm_state_get(dev) == DEVICE_STM_DONE &&
         (status != SANE_STATUS_EOF || dev->job_status == SANE_STATUS_GOOD)) {
         device_stm_state_set(dev, DEVICE_STM_IDLE);
+        if (status == SANE_STATUS_NO_DOCS) {
+            device_adf_watch_start(dev);
+        }
     }
 
     return status;
@@ -11,6 +11,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* Image decoding profiles, in SANE format
+ */
+static SANE_String_Const devopt_decode_profiles[] = {
+    OPTVAL_DECODE_PROFILE_ACCURATE,
+    OPTVAL_DECODE_PROFILE_FAST,
+    NULL
+};
+
+/* Scan intents to DEVCAPS_SOURCE_INTENT_xxx flags mapping
+ */
+static const unsigned int devopt_scanintent_flags[NUM_ID_SCANINTENT] = {
+    [ID_SCANINTENT_DOCUMENT]      = DEVCAPS_SOURCE_INTENT_DOCUMENT,
+    [ID_SCANINTENT_TXT_AND_GRAPH] = DEVCAPS_SOURCE_INTENT_TXT_AND_GRAPH,
+    [ID_SCANINTENT_PHOTO]         = DEVCAPS_SOURCE_INTENT_PHOTO,
+    [ID_SCANINTENT_PREVIEW]       = DEVCAPS_SOURCE_INTENT_PREVIEW
+};
+
 /* Initialize device options
  */
 void
@@ -20,8 +37,13 @@ devopt_init (devopt *opt)
     opt->src = ID_SOURCE_UNKNOWN;
     opt->colormode = ID_COLORMODE_UNKNOWN;
     opt->resolution = CONFIG_DEFAULT_RESOLUTION;
+    opt->decode_profile = ID_DECODE_PROFILE_ACCURATE;
+    opt->transfer_format = ID_FORMAT_JPEG;
+    opt->scanintent = ID_SCANINTENT_AUTO;
     opt->sane_sources = sane_string_array_new();
     opt->sane_colormodes = sane_string_array_new();
+    opt->sane_scanintents = sane_string_array_new();
+    opt->sane_transfer_formats = sane_string_array_new();
 }
 
 /* Cleanup device options
@@ -31,6 +53,8 @@ devopt_cleanup (devopt *opt)
 {
     sane_string_array_free(opt->sane_sources);
     sane_string_array_free(opt->sane_colormodes);
+    sane_string_array_free(opt->sane_scanintents);
+    sane_string_array_free(opt->sane_transfer_formats);
     devcaps_cleanup(&opt->caps);
 }
 
@@ -79,6 +103,21 @@ devopt_choose_colormode(devopt *opt, ID_COLORMODE wanted)
     return wanted;
 }
 
+/* Choose appropriate scan intent. If wanted intent is not
+ * supported by the current source, device default is used
+ */
+static ID_SCANINTENT
+devopt_choose_scanintent (devopt *opt, ID_SCANINTENT wanted)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+
+    if ((src->flags & devopt_scanintent_flags[wanted]) != 0) {
+        return wanted;
+    }
+
+    return ID_SCANINTENT_AUTO;
+}
+
 /* Choose appropriate scanner resolution
  */
 static SANE_Word
@@ -107,6 +146,16 @@ devopt_choose_resolution (devopt *opt, SANE_Word wanted)
     }
 }
 
+/* Check if transfer format is supported by the current source
+ */
+static bool
+devopt_transfer_format_supported (devopt *opt, ID_FORMAT fmt)
+{
+    devcaps_source *src = opt->caps.src[opt->src];
+
+    return (src->formats & DEVCAPS_FORMATS_SUPPORTED & (1 << fmt)) != 0;
+}
+
 /* Rebuild option descriptors
  */
 static void
@@ -120,6 +169,8 @@ devopt_rebuild_opt_desc (devopt *opt)
 
     sane_string_array_reset(opt->sane_sources);
     sane_string_array_reset(opt->sane_colormodes);
+    sane_string_array_reset(opt->sane_scanintents);
+    sane_string_array_reset(opt->sane_transfer_formats);
 
     for (i = 0; i < NUM_ID_SOURCE; i ++) {
         if (opt->caps.src[i] != NULL) {
@@ -136,6 +187,23 @@ devopt_rebuild_opt_desc (devopt *opt)
         }
     }
 
+    for (i = 0; i < NUM_ID_SCANINTENT; i ++) {
+        if (i == ID_SCANINTENT_AUTO ||
+            (src->flags & devopt_scanintent_flags[i]) != 0) {
+            opt->sane_scanintents = sane_string_array_append(
+                opt->sane_scanintents, (SANE_String) id_scanintent_sane_name(i));
+        }
+    }
+
+    opt->sane_transfer_formats = sane_string_array_append(
+        opt->sane_transfer_formats, (SANE_String) OPTVAL_TRANSFER_FORMAT_AUTO);
+    for (i = 0; i < NUM_ID_FORMAT; i ++) {
+        if (devopt_transfer_format_supported(opt, i)) {
+            opt->sane_transfer_formats = sane_string_array_append(
+                opt->sane_transfer_formats, (SANE_String) id_format_sane_name(i));
+        }
+    }
+
     /* OPT_NUM_OPTIONS */
     desc = &opt->desc[OPT_NUM_OPTIONS];
     desc->name = SANE_NAME_NUM_OPTIONS;
@@ -192,6 +260,51 @@ devopt_rebuild_opt_desc (devopt *opt)
     desc->constraint_type = SANE_CONSTRAINT_STRING_LIST;
     desc->constraint.string_list = (SANE_String_Const*) opt->sane_sources;
 
+    /* OPT_SCAN_INTENT */
+    desc = &opt->desc[OPT_SCAN_INTENT];
+    desc->name = OPTNAME_SCAN_INTENT;
+    desc->title = SANE_I18N("Scan intent");
+    desc->desc = SANE_I18N("Kind of document being scanned. Device "
+            "may choose faster processing, suitable for this kind "
+            "of documents");
+    desc->type = SANE_TYPE_STRING;
+    desc->size = sane_string_array_max_strlen(opt->sane_scanintents) + 1;
+    desc->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT;
+    if (sane_string_array_len(opt->sane_scanintents) < 2) {
+        desc->cap |= SANE_CAP_INACTIVE;
+    }
+    desc->constraint_type = SANE_CONSTRAINT_STRING_LIST;
+    desc->constraint.string_list = (SANE_String_Const*) opt->sane_scanintents;
+
+    /* OPT_DECODE_PROFILE */
+    desc = &opt->desc[OPT_DECODE_PROFILE];
+    desc->name = OPTNAME_DECODE_PROFILE;
+    desc->title = SANE_I18N("Decoding profile");
+    desc->desc = SANE_I18N("Image decoding profile: accurate or fast. "
+            "The fast profile saves CPU at a cost of slightly lower "
+            "image quality");
+    desc->type = SANE_TYPE_STRING;
+    desc->size = sizeof(OPTVAL_DECODE_PROFILE_ACCURATE);
+    desc->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT |
+            SANE_CAP_ADVANCED;
+    desc->constraint_type = SANE_CONSTRAINT_STRING_LIST;
+    desc->constraint.string_list = devopt_decode_profiles;
+
+    /* OPT_TRANSFER_FORMAT */
+    desc = &opt->desc[OPT_TRANSFER_FORMAT];
+    desc->name = OPTNAME_TRANSFER_FORMAT;
+    desc->title = SANE_I18N("Transfer format");
+    desc->desc = SANE_I18N("Image format, used to transfer images from "
+            "scanner. If not supported by the scanner, JPEG or PDF "
+            "is used instead");
+    desc->type = SANE_TYPE_STRING;
+    desc->size = sane_string_array_max_strlen(opt->sane_transfer_formats) + 1;
+    desc->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT |
+            SANE_CAP_ADVANCED;
+    desc->constraint_type = SANE_CONSTRAINT_STRING_LIST;
+    desc->constraint.string_list =
+            (SANE_String_Const*) opt->sane_transfer_formats;
+
     /* OPT_GROUP_GEOMETRY */
     desc = &opt->desc[OPT_GROUP_GEOMETRY];
     desc->name = SANE_NAME_GEOMETRY;
@@ -350,6 +463,9 @@ devopt_set_source (devopt *opt, ID_SOURCE id_src, SANE_Word *info)
     /* Try to preserve resolution */
     opt->resolution = devopt_choose_resolution(opt, opt->resolution);
 
+    /* Try to preserve scan intent */
+    opt->scanintent = devopt_choose_scanintent(opt, opt->scanintent);
+
     /* Reset window to maximum size */
     opt->tl_x = 0;
     opt->tl_y = 0;
@@ -414,13 +530,25 @@ devopt_set_geom (devopt *opt, SANE_Int option, SANE_Fixed val, SANE_Word *info)
  * devopt.caps needs to be properly filled.
  */
 void
-devopt_set_defaults (devopt *opt)
+devopt_set_defaults (devopt *opt, const conf_profile *profile)
 {
     devcaps_source *src;
 
     opt->src = devopt_choose_default_source(opt);
     opt->colormode = devopt_choose_colormode(opt, ID_COLORMODE_UNKNOWN);
     opt->resolution = devopt_choose_resolution(opt, CONFIG_DEFAULT_RESOLUTION);
+    opt->decode_profile = conf.decode_profile;
+    opt->transfer_format = conf.transfer_format;
+
+    if (profile != NULL) {
+        if (profile->decode_profile != ID_DECODE_PROFILE_UNKNOWN) {
+            opt->decode_profile = profile->decode_profile;
+        }
+        if (profile->transfer_format_set) {
+            opt->transfer_format = profile->transfer_format;
+        }
+    }
+    opt->scanintent = ID_SCANINTENT_AUTO;
 
     src = opt->caps.src[opt->src];
     opt->tl_x = 0;
@@ -437,9 +565,12 @@ devopt_set_defaults (devopt *opt)
 SANE_Status
 devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info)
 {
-    SANE_Status    status = SANE_STATUS_GOOD;
-    ID_SOURCE      id_src;
-    ID_COLORMODE   id_colormode;
+    SANE_Status       status = SANE_STATUS_GOOD;
+    ID_SOURCE         id_src;
+    ID_COLORMODE      id_colormode;
+    ID_DECODE_PROFILE id_decode_profile;
+    ID_SCANINTENT     id_scanintent;
+    ID_FORMAT         id_format;
 
     /* Simplify life of options handlers by ensuring info != NULL  */
     if (info == NULL) {
@@ -473,6 +604,38 @@ devopt_set_option (devopt *opt, SANE_Int option, void *value, SANE_Word *info)
         }
         break;
 
+    case OPT_SCAN_INTENT:
+        id_scanintent = id_scanintent_by_sane_name(value);
+        if (id_scanintent == ID_SCANINTENT_UNKNOWN ||
+            devopt_choose_scanintent(opt, id_scanintent) != id_scanintent) {
+            status = SANE_STATUS_INVAL;
+        } else {
+            opt->scanintent = id_scanintent;
+        }
+        break;
+
+    case OPT_DECODE_PROFILE:
+        id_decode_profile = id_decode_profile_by_sane_name(value);
+        if (id_decode_profile == ID_DECODE_PROFILE_UNKNOWN) {
+            status = SANE_STATUS_INVAL;
+        } else {
+            opt->decode_profile = id_decode_profile;
+        }
+        break;
+
+    case OPT_TRANSFER_FORMAT:
+        /* Accept only values from the constraint list */
+        id_format = id_format_by_sane_name(value);
+        if (!strcasecmp(value, OPTVAL_TRANSFER_FORMAT_AUTO)) {
+            opt->transfer_format = ID_FORMAT_UNKNOWN;
+        } else if (id_format != ID_FORMAT_UNKNOWN &&
+                   devopt_transfer_format_supported(opt, id_format)) {
+            opt->transfer_format = id_format;
+        } else {
+            status = SANE_STATUS_INVAL;
+        }
+        break;
+
     case OPT_SCAN_TL_X:
     case OPT_SCAN_TL_Y:
     case OPT_SCAN_BR_X:
@@ -520,6 +683,22 @@ devopt_get_option (devopt *opt, SANE_Int option, void *value)
         strcpy(value, id_source_sane_name(opt->src));
         break;
 
+    case OPT_SCAN_INTENT:
+        strcpy(value, id_scanintent_sane_name(opt->scanintent));
+        break;
+
+    case OPT_DECODE_PROFILE:
+        strcpy(value, id_decode_profile_sane_name(opt->decode_profile));
+        break;
+
+    case OPT_TRANSFER_FORMAT:
+        if (opt->transfer_format == ID_FORMAT_UNKNOWN) {
+            strcpy(value, OPTVAL_TRANSFER_FORMAT_AUTO);
+        } else {
+            strcpy(value, id_format_sane_name(opt->transfer_format));
+        }
+        break;
+
     case OPT_SCAN_TL_X:
         *(SANE_Fixed*) value = opt->tl_x;
         break;
@@ -0,0 +1,84 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * On-demand loading of optional shared libraries
+ */
+
+#include "airscan.h"
+
+#include <dlfcn.h>
+
+/* Static variables
+ */
+G_LOCK_DEFINE_STATIC(dll_mutex);
+
+/* Load the library, if not loaded yet, and resolve all its symbols
+ *
+ * Libraries are never unloaded: the backend itself is marked as
+ * NODELETE, and so are libraries it depends on
+ */
+static error
+dll_load_locked (dll *lib)
+{
+    int        i;
+    const char *soname = NULL;
+
+    /* Already loaded or already failed? */
+    if (lib->handle != NULL) {
+        return NULL;
+    }
+
+    if (lib->errbuf[0] != '\0') {
+        return ERROR(lib->errbuf);
+    }
+
+    /* Try all known sonames, in order of preference */
+    for (i = 0; lib->sonames[i] != NULL && lib->handle == NULL; i ++) {
+        soname = lib->sonames[i];
+        lib->handle = dlopen(soname, RTLD_NOW | RTLD_LOCAL | RTLD_NODELETE);
+    }
+
+    if (lib->handle == NULL) {
+        snprintf(lib->errbuf, sizeof(lib->errbuf), "%s: %s", lib->name,
+                dlerror());
+        return ERROR(lib->errbuf);
+    }
+
+    /* Resolve symbols */
+    for (i = 0; lib->syms[i].name != NULL; i ++) {
+        void *sym = dlsym(lib->handle, lib->syms[i].name);
+
+        if (sym == NULL) {
+            snprintf(lib->errbuf, sizeof(lib->errbuf), "%s: %s", soname,
+                    dlerror());
+            dlclose(lib->handle);
+            lib->handle = NULL;
+            return ERROR(lib->errbuf);
+        }
+
+        *lib->syms[i].ptr = sym;
+    }
+
+    log_debug(NULL, "%s: loaded", soname);
+
+    return NULL;
+}
+
+/* Load the library on demand. Safe to call from any thread
+ */
+error
+dll_load (dll *lib)
+{
+    error err;
+
+    G_LOCK(dll_mutex);
+    err = dll_load_locked(lib);
+    G_UNLOCK(dll_mutex);
+
+    return err;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -182,9 +182,9 @@ eloop_cond_wait_until (GCond *cond, gint64 timeout)
 /* Create AvahiGLibPoll that runs in context of the event loop
  */
 AvahiGLibPoll*
-eloop_new_avahi_poll (void)
+eloop_new_avahi_poll (__typeof__(avahi_glib_poll_new) *glib_poll_new)
 {
-    return avahi_glib_poll_new(eloop_glib_main_context, G_PRIORITY_DEFAULT);
+    return glib_poll_new(eloop_glib_main_context, G_PRIORITY_DEFAULT);
 }
 
 /* Call function on a context of event loop thread
@@ -14,10 +14,15 @@
  */
 #define ESCL_LOAD_RETRY_ATTEMPTS        10
 
-/* And pause between retries, in milliseconds
+/* And pause between retries, in milliseconds, if device doesn't
+ * send Retry-After hint
  */
 #define ESCL_LOAD_RETRY_PAUSE           1000
 
+/* Minimal pause between retries, in milliseconds, regardless of hint
+ */
+#define ESCL_LOAD_RETRY_PAUSE_MIN       250
+
 
 /* proto_handler_escl represents eSCL protocol handler
  */
@@ -83,6 +88,29 @@ escl_devcaps_source_parse_color_modes (xml_rd *xml, devcaps_source *src)
     return NULL;
 }
 
+/* Parse supported scan intents
+ */
+static void
+escl_devcaps_source_parse_intents (xml_rd *xml, devcaps_source *src)
+{
+    xml_rd_enter(xml);
+    for (; !xml_rd_end(xml); xml_rd_next(xml)) {
+        if(xml_rd_node_name_match(xml, "scan:Intent")) {
+            const char *v = xml_rd_node_value(xml);
+            if (!strcmp(v, "Document")) {
+                src->flags |= DEVCAPS_SOURCE_INTENT_DOCUMENT;
+            } else if (!strcmp(v, "TextAndGraphic")) {
+                src->flags |= DEVCAPS_SOURCE_INTENT_TXT_AND_GRAPH;
+            } else if (!strcmp(v, "Photo")) {
+                src->flags |= DEVCAPS_SOURCE_INTENT_PHOTO;
+            } else if (!strcmp(v, "Preview")) {
+                src->flags |= DEVCAPS_SOURCE_INTENT_PREVIEW;
+            }
+        }
+    }
+    xml_rd_leave(xml);
+}
+
 /* Parse document formats
  */
 static error
@@ -301,6 +329,8 @@ escl_devcaps_source_parse (xml_rd *xml, devcaps_source **out)
             err = xml_rd_node_value_uint(xml, &src->max_hei_px);
         } else if (xml_rd_node_name_match(xml, "scan:SettingProfiles")) {
             err = escl_devcaps_source_parse_setting_profiles(xml, src);
+        } else if (xml_rd_node_name_match(xml, "scan:SupportedIntents")) {
+            escl_devcaps_source_parse_intents(xml, src);
         }
     }
     xml_rd_leave(xml);
@@ -531,7 +561,8 @@ escl_scan_query (const proto_ctx *ctx)
     const proto_scan_params *params = &ctx->params;
     const char              *source = NULL;
     const char              *colormode = NULL;
-    const char              *mime = "image/jpeg";
+    const char              *intent = NULL;
+    const char              *mime = id_format_mime_name(params->format);
     const devcaps_source    *src = ctx->devcaps->src[params->src];
     bool                    duplex = false;
     http_query              *query;
@@ -555,10 +586,23 @@ escl_scan_query (const proto_ctx *ctx)
         log_internal_error(ctx->log);
     }
 
+    switch (params->scanintent) {
+    case ID_SCANINTENT_DOCUMENT:      intent = "Document"; break;
+    case ID_SCANINTENT_TXT_AND_GRAPH: intent = "TextAndGraphic"; break;
+    case ID_SCANINTENT_PHOTO:         intent = "Photo"; break;
+    case ID_SCANINTENT_PREVIEW:       intent = "Preview"; break;
+
+    default:
+        break;
+    }
+
     /* Build scan request */
     xml_wr *xml = xml_wr_begin("scan:ScanSettings", escl_xml_wr_ns);
 
     xml_wr_add_text(xml, "pwg:Version", "2.0");
+    if (intent != NULL) {
+        xml_wr_add_text(xml, "scan:Intent", intent);
+    }
 
     xml_wr_enter(xml, "pwg:ScanRegions");
     xml_wr_enter(xml, "pwg:ScanRegion");
@@ -655,6 +699,32 @@ ERROR:
     return result;
 }
 
+/* Get pause before retry, in milliseconds
+ *
+ * retry_after is the Retry-After hint, sent by device, or -1, if
+ * device didn't send it. The hint is honoured within the bounds
+ * of ESCL_LOAD_RETRY_PAUSE_MIN and conf.retry_after_max
+ */
+static int
+escl_retry_pause (int retry_after)
+{
+    if (retry_after < 0 || conf.retry_after_max == 0) {
+        return ESCL_LOAD_RETRY_PAUSE;
+    }
+
+    return CLAMP(retry_after, ESCL_LOAD_RETRY_PAUSE_MIN,
+        MAX(conf.retry_after_max, ESCL_LOAD_RETRY_PAUSE_MIN));
+}
+
+/* Check if HTTP status means that device is temporary busy
+ */
+static bool
+escl_http_status_busy (int http_status)
+{
+    return http_status == HTTP_STATUS_SERVICE_UNAVAILABLE ||
+           http_status == HTTP_STATUS_TOO_MANY_REQUESTS;
+}
+
 /* Initiate image downloading
  */
 static http_query*
@@ -683,8 +753,18 @@ escl_load_decode (const proto_ctx *ctx)
     /* Check HTTP status */
     err = http_query_error(ctx->query);
     if (err != NULL) {
+        int retry_after = http_query_retry_after(ctx->query);
+
         if (ctx->params.src == ID_SOURCE_PLATEN && ctx->images_received > 0) {
             result.next = PROTO_OP_CLEANUP;
+        } else if (escl_http_status_busy(http_query_status(ctx->query)) &&
+                   retry_after >= 0 && conf.retry_after_max != 0 &&
+                   ctx->failed_attempt < ESCL_LOAD_RETRY_ATTEMPTS) {
+            /* Device told us, when to come back, so there is no
+             * need to ask its status
+             */
+            result.next = PROTO_OP_LOAD;
+            result.delay = escl_retry_pause(retry_after);
         } else {
             result.next = PROTO_OP_CHECK;
             result.err = eloop_eprintf("HTTP: %s", ESTRING(err));
@@ -709,10 +789,15 @@ escl_status_query (const proto_ctx *ctx)
 /* Parse ScannerStatus response.
  *
  * Returned SANE_STATUS_UNSUPPORTED means status not understood
+ *
+ * If adf_status_out is not NULL, ADF state is returned there
+ * separately, with the same meaning of SANE_STATUS_UNSUPPORTED.
+ * The same is true for device_status_out and device state
  */
 static SANE_Status
 escl_decode_scanner_status (const proto_ctx *ctx,
-        const char *xml_text, size_t xml_len)
+        const char *xml_text, size_t xml_len, SANE_Status *adf_status_out,
+        SANE_Status *device_status_out)
 {
     error       err = NULL;
     xml_rd      *xml;
@@ -790,6 +875,14 @@ DONE:
         trace_printf(log_ctx_trace(ctx->log), "");
     }
 
+    if (adf_status_out != NULL) {
+        *adf_status_out = adf_status;
+    }
+
+    if (device_status_out != NULL) {
+        *device_status_out = device_status;
+    }
+
     return status;
 }
 
@@ -809,11 +902,12 @@ escl_status_decode (const proto_ctx *ctx)
         goto FAIL;
     } else {
         http_data *data = http_query_get_response_data(ctx->query);
-        status = escl_decode_scanner_status(ctx, data->bytes, data->size);
+        status = escl_decode_scanner_status(ctx, data->bytes, data->size,
+            NULL, NULL);
     }
 
     /* Now it's time to make a decision */
-    if (ctx->failed_http_status == HTTP_STATUS_SERVICE_UNAVAILABLE &&
+    if (escl_http_status_busy(ctx->failed_http_status) &&
         ctx->failed_attempt < ESCL_LOAD_RETRY_ATTEMPTS) {
 
         /* Note, some devices may return HTTP 503 error core, meaning
@@ -827,7 +921,7 @@ escl_status_decode (const proto_ctx *ctx)
         case SANE_STATUS_UNSUPPORTED:
         case SANE_STATUS_DEVICE_BUSY:
                 result.next = ctx->failed_op;
-                result.delay = ESCL_LOAD_RETRY_PAUSE;
+                result.delay = escl_retry_pause(ctx->failed_retry_after);
                 return result;
 
         default:
@@ -836,7 +930,7 @@ escl_status_decode (const proto_ctx *ctx)
     }
 
     if (status == SANE_STATUS_GOOD || status == SANE_STATUS_UNSUPPORTED) {
-        if (ctx->failed_http_status == HTTP_STATUS_SERVICE_UNAVAILABLE) {
+        if (escl_http_status_busy(ctx->failed_http_status)) {
             status = SANE_STATUS_DEVICE_BUSY;
         } else {
             status = SANE_STATUS_IO_ERROR;
@@ -852,6 +946,49 @@ FAIL:
     return result;
 }
 
+/* Decode ADF state, for the continuous ADF mode
+ */
+static SANE_Status
+escl_adf_status_decode (const proto_ctx *ctx)
+{
+    http_data   *data;
+    SANE_Status status, adf_status = SANE_STATUS_UNSUPPORTED;
+
+    if (http_query_error(ctx->query) != NULL) {
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    data = http_query_get_response_data(ctx->query);
+    status = escl_decode_scanner_status(ctx, data->bytes, data->size,
+        &adf_status, NULL);
+
+    if (adf_status != SANE_STATUS_GOOD) {
+        return adf_status;
+    }
+
+    return status;
+}
+
+/* Decode device state, before the next job is started
+ */
+static SANE_Status
+escl_idle_status_decode (const proto_ctx *ctx)
+{
+    http_data   *data;
+    SANE_Status device_status = SANE_STATUS_UNSUPPORTED;
+
+    if (http_query_error(ctx->query) != NULL) {
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    data = http_query_get_response_data(ctx->query);
+    escl_decode_scanner_status(ctx, data->bytes, data->size, NULL,
+        &device_status);
+
+    return device_status == SANE_STATUS_GOOD ?
+        SANE_STATUS_GOOD : SANE_STATUS_DEVICE_BUSY;
+}
+
 /* Cancel scan in progress
  */
 static http_query*
@@ -894,6 +1031,9 @@ proto_handler_escl_new (void)
     escl->proto.cleanup_query = escl_cancel_query;
     escl->proto.cancel_query = escl_cancel_query;
 
+    escl->proto.adf_status_decode = escl_adf_status_decode;
+    escl->proto.idle_status_decode = escl_idle_status_decode;
+
     return &escl->proto;
 }
 
@@ -0,0 +1,449 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Fake protocol handler, for testing and benchmarking
+ *
+ * This handler completes all operations locally, without any
+ * network activity, following the simple script, taken from the
+ * SANE_AIRSCAN_FAKE_PROTO environment variable. The script is
+ * a comma-separated list of name=value pairs:
+ *
+ *   pages=N   - number of pages per job, 1 by default. 0 means
+ *               empty ADF
+ *   delay=MS  - delay before each operation completion, in
+ *               milliseconds, 0 by default
+ *   fail=N    - loading of page N (1-based) fails with HTTP 500,
+ *               0 (never) by default
+ *   busy=N    - first N scan requests of each job are rejected
+ *               with HTTP 503, 0 by default
+ *
+ * Empty string means all defaults. Images are synthetic JPEGs of
+ * requested size and color mode. Device URIs are not used, but
+ * still required, so devices need to be added manually into the
+ * [devices] section of configuration file
+ */
+
+#include "airscan.h"
+
+#include <jpeglib.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******************** Protocol constants ********************/
+/* How many retry attempts to perform after HTTP 503
+ */
+#define FAKE_RETRY_ATTEMPTS             10
+
+/* HTTP statuses we use, in addition to the standard set
+ */
+#define FAKE_HTTP_STATUS_NOT_FOUND      404
+#define FAKE_HTTP_STATUS_SERVER_ERROR   500
+
+/* fake_script represents parsed SANE_AIRSCAN_FAKE_PROTO script
+ */
+typedef struct {
+    int pages; /* Pages per job */
+    int delay; /* Operation delay, milliseconds */
+    int fail;  /* Failed page, 1-based, 0 if none */
+    int busy;  /* Count of rejected scan requests */
+} fake_script;
+
+/* proto_handler_fake represents fake protocol handler
+ */
+typedef struct {
+    proto_handler proto;       /* Base class */
+    fake_script   script;      /* The script */
+
+    /* Synthetic image, cached between pages and jobs */
+    unsigned char *image;      /* JPEG data, allocated by libjpeg */
+    unsigned long image_size;  /* JPEG data size */
+    int           image_wid;   /* Image width, pixels */
+    int           image_hei;   /* Image height, pixels */
+    bool          image_gray;  /* Image is grayscale */
+} proto_handler_fake;
+
+/******************** Script parsing ********************/
+/* Parse the script. Unknown or invalid items are logged and ignored
+ */
+static void
+fake_script_parse (fake_script *script, const char *text)
+{
+    char *s, *next, *copy = g_strdup(text);
+
+    script->pages = 1;
+    script->delay = 0;
+    script->fail = 0;
+    script->busy = 0;
+
+    for (s = copy; s != NULL && *s != '\0'; s = next) {
+        char *val, *end;
+        long n;
+        int  *field = NULL;
+
+        next = strchr(s, ',');
+        if (next != NULL) {
+            *next ++ = '\0';
+        }
+
+        val = strchr(s, '=');
+        if (val != NULL) {
+            *val ++ = '\0';
+            n = strtol(val, &end, 10);
+            if (end != val && *end == '\0' && n >= 0 && n <= G_MAXINT) {
+                if (!strcmp(s, "pages")) {
+                    field = &script->pages;
+                } else if (!strcmp(s, "delay")) {
+                    field = &script->delay;
+                } else if (!strcmp(s, "fail")) {
+                    field = &script->fail;
+                } else if (!strcmp(s, "busy")) {
+                    field = &script->busy;
+                }
+            }
+        }
+
+        if (field != NULL) {
+            *field = (int) n;
+        } else {
+            log_debug(NULL, "%s: invalid item \"%s\" ignored",
+                    CONFIG_ENV_AIRSCAN_FAKE_PROTO, s);
+        }
+    }
+
+    g_free(copy);
+}
+
+/******************** Synthetic images ********************/
+/* Make sure that synthetic image of requested parameters is available
+ */
+static void
+fake_image_prepare (proto_handler_fake *fake, int wid, int hei, bool gray)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    JSAMPROW                    line;
+    int                         x, y, comps = gray ? 1 : 3;
+
+    if (fake->image != NULL && fake->image_wid == wid &&
+        fake->image_hei == hei && fake->image_gray == gray) {
+        return;
+    }
+
+    free(fake->image);
+    fake->image = NULL;
+    fake->image_size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &fake->image, &fake->image_size);
+
+    cinfo.image_width = wid;
+    cinfo.image_height = hei;
+    cinfo.input_components = comps;
+    cinfo.in_color_space = gray ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+
+    /* Draw some gradients, so image is not trivial to compress */
+    line = g_malloc(wid * comps);
+    jpeg_start_compress(&cinfo, true);
+
+    for (y = 0; y < hei; y ++) {
+        for (x = 0; x < wid; x ++) {
+            JSAMPLE *px = line + x * comps;
+            px[0] = (JSAMPLE) (x + y);
+            if (!gray) {
+                px[1] = (JSAMPLE) x;
+                px[2] = (JSAMPLE) y;
+            }
+        }
+
+        jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(line);
+
+    fake->image_wid = wid;
+    fake->image_hei = hei;
+    fake->image_gray = gray;
+}
+
+/******************** HTTP utility functions ********************/
+/* Create local HTTP query, completed with specified status
+ */
+static http_query*
+fake_http_query (const proto_ctx *ctx, const char *path,
+        const char *method, int status)
+{
+    proto_handler_fake *fake = (proto_handler_fake*) ctx->proto;
+    http_query         *q;
+
+    q = http_query_new_relative(ctx->http, ctx->base_uri, path,
+        method, NULL, NULL);
+    http_query_set_local_response(q, status, fake->script.delay,
+        NULL, NULL, 0);
+
+    return q;
+}
+
+/******************** Device Capabilities ********************/
+/* Create fake source
+ */
+static devcaps_source*
+fake_devcaps_source_new (void)
+{
+    static const SANE_Word resolutions[] = {75, 150, 300, 600};
+    devcaps_source         *src = devcaps_source_new();
+    size_t                 i;
+
+    src->flags = DEVCAPS_SOURCE_RES_DISCRETE | DEVCAPS_SOURCE_HAS_SIZE |
+        DEVCAPS_SOURCE_PWG_DOCFMT;
+    src->colormodes = DEVCAPS_COLORMODES_SUPPORTED;
+    src->formats = 1 << ID_FORMAT_JPEG;
+
+    for (i = 0; i < sizeof(resolutions) / sizeof(resolutions[0]); i ++) {
+        src->resolutions = sane_word_array_append(src->resolutions,
+            resolutions[i]);
+    }
+
+    /* Letter width and A4 height, at 300 DPI */
+    src->min_wid_px = src->min_hei_px = 16;
+    src->max_wid_px = 2550;
+    src->max_hei_px = 3508;
+
+    src->win_x_range_mm.min = src->win_y_range_mm.min = 0;
+    src->win_x_range_mm.max = math_px2mm_res(src->max_wid_px, 300);
+    src->win_y_range_mm.max = math_px2mm_res(src->max_hei_px, 300);
+
+    return src;
+}
+
+/* Query device capabilities
+ */
+static http_query*
+fake_devcaps_query (const proto_ctx *ctx)
+{
+    return fake_http_query(ctx, "ScannerCapabilities", "GET",
+        HTTP_STATUS_OK);
+}
+
+/* Decode device capabilities
+ */
+static error
+fake_devcaps_decode (const proto_ctx *ctx, devcaps *caps)
+{
+    caps->units = 300;
+    caps->protocol = ctx->proto->name;
+    caps->vendor = g_strdup("AirScan");
+    caps->model = g_strdup("Fake Scanner");
+
+    caps->src[ID_SOURCE_PLATEN] = fake_devcaps_source_new();
+    caps->src[ID_SOURCE_ADF_SIMPLEX] = fake_devcaps_source_new();
+    caps->src[ID_SOURCE_ADF_DUPLEX] = fake_devcaps_source_new();
+
+    return NULL;
+}
+
+/******************** Scan operations ********************/
+/* Initiate scanning
+ */
+static http_query*
+fake_scan_query (const proto_ctx *ctx)
+{
+    proto_handler_fake *fake = (proto_handler_fake*) ctx->proto;
+    int                status = HTTP_STATUS_CREATED;
+
+    if (ctx->failed_attempt < fake->script.busy) {
+        status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+    }
+
+    return fake_http_query(ctx, "ScanJobs", "POST", status);
+}
+
+/* Decode result of scan request
+ */
+static proto_result
+fake_scan_decode (const proto_ctx *ctx)
+{
+    proto_result result = {0};
+
+    if (http_query_status(ctx->query) != HTTP_STATUS_CREATED) {
+        result.next = PROTO_OP_CHECK;
+        result.err = eloop_eprintf("ScanJobs request: unexpected HTTP status %d",
+                http_query_status(ctx->query));
+        return result;
+    }
+
+    result.next = PROTO_OP_LOAD;
+    result.data.location = g_strdup("ScanJobs/fake");
+
+    return result;
+}
+
+/* Initiate image downloading
+ */
+static http_query*
+fake_load_query (const proto_ctx *ctx)
+{
+    proto_handler_fake      *fake = (proto_handler_fake*) ctx->proto;
+    const proto_scan_params *params = &ctx->params;
+    int                     page = (int) ctx->images_received + 1;
+    http_query              *q;
+    void                    *body;
+
+    if (page > fake->script.pages) {
+        return fake_http_query(ctx, "NextDocument", "GET",
+            FAKE_HTTP_STATUS_NOT_FOUND);
+    }
+
+    if (page == fake->script.fail) {
+        return fake_http_query(ctx, "NextDocument", "GET",
+            FAKE_HTTP_STATUS_SERVER_ERROR);
+    }
+
+    fake_image_prepare(fake,
+        math_muldiv(params->wid, params->x_res, ctx->devcaps->units),
+        math_muldiv(params->hei, params->y_res, ctx->devcaps->units),
+        params->colormode == ID_COLORMODE_GRAYSCALE);
+
+    body = g_malloc(fake->image_size);
+    memcpy(body, fake->image, fake->image_size);
+
+    q = http_query_new_relative(ctx->http, ctx->base_uri, "NextDocument",
+        "GET", NULL, NULL);
+    http_query_set_local_response(q, HTTP_STATUS_OK, fake->script.delay,
+        "image/jpeg", body, fake->image_size);
+
+    return q;
+}
+
+/* Decode result of image request
+ */
+static proto_result
+fake_load_decode (const proto_ctx *ctx)
+{
+    proto_result result = {0};
+    error        err = NULL;
+
+    err = http_query_error(ctx->query);
+    if (err != NULL) {
+        if (ctx->params.src == ID_SOURCE_PLATEN && ctx->images_received > 0) {
+            result.next = PROTO_OP_CLEANUP;
+        } else {
+            result.next = PROTO_OP_CHECK;
+            result.err = eloop_eprintf("HTTP: %s", ESTRING(err));
+        }
+
+        return result;
+    }
+
+    result.next = PROTO_OP_LOAD;
+    result.data.image = http_data_ref(http_query_get_response_data(ctx->query));
+
+    return result;
+}
+
+/* Request device status
+ */
+static http_query*
+fake_status_query (const proto_ctx *ctx)
+{
+    return fake_http_query(ctx, "ScannerStatus", "GET", HTTP_STATUS_OK);
+}
+
+/* Decode result of device status request
+ *
+ * Fake device state is fully defined by the failed operation
+ * and its HTTP status
+ */
+static proto_result
+fake_status_decode (const proto_ctx *ctx)
+{
+    proto_handler_fake *fake = (proto_handler_fake*) ctx->proto;
+    proto_result       result = {0};
+
+    switch (ctx->failed_http_status) {
+    case HTTP_STATUS_SERVICE_UNAVAILABLE:
+        if (ctx->failed_attempt < FAKE_RETRY_ATTEMPTS) {
+            result.next = ctx->failed_op;
+            result.delay = fake->script.delay;
+            return result;
+        }
+
+        result.status = SANE_STATUS_DEVICE_BUSY;
+        break;
+
+    case FAKE_HTTP_STATUS_NOT_FOUND:
+        result.status = SANE_STATUS_NO_DOCS;
+        break;
+
+    default:
+        result.status = SANE_STATUS_IO_ERROR;
+    }
+
+    result.next = ctx->location ? PROTO_OP_CLEANUP : PROTO_OP_FINISH;
+
+    return result;
+}
+
+/* Cancel scan in progress
+ */
+static http_query*
+fake_cancel_query (const proto_ctx *ctx)
+{
+    return fake_http_query(ctx, ctx->location, "DELETE", HTTP_STATUS_OK);
+}
+
+/******************** Constructor/destructor ********************/
+/* Free fake protocol handler
+ */
+static void
+fake_free (proto_handler *proto)
+{
+    proto_handler_fake *fake = (proto_handler_fake*) proto;
+
+    free(fake->image);
+    g_free(fake);
+}
+
+/* proto_handler_fake_new creates new fake protocol handler
+ */
+proto_handler*
+proto_handler_fake_new (void)
+{
+    const char         *script = getenv(CONFIG_ENV_AIRSCAN_FAKE_PROTO);
+    proto_handler_fake *fake;
+
+    if (script == NULL) {
+        return NULL;
+    }
+
+    fake = g_new0(proto_handler_fake, 1);
+    fake_script_parse(&fake->script, script);
+
+    fake->proto.name = "fake";
+    fake->proto.free = fake_free;
+
+    fake->proto.devcaps_query = fake_devcaps_query;
+    fake->proto.devcaps_decode = fake_devcaps_decode;
+
+    fake->proto.scan_query = fake_scan_query;
+    fake->proto.scan_decode = fake_scan_decode;
+
+    fake->proto.load_query = fake_load_query;
+    fake->proto.load_decode = fake_load_decode;
+
+    fake->proto.status_query = fake_status_query;
+    fake->proto.status_decode = fake_status_decode;
+
+    fake->proto.cleanup_query = fake_cancel_query;
+    fake->proto.cancel_query = fake_cancel_query;
+
+    return &fake->proto;
+}
+
+/* vim:ts=8:sw=4:et
+ */
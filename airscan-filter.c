@@ -0,0 +1,198 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Line filters
+ *
+ * Filters are chained and applied to each decoded line in turn, so
+ * the whole chain runs in a single pass over the image. Kernels are
+ * chosen by filters once per image, according to the input format,
+ * so per-line work doesn't contain format checks
+ */
+
+#include "airscan.h"
+
+#include <string.h>
+
+/******************** Filter chain ********************/
+/* Append filter to the end of chain. Returns updated chain
+ */
+filter*
+filter_chain_push (filter *chain, filter *f)
+{
+    filter *last;
+
+    f->next = NULL;
+    if (chain == NULL) {
+        return f;
+    }
+
+    for (last = chain; last->next != NULL; last = last->next)
+        ;
+
+    last->next = f;
+
+    return chain;
+}
+
+/* Free the chain. Returns NULL
+ */
+filter*
+filter_chain_free (filter *chain)
+{
+    while (chain != NULL) {
+        filter *next = chain->next;
+        chain->free(chain);
+        chain = next;
+    }
+
+    return NULL;
+}
+
+/* Prepare the chain for the new image
+ */
+void
+filter_chain_begin (filter *chain, SANE_Parameters *params)
+{
+    for (; chain != NULL; chain = chain->next) {
+        chain->active = chain->begin(chain, params);
+    }
+}
+
+/* Pass the line through the chain
+ */
+void
+filter_chain_apply (filter *chain, uint8_t *line, int pixels)
+{
+    for (; chain != NULL; chain = chain->next) {
+        if (chain->active) {
+            chain->apply(chain, line, pixels);
+        }
+    }
+}
+
+/******************** Color to grayscale conversion ********************/
+/* Color to grayscale conversion filter
+ */
+typedef struct {
+    filter base;        /* Base class */
+} filter_gray;
+
+/* Free the filter
+ */
+static void
+filter_gray_free (filter *f)
+{
+    g_free(f);
+}
+
+/* Convert RGB line to grayscale, in place. Uses integer
+ * approximation of the ITU-R BT.601 luma
+ */
+static void
+filter_gray_apply_rgb (filter *f, uint8_t *line, int pixels)
+{
+    const uint8_t *in = line;
+    int           i;
+
+    (void) f;
+
+    for (i = 0; i < pixels; i ++, in += 3) {
+        line[i] = (in[0] * 77 + in[1] * 150 + in[2] * 29 + 128) >> 8;
+    }
+}
+
+/* Start new image. Only RGB images need conversion
+ */
+static bool
+filter_gray_begin (filter *f, SANE_Parameters *params)
+{
+    if (params->format != SANE_FRAME_RGB || params->depth != 8) {
+        return false;
+    }
+
+    f->apply = filter_gray_apply_rgb;
+
+    params->format = SANE_FRAME_GRAY;
+    params->bytes_per_line = params->pixels_per_line;
+
+    return true;
+}
+
+/* Create color to grayscale conversion filter
+ */
+filter*
+filter_gray_new (void)
+{
+    filter_gray *gray = g_new0(filter_gray, 1);
+
+    gray->base.free = filter_gray_free;
+    gray->base.begin = filter_gray_begin;
+
+    return &gray->base;
+}
+
+/******************** Tap ********************/
+/* Tap filter
+ */
+typedef struct {
+    filter base;                    /* Base class */
+    size_t len;                     /* Bytes per line */
+    void   (*callback) (void *ptr,  /* Line callback */
+                const uint8_t *line, size_t len);
+    void   *ptr;                    /* Callback's parameter */
+} filter_tap;
+
+/* Free the filter
+ */
+static void
+filter_tap_free (filter *f)
+{
+    g_free(f);
+}
+
+/* Pass the line to the callback
+ */
+static void
+filter_tap_apply (filter *f, uint8_t *line, int pixels)
+{
+    filter_tap *tap = (filter_tap*) f;
+
+    (void) pixels;
+
+    tap->callback(tap->ptr, line, tap->len);
+}
+
+/* Start new image
+ */
+static bool
+filter_tap_begin (filter *f, SANE_Parameters *params)
+{
+    filter_tap *tap = (filter_tap*) f;
+
+    tap->len = params->bytes_per_line;
+    f->apply = filter_tap_apply;
+
+    return true;
+}
+
+/* Create tap filter, that passes each line to the callback
+ * without modification
+ */
+filter*
+filter_tap_new (void (*callback) (void *ptr, const uint8_t *line, size_t len),
+        void *ptr)
+{
+    filter_tap *tap = g_new0(filter_tap, 1);
+
+    tap->base.free = filter_tap_free;
+    tap->base.begin = filter_tap_begin;
+    tap->callback = callback;
+    tap->ptr = ptr;
+
+    return &tap->base;
+}
+
+/* vim:ts=8:sw=4:et
+ */
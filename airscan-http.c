@@ -11,11 +11,37 @@
 #include "airscan.h"
 
 #include <arpa/inet.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/un.h>
+#include <time.h>
 #include <libsoup/soup.h>
 
+/******************** Constants ********************/
+/* Connection limits: total and per host. Per host limit leaves
+ * room for control and status queries, while the image is being
+ * transferred
+ */
+#define HTTP_MAX_CONNS          64
+#define HTTP_MAX_CONNS_PER_HOST 4
+
+/******************** Types ********************/
+/* http_bucket is the token bucket, that paces image transfer.
+ * Tokens are bytes. Bucket is refilled at the configured rate,
+ * up to one second worth of traffic, and may go into debt, when
+ * received chunk is larger that available tokens
+ */
+typedef struct {
+    double  rate;   /* Bytes per second, 0 if unlimited */
+    double  tokens; /* Available tokens, negative on debt */
+    gint64  time;   /* Last refill time, g_get_monotonic_time() */
+} http_bucket;
+
 /******************** Static variables ********************/
 static SoupSession *http_session;
+static GHashTable  *http_unix_sessions;
 static http_query  *http_query_list;
+static http_bucket http_bucket_total;
 
 /******************** Forward declarations ********************/
 typedef struct http_multipart http_multipart;
@@ -45,17 +71,34 @@ struct http_uri {
     } addr;
 };
 
-/* Create new URI, by parsing URI string
+/* Check that host part of the unix://socket/path URI is a valid
+ * socket name: a plain file name, that cannot escape socket-dir
  */
-http_uri*
-http_uri_new (const char *str, bool strip_fragment)
+static bool
+http_uri_unix_host_valid (const char *host)
+{
+    return host != NULL && host[0] != '\0' && strchr(host, '/') == NULL &&
+           strcmp(host, ".") && strcmp(host, "..");
+}
+
+/* Create new URI, by parsing URI string. If `allow_unix' is true,
+ * the unix://socket/path URIs are accepted as well
+ */
+static http_uri*
+http_uri_new_internal (const char *str, bool strip_fragment, bool allow_unix)
 {
     http_uri *uri = NULL;
     SoupURI  *parsed = soup_uri_new(str);
 
-    /* Allow only http and https schemes */
+    /* Allow only http, https and, if requested, unix schemes */
     if (parsed != NULL) {
-        if (strcmp(parsed->scheme, "http") && strcmp(parsed->scheme, "https")) {
+        if (!strcmp(parsed->scheme, "unix")) {
+            if (!allow_unix || !http_uri_unix_host_valid(parsed->host)) {
+                soup_uri_free(parsed);
+                parsed = NULL;
+            }
+        } else if (strcmp(parsed->scheme, "http") &&
+                   strcmp(parsed->scheme, "https")) {
             soup_uri_free(parsed);
             parsed = NULL;
         }
@@ -73,6 +116,23 @@ http_uri_new (const char *str, bool strip_fragment)
     return uri;
 }
 
+/* Create new URI, by parsing URI string
+ */
+http_uri*
+http_uri_new (const char *str, bool strip_fragment)
+{
+    return http_uri_new_internal(str, strip_fragment, false);
+}
+
+/* Create new URI of the locally configured device. Besides http
+ * and https, the unix://socket/path form is accepted
+ */
+http_uri*
+http_uri_new_local (const char *str, bool strip_fragment)
+{
+    return http_uri_new_internal(str, strip_fragment, true);
+}
+
 /* Clone an URI
  */
 http_uri*
@@ -94,6 +154,26 @@ http_uri_new_relative (const http_uri *base, const char *path,
     http_uri *uri = NULL;
     SoupURI  *parsed = soup_uri_new_with_base(base->parsed, path);
 
+    /* Absolute path may change the scheme and host. Allow only http
+     * and https, and unix only if it refers the same socket as base
+     */
+    if (parsed != NULL && !path_only) {
+        bool ok;
+
+        if (!strcmp(parsed->scheme, "unix")) {
+            ok = !strcmp(base->parsed->scheme, "unix") &&
+                 !g_strcmp0(base->parsed->host, parsed->host);
+        } else {
+            ok = !strcmp(parsed->scheme, "http") ||
+                 !strcmp(parsed->scheme, "https");
+        }
+
+        if (!ok) {
+            soup_uri_free(parsed);
+            parsed = NULL;
+        }
+    }
+
     if (parsed != NULL) {
         uri = g_new0(http_uri, 1);
         if (path_only) {
@@ -124,6 +204,25 @@ http_uri_free (http_uri *uri)
     }
 }
 
+/* Check if URI refers AF_UNIX socket
+ */
+static bool
+http_uri_is_unix (const http_uri *uri)
+{
+    return !strcmp(uri->parsed->scheme, "unix");
+}
+
+/* Get path of the AF_UNIX socket, the unix://socket/path URI
+ * refers to. The returned string must be released with g_free()
+ */
+static char*
+http_uri_unix_path (const http_uri *uri)
+{
+    const char *dir = conf.socket_dir ? conf.socket_dir : CONF_SOCKET_DIR;
+
+    return g_build_filename(dir, uri->parsed->host, NULL);
+}
+
 /* Get URI string
  */
 const char*
@@ -150,6 +249,11 @@ http_uri_addr (http_uri *uri)
         return &uri->addr.sockaddr;
     }
 
+    /* unix://socket/path has no network address */
+    if (http_uri_is_unix(uri)) {
+        return NULL;
+    }
+
     /* Try to parse */
     if (strchr(host, ':') != NULL) {
         /* Strip zone suffix */
@@ -351,6 +455,7 @@ static void
 http_multipart_unref (http_multipart *mp)
 {
     if (g_atomic_int_dec_and_test(&mp->refcnt)) {
+        memstat_free(MEMSTAT_HTTP, sizeof(http_multipart));
         g_free(mp->bodies);
         http_data_unref(mp->data);
         g_free(mp);
@@ -403,6 +508,7 @@ http_multipart_new (SoupMessageHeaders *headers, http_data *data)
 
     /* Create http_multipart structure */
     mp = g_new0(http_multipart, 1);
+    memstat_alloc(MEMSTAT_HTTP, sizeof(http_multipart));
     mp->data = http_data_ref(data);
 
     /* Split data into parts */
@@ -473,6 +579,9 @@ http_data_new_internal(const void *bytes, size_t size,
     data_ex->buf = buf;
     data_ex->mp = mp ? http_multipart_ref(mp) : NULL;
 
+    /* Multipart bodies don't own their bytes */
+    memstat_alloc(MEMSTAT_HTTP, sizeof(http_data_ex) + (buf ? buf->length : 0));
+
     return &data_ex->data;
 }
 
@@ -523,6 +632,9 @@ http_data_unref (http_data *data)
     if (data != NULL) {
         http_data_ex *data_ex = OUTER_STRUCT(data, http_data_ex, data);
         if (g_atomic_int_dec_and_test(&data_ex->refcnt)) {
+            memstat_free(MEMSTAT_HTTP, sizeof(http_data_ex) +
+                (data_ex->buf ? data_ex->buf->length : 0));
+
             if (data_ex->mp != NULL) {
                 http_multipart_unref(data_ex->mp);
             } else if (data_ex->buf != NULL) {
@@ -634,15 +746,52 @@ http_data_queue_len (const http_data_queue *queue);
 void
 http_data_queue_purge (http_data_queue *queue);
 
+/******************** Bandwidth scheduler ********************/
+/* Initialize the bucket
+ */
+static void
+http_bucket_init (http_bucket *bucket, uint64_t rate)
+{
+    bucket->rate = (double) rate;
+    bucket->tokens = bucket->rate;
+    bucket->time = g_get_monotonic_time();
+}
+
+/* Refill the bucket and consume tokens. Returns delay, in
+ * milliseconds, until the bucket is out of debt, or 0 if
+ * transfer may continue immediately
+ */
+static int
+http_bucket_consume (http_bucket *bucket, size_t bytes, gint64 now)
+{
+    if (bucket->rate == 0) {
+        return 0;
+    }
+
+    bucket->tokens += bucket->rate * (now - bucket->time) / 1000000.0;
+    if (bucket->tokens > bucket->rate) {
+        bucket->tokens = bucket->rate;
+    }
+    bucket->time = now;
+
+    bucket->tokens -= bytes;
+    if (bucket->tokens >= 0) {
+        return 0;
+    }
+
+    return (int) (-bucket->tokens * 1000 / bucket->rate) + 1;
+}
+
 /******************** HTTP client ********************/
 /* Type http_client represents HTTP client instance
  */
 struct http_client {
-    void       *ptr;       /* Callback's user data */
-    log_ctx    *log;       /* Logging context */
-    GPtrArray  *pending;   /* Pending queries */
-    void       (*onerror)( /* Callback to be called on transport error */
+    void        *ptr;       /* Callback's user data */
+    log_ctx     *log;       /* Logging context */
+    GPtrArray   *pending;   /* Pending queries */
+    void        (*onerror)( /* Callback to be called on transport error */
             void *ptr, error err);
+    http_bucket bucket;     /* Per-device image transfer pacing */
 };
 
 /* Create new http_client
@@ -654,6 +803,7 @@ http_client_new (log_ctx *log, void *ptr)
     client->ptr = ptr;
     client->log = log;
     client->pending = g_ptr_array_new();
+    http_bucket_init(&client->bucket, conf.bandwidth_device);
     return client;
 }
 
@@ -713,11 +863,23 @@ struct http_query {
     http_client       *client;                  /* Client that owns the query */
     http_uri          *uri;                     /* Query URI */
     SoupMessage       *msg;                     /* Underlying SOUP message */
+    char              *unix_path;               /* AF_UNIX socket path or NULL */
+    HTTP_PRIORITY     prio;                     /* Priority class */
     uintptr_t         uintptr;                  /* User-defined parameter */
     void              (*callback) (void *ptr,   /* Completion callback */
                                 http_query *q);
     http_query_cached *cached;                  /* Cached data */
     http_query        *prev, *next;             /* In the http_query_list */
+
+    /* Local queries, completed without network activity */
+    bool              local;                    /* Query is local */
+    int               local_status;             /* HTTP status to return */
+    int               local_delay;              /* Delay, milliseconds */
+    eloop_timer       *local_timer;             /* Delay timer */
+
+    /* Bandwidth pacing */
+    gulong            pace_handler;             /* "got-chunk" handler */
+    eloop_timer       *pace_timer;              /* Resume timer */
 };
 
 /* Insert http_query into http_query_list
@@ -756,7 +918,12 @@ static void
 http_query_free (http_query *q)
 {
     http_query_list_del(q);
+    if (q->pace_timer != NULL) {
+        eloop_timer_cancel(q->pace_timer);
+    }
     http_uri_free(q->uri);
+    g_free(q->unix_path);
+    memstat_free(MEMSTAT_HTTP, sizeof(http_query) + sizeof(http_query_cached));
 
     http_data_unref(q->cached->request_data);
     http_data_unref(q->cached->response_data);
@@ -765,6 +932,12 @@ http_query_free (http_query *q)
     }
 
     g_free(q->cached);
+
+    /* Local queries never reach SoupSession, so we still own msg */
+    if (q->local) {
+        g_object_unref(q->msg);
+    }
+
     g_free(q);
 }
 
@@ -807,6 +980,108 @@ http_query_callback (SoupSession *session, SoupMessage *msg, gpointer userdata)
     }
 }
 
+/* Completion timer callback for local queries
+ */
+static void
+http_query_local_callback (void *data)
+{
+    http_query *q = data;
+
+    q->local_timer = NULL;
+    soup_message_set_status(q->msg, q->local_status);
+    http_query_callback(NULL, q->msg, q);
+}
+
+/* Free SoupSession, used for AF_UNIX socket
+ */
+static void
+http_session_unix_free (gpointer p)
+{
+    SoupSession *session = p;
+
+    soup_session_abort(session);
+    g_object_unref(session);
+}
+
+/* Get SoupSession, that sends queries via AF_UNIX socket.
+ *
+ * Sessions are created on demand, one per socket, and
+ * kept alive until HTTP client is stopped, so connections
+ * to local proxies are reused between queries
+ */
+static SoupSession*
+http_session_unix (const char *path)
+{
+    SoupSession        *session;
+    struct sockaddr_un addr;
+    GSocketAddress     *connectable;
+
+    session = g_hash_table_lookup(http_unix_sessions, path);
+    if (session != NULL) {
+        return session;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    connectable = g_socket_address_new_from_native(&addr, sizeof(addr));
+    session = soup_session_new_with_options(
+        SOUP_SESSION_REMOTE_CONNECTABLE, connectable,
+        SOUP_SESSION_MAX_CONNS_PER_HOST, HTTP_MAX_CONNS_PER_HOST,
+        NULL);
+    g_object_unref(connectable);
+
+    g_hash_table_insert(http_unix_sessions, g_strdup(path), session);
+
+    return session;
+}
+
+/* Get SoupSession, the query is sent via
+ */
+static SoupSession*
+http_query_session (http_query *q)
+{
+    if (q->unix_path != NULL) {
+        return http_session_unix(q->unix_path);
+    }
+
+    return http_session;
+}
+
+/* Resume paused transfer. Called via pace_timer
+ */
+static void
+http_query_pace_resume (void *data)
+{
+    http_query *q = data;
+
+    q->pace_timer = NULL;
+    soup_session_unpause_message(http_query_session(q), q->msg);
+}
+
+/* "got-chunk" signal handler. Consumes tokens from per-device
+ * and total buckets and, if any of them is in debt, pauses
+ * transfer until the debt is repaid
+ */
+static void
+http_query_pace_got_chunk (SoupMessage *msg, SoupBuffer *chunk,
+        gpointer userdata)
+{
+    http_query *q = userdata;
+    gint64     now = g_get_monotonic_time();
+    int        delay, delay_total;
+
+    delay = http_bucket_consume(&q->client->bucket, chunk->length, now);
+    delay_total = http_bucket_consume(&http_bucket_total, chunk->length, now);
+    delay = MAX(delay, delay_total);
+
+    if (delay > 0 && q->pace_timer == NULL) {
+        soup_session_pause_message(http_query_session(q), msg);
+        q->pace_timer = eloop_timer_new(delay, http_query_pace_resume, q);
+    }
+}
+
 /* Set Host header in HTTP request
  */
 static void
@@ -816,6 +1091,12 @@ http_query_set_host (http_query *q)
     size_t                len;
     const struct sockaddr *addr = http_uri_addr(q->uri);
 
+    if (q->unix_path != NULL) {
+        soup_message_headers_replace(q->msg->request_headers,
+            "Host", "localhost");
+        return;
+    }
+
     if (addr != NULL) {
         ip_straddr s = ip_straddr_from_sockaddr(addr);
         soup_message_headers_replace(q->msg->request_headers, "Host", s.text);
@@ -849,8 +1130,30 @@ http_query_new (http_client *client, http_uri *uri, const char *method,
 
     q->client = client;
     q->uri = uri;
-    q->msg = soup_message_new_from_uri(method, uri->parsed);
+
+    if (http_uri_is_unix(uri)) {
+        /* SOUP knows nothing about unix://, so message is created
+         * for http://localhost/path and sent via the session,
+         * connected to the socket
+         */
+        SoupURI *msg_uri = soup_uri_copy(uri->parsed);
+
+        soup_uri_set_scheme(msg_uri, SOUP_URI_SCHEME_HTTP);
+        soup_uri_set_host(msg_uri, "localhost");
+        soup_uri_set_port(msg_uri, 80);
+
+        q->msg = soup_message_new_from_uri(method, msg_uri);
+        q->unix_path = http_uri_unix_path(uri);
+        soup_uri_free(msg_uri);
+    } else {
+        q->msg = soup_message_new_from_uri(method, uri->parsed);
+    }
+
+    /* Only queries, explicitly tagged as image transfers, are paced */
+    http_query_set_priority(q, HTTP_PRIORITY_STATUS);
+
     q->cached = g_new0(http_query_cached, 1);
+    memstat_alloc(MEMSTAT_HTTP, sizeof(http_query) + sizeof(http_query_cached));
 
     if (body != NULL) {
         soup_message_set_request(q->msg, content_type, SOUP_MEMORY_TAKE,
@@ -869,8 +1172,18 @@ http_query_new (http_client *client, http_uri *uri, const char *method,
      *
      * Looks like Kyocera firmware bug. Force connection to close
      * as a workaround
+     *
+     * Local proxies, connected via AF_UNIX socket, don't suffer
+     * from this problem, and their connections are kept alive
      */
-    soup_message_headers_replace(q->msg->request_headers, "Connection", "close");
+    if (q->unix_path == NULL) {
+        soup_message_headers_replace(q->msg->request_headers,
+            "Connection", "close");
+    } else if (strlen(q->unix_path) >= sizeof(((struct sockaddr_un*) 0)->sun_path)) {
+        log_debug(client->log, "HTTP %s: socket path too long", q->unix_path);
+        http_query_set_local_response(q, SOUP_STATUS_CANT_CONNECT, 0,
+            NULL, NULL, 0);
+    }
 
     return q;
 }
@@ -901,7 +1214,55 @@ http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q))
 
     log_debug(q->client->log, "HTTP %s %s", q->msg->method, http_uri_str(q->uri));
 
-    soup_session_queue_message(http_session, q->msg, http_query_callback, q);
+    if (q->local) {
+        q->local_timer = eloop_timer_new(q->local_delay,
+                http_query_local_callback, q);
+        return;
+    }
+
+    if (q->prio == HTTP_PRIORITY_IMAGE &&
+        (q->client->bucket.rate != 0 || http_bucket_total.rate != 0)) {
+        q->pace_handler = g_signal_connect(q->msg, "got-chunk",
+            G_CALLBACK(http_query_pace_got_chunk), q);
+    }
+
+    soup_session_queue_message(http_query_session(q), q->msg,
+        http_query_callback, q);
+}
+
+/* Set query priority class. Must be called before http_query_submit()
+ */
+void
+http_query_set_priority (http_query *q, HTTP_PRIORITY prio)
+{
+    SoupMessagePriority soup_prio = SOUP_MESSAGE_PRIORITY_NORMAL;
+
+    q->prio = prio;
+
+    switch (prio) {
+    case HTTP_PRIORITY_DISCOVERY: soup_prio = SOUP_MESSAGE_PRIORITY_LOW; break;
+    case HTTP_PRIORITY_IMAGE:     soup_prio = SOUP_MESSAGE_PRIORITY_NORMAL; break;
+    case HTTP_PRIORITY_STATUS:    soup_prio = SOUP_MESSAGE_PRIORITY_HIGH; break;
+    case HTTP_PRIORITY_CONTROL:   soup_prio = SOUP_MESSAGE_PRIORITY_VERY_HIGH; break;
+    }
+
+    soup_message_set_priority(q->msg, soup_prio);
+}
+
+/* Make query to be completed locally, without any network activity.
+ */
+void
+http_query_set_local_response (http_query *q, int status, int delay,
+        const char *content_type, void *body, size_t size)
+{
+    q->local = true;
+    q->local_status = status;
+    q->local_delay = delay;
+
+    if (body != NULL) {
+        soup_message_set_response(q->msg, content_type, SOUP_MEMORY_TAKE,
+                body, size);
+    }
 }
 
 /* Cancel unfinished http_query. Callback will not be called and
@@ -915,6 +1276,15 @@ http_query_cancel (http_query *q)
     log_assert(client->log, g_ptr_array_find(client->pending, q, NULL));
     g_ptr_array_remove(client->pending, q);
 
+    if (q->local) {
+        if (q->local_timer != NULL) {
+            eloop_timer_cancel(q->local_timer);
+        }
+        soup_message_set_status(q->msg, SOUP_STATUS_CANCELLED);
+        http_query_free(q);
+        return;
+    }
+
     /* Note, if message processing already finished,
      * soup_session_cancel_message() will do literally nothing,
      * and in particular will not update message status,
@@ -922,7 +1292,11 @@ http_query_cancel (http_query *q)
      * messages is set properly
      */
     g_object_ref(q->msg);
-    soup_session_cancel_message(http_session, q->msg, SOUP_STATUS_CANCELLED);
+    if (q->pace_handler != 0) {
+        g_signal_handler_disconnect(q->msg, q->pace_handler);
+    }
+    soup_session_cancel_message(http_query_session(q), q->msg,
+        SOUP_STATUS_CANCELLED);
     soup_message_set_status(q->msg, SOUP_STATUS_CANCELLED);
     g_object_unref(q->msg);
 
@@ -1037,6 +1411,56 @@ http_query_get_response_header(const http_query *q, const char *name)
     return soup_message_headers_get_one(q->msg->response_headers, name);
 }
 
+/* Get Retry-After hint of the response, in milliseconds
+ */
+int
+http_query_retry_after (const http_query *q)
+{
+    const char    *val = http_query_get_response_header(q, "Retry-After");
+    char          *end;
+    unsigned long secs;
+    SoupDate      *date;
+    time_t        now;
+
+    if (val == NULL) {
+        return -1;
+    }
+
+    /* Try delay-seconds */
+    while (g_ascii_isspace(*val)) {
+        val ++;
+    }
+
+    if (g_ascii_isdigit(*val)) {
+        secs = strtoul(val, &end, 10);
+        while (g_ascii_isspace(*end)) {
+            end ++;
+        }
+
+        if (*end != '\0') {
+            return -1;
+        }
+
+        return (int) MIN(secs, INT_MAX / 1000) * 1000;
+    }
+
+    /* Try HTTP-date */
+    date = soup_date_new_from_string(val);
+    if (date == NULL) {
+        return -1;
+    }
+
+    secs = 0;
+    now = time(NULL);
+    if (soup_date_to_time_t(date) > now) {
+        secs = soup_date_to_time_t(date) - now;
+    }
+
+    soup_date_free(date);
+
+    return (int) MIN(secs, INT_MAX / 1000) * 1000;
+}
+
 /* Get request data
  */
 http_data*
@@ -1136,7 +1560,10 @@ http_start_stop (bool start)
     if (start) {
         GValue val = G_VALUE_INIT;
 
-        http_session = soup_session_new();
+        http_session = soup_session_new_with_options(
+            SOUP_SESSION_MAX_CONNS, HTTP_MAX_CONNS,
+            SOUP_SESSION_MAX_CONNS_PER_HOST, HTTP_MAX_CONNS_PER_HOST,
+            NULL);
 
         g_value_init(&val, G_TYPE_BOOLEAN);
         g_value_set_boolean(&val, false);
@@ -1146,11 +1573,19 @@ http_start_stop (bool start)
 
         g_object_set_property(G_OBJECT(http_session),
             SOUP_SESSION_SSL_STRICT, &val);
+
+        http_unix_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, http_session_unix_free);
+
+        http_bucket_init(&http_bucket_total, conf.bandwidth_total);
     } else {
         soup_session_abort(http_session);
         g_object_unref(http_session);
         http_session = NULL;
 
+        g_hash_table_destroy(http_unix_sessions);
+        http_unix_sessions = NULL;
+
         /* Note, soup_session_abort() may leave some requests
          * pending, so we must free them here explicitly
          */
@@ -136,6 +136,65 @@ id_colormode_by_sane_name (const char *name)
     return id_by_name(name, strcmp, id_colormode_sane_name_table);
 }
 
+/******************** ID_DECODE_PROFILE ********************/
+/* id_decode_profile_sane_name_table represents ID_DECODE_PROFILE to
+ * SANE name mapping
+ */
+static id_name_table id_decode_profile_sane_name_table[] = {
+    {ID_DECODE_PROFILE_ACCURATE, OPTVAL_DECODE_PROFILE_ACCURATE},
+    {ID_DECODE_PROFILE_FAST,     OPTVAL_DECODE_PROFILE_FAST},
+    {-1, NULL}
+};
+
+/* id_decode_profile_sane_name returns SANE name for the decode profile
+ * For unknown ID returns NULL
+ */
+const char*
+id_decode_profile_sane_name (ID_DECODE_PROFILE id)
+{
+    return id_name(id, id_decode_profile_sane_name_table);
+}
+
+/* id_decode_profile_by_sane_name returns ID_DECODE_PROFILE by its SANE name
+ * For unknown name returns ID_DECODE_PROFILE_UNKNOWN
+ */
+ID_DECODE_PROFILE
+id_decode_profile_by_sane_name (const char *name)
+{
+    return id_by_name(name, strcmp, id_decode_profile_sane_name_table);
+}
+
+/******************** ID_SCANINTENT ********************/
+/* id_scanintent_sane_name_table represents ID_SCANINTENT to
+ * SANE name mapping
+ */
+static id_name_table id_scanintent_sane_name_table[] = {
+    {ID_SCANINTENT_AUTO,          OPTVAL_SCAN_INTENT_AUTO},
+    {ID_SCANINTENT_DOCUMENT,      OPTVAL_SCAN_INTENT_DOCUMENT},
+    {ID_SCANINTENT_TXT_AND_GRAPH, OPTVAL_SCAN_INTENT_TXT_AND_GRAPH},
+    {ID_SCANINTENT_PHOTO,         OPTVAL_SCAN_INTENT_PHOTO},
+    {ID_SCANINTENT_PREVIEW,       OPTVAL_SCAN_INTENT_PREVIEW},
+    {-1, NULL}
+};
+
+/* id_scanintent_sane_name returns SANE name for the scan intent
+ * For unknown ID returns NULL
+ */
+const char*
+id_scanintent_sane_name (ID_SCANINTENT id)
+{
+    return id_name(id, id_scanintent_sane_name_table);
+}
+
+/* id_scanintent_by_sane_name returns ID_SCANINTENT by its SANE name
+ * For unknown name returns ID_SCANINTENT_UNKNOWN
+ */
+ID_SCANINTENT
+id_scanintent_by_sane_name (const char *name)
+{
+    return id_by_name(name, strcasecmp, id_scanintent_sane_name_table);
+}
+
 /******************** ID_FORMAT ********************/
 /* id_format_mime_name_table represents ID_FORMAT to
  * MIME name mapping
@@ -144,6 +203,7 @@ static id_name_table id_format_mime_name_table[] = {
     {ID_FORMAT_JPEG, "image/jpeg"},
     {ID_FORMAT_TIFF, "image/tiff"},
     {ID_FORMAT_PDF,  "application/pdf"},
+    {ID_FORMAT_BMP,  "image/bmp"},
     {-1, NULL}
 };
 
@@ -164,5 +224,69 @@ id_format_by_mime_name (const char *name)
     return id_by_name(name, strcasecmp, id_format_mime_name_table);
 }
 
+/* id_format_sane_name_table represents ID_FORMAT to
+ * SANE name mapping
+ */
+static id_name_table id_format_sane_name_table[] = {
+    {ID_FORMAT_JPEG, OPTVAL_TRANSFER_FORMAT_JPEG},
+    {ID_FORMAT_PDF,  OPTVAL_TRANSFER_FORMAT_PDF},
+    {ID_FORMAT_BMP,  OPTVAL_TRANSFER_FORMAT_BMP},
+    {-1, NULL}
+};
+
+/* id_format_sane_name returns SANE name for the transfer format
+ * For unknown ID returns NULL
+ */
+const char*
+id_format_sane_name (ID_FORMAT id)
+{
+    return id_name(id, id_format_sane_name_table);
+}
+
+/* id_format_by_sane_name returns ID_FORMAT by its SANE name
+ * For unknown name returns ID_FORMAT_UNKNOWN
+ */
+ID_FORMAT
+id_format_by_sane_name (const char *name)
+{
+    return id_by_name(name, strcasecmp, id_format_sane_name_table);
+}
+
+/* id_format_detect detects image format by its signature
+ * For unrecognized data returns ID_FORMAT_UNKNOWN
+ *
+ * Note, WSD "dib" format may come either as BMP file or as a bare
+ * DIB, starting with BITMAPINFOHEADER (40 bytes) or its extended
+ * versions (108 and 124 bytes)
+ */
+ID_FORMAT
+id_format_detect (const void *data, size_t size)
+{
+    const unsigned char *p = data;
+
+    if (size >= 2 && p[0] == 0xff && p[1] == 0xd8) {
+        return ID_FORMAT_JPEG;
+    }
+
+    if (size >= 5 && !memcmp(p, "%PDF-", 5)) {
+        return ID_FORMAT_PDF;
+    }
+
+    if (size >= 4 && (!memcmp(p, "II*\0", 4) || !memcmp(p, "MM\0*", 4))) {
+        return ID_FORMAT_TIFF;
+    }
+
+    if (size >= 2 && p[0] == 'B' && p[1] == 'M') {
+        return ID_FORMAT_BMP;
+    }
+
+    if (size >= 4 && p[1] == 0 && p[2] == 0 && p[3] == 0 &&
+        (p[0] == 40 || p[0] == 108 || p[0] == 124)) {
+        return ID_FORMAT_BMP;
+    }
+
+    return ID_FORMAT_UNKNOWN;
+}
+
 /* vim:ts=8:sw=4:et
  */
@@ -22,6 +22,7 @@ typedef struct {
     char                          errbuf[    /* Error buffer */
                                         JMSG_LENGTH_MAX + 16];
     JDIMENSION                    num_lines; /* Num of lines left to read */
+    ID_DECODE_PROFILE             profile;   /* Decoding profile */
 } image_decoder_jpeg;
 
 /* Free JPEG decoder
@@ -57,6 +58,18 @@ image_decoder_jpeg_begin (image_decoder *decoder, const void *data,
             jpeg->cinfo.out_color_space = JCS_RGB;
         }
 
+        /* Trade some quality for speed, if requested. Note, the
+         * output color space is already the cheapest possible for
+         * our needs: grayscale JPEG is returned as is, and color
+         * JPEG is converted only to RGB, which SANE requires
+         */
+        if (jpeg->profile == ID_DECODE_PROFILE_FAST) {
+            jpeg->cinfo.dct_method = JDCT_IFAST;
+            jpeg->cinfo.do_fancy_upsampling = false;
+            jpeg->cinfo.do_block_smoothing = false;
+            jpeg->cinfo.dither_mode = JDITHER_NONE;
+        }
+
         jpeg_start_decompress(&jpeg->cinfo);
         jpeg->num_lines = jpeg->cinfo.image_height;
 
@@ -147,6 +160,17 @@ image_decoder_jpeg_set_window (image_decoder *decoder, image_window *win)
 #endif
 }
 
+/* Set decoding profile
+ */
+static void
+image_decoder_jpeg_set_profile (image_decoder *decoder,
+        ID_DECODE_PROFILE profile)
+{
+    image_decoder_jpeg *jpeg = (image_decoder_jpeg*) decoder;
+
+    jpeg->profile = profile;
+}
+
 /* Read next line of image
  */
 static error
@@ -212,6 +236,7 @@ image_decoder_jpeg_new (void)
     jpeg->decoder.get_params = image_decoder_jpeg_get_params;
     jpeg->decoder.set_window = image_decoder_jpeg_set_window;
     jpeg->decoder.read_line = image_decoder_jpeg_read_line;
+    jpeg->decoder.set_profile = image_decoder_jpeg_set_profile;
 
     jpeg->cinfo.err = jpeg_std_error(&jpeg->jerr);
     jpeg->jerr.output_message = image_decoder_jpeg_output_message;
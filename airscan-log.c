@@ -118,6 +118,17 @@ log_ctx_new (const char *name)
     return log;
 }
 
+/* log_ctx_set_name changes name of the logging context. The
+ * associated trace, if any, is reopened under the new name
+ */
+void
+log_ctx_set_name (log_ctx *log, const char *name)
+{
+    log->name = name;
+    trace_close(log->trace);
+    log->trace = trace_open(name);
+}
+
 /* log_ctx_free destroys logging context
  */
 void
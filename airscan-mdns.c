@@ -64,9 +64,83 @@ static AvahiTimeout *mdns_avahi_restart_timer;
 static AvahiClient *mdns_avahi_client;
 static bool mdns_avahi_browser_running;
 static AvahiServiceBrowser *mdns_avahi_browser[NUM_MDNS_SERVICE];
+static bool mdns_started;
 static bool mdns_initscan[NUM_MDNS_SERVICE];
 static int mdns_initscan_count[NUM_ZEROCONF_METHOD];
 
+/* Avahi entry points. Avahi libraries are not linked directly,
+ * but loaded on demand, when MDNS discovery is started
+ */
+static __typeof__(avahi_address_snprint)       *mdns_avahi_address_snprint;
+static __typeof__(avahi_strerror)              *mdns_avahi_strerror;
+static __typeof__(avahi_string_list_find)      *mdns_avahi_string_list_find;
+static __typeof__(avahi_client_new)            *mdns_avahi_client_new;
+static __typeof__(avahi_client_free)           *mdns_avahi_client_free;
+static __typeof__(avahi_client_errno)          *mdns_avahi_client_errno;
+static __typeof__(avahi_service_browser_new)   *mdns_avahi_service_browser_new;
+static __typeof__(avahi_service_browser_free)  *mdns_avahi_service_browser_free;
+static __typeof__(avahi_service_resolver_new)  *mdns_avahi_service_resolver_new;
+static __typeof__(avahi_service_resolver_free) *mdns_avahi_service_resolver_free;
+static __typeof__(avahi_glib_poll_new)         *mdns_avahi_glib_poll_new;
+static __typeof__(avahi_glib_poll_free)        *mdns_avahi_glib_poll_free;
+static __typeof__(avahi_glib_poll_get)         *mdns_avahi_glib_poll_get;
+
+static const char * const mdns_avahi_common_sonames[] = {
+    "libavahi-common.so.3", NULL
+};
+
+static const dll_sym mdns_avahi_common_syms[] = {
+    {"avahi_address_snprint", (void**) &mdns_avahi_address_snprint},
+    {"avahi_strerror", (void**) &mdns_avahi_strerror},
+    {"avahi_string_list_find", (void**) &mdns_avahi_string_list_find},
+    {NULL, NULL}
+};
+
+static const char * const mdns_avahi_client_sonames[] = {
+    "libavahi-client.so.3", NULL
+};
+
+static const dll_sym mdns_avahi_client_syms[] = {
+    {"avahi_client_new", (void**) &mdns_avahi_client_new},
+    {"avahi_client_free", (void**) &mdns_avahi_client_free},
+    {"avahi_client_errno", (void**) &mdns_avahi_client_errno},
+    {"avahi_service_browser_new", (void**) &mdns_avahi_service_browser_new},
+    {"avahi_service_browser_free", (void**) &mdns_avahi_service_browser_free},
+    {"avahi_service_resolver_new", (void**) &mdns_avahi_service_resolver_new},
+    {"avahi_service_resolver_free",
+            (void**) &mdns_avahi_service_resolver_free},
+    {NULL, NULL}
+};
+
+static const char * const mdns_avahi_glib_sonames[] = {
+    "libavahi-glib.so.1", NULL
+};
+
+static const dll_sym mdns_avahi_glib_syms[] = {
+    {"avahi_glib_poll_new", (void**) &mdns_avahi_glib_poll_new},
+    {"avahi_glib_poll_free", (void**) &mdns_avahi_glib_poll_free},
+    {"avahi_glib_poll_get", (void**) &mdns_avahi_glib_poll_get},
+    {NULL, NULL}
+};
+
+static dll mdns_avahi_common_dll = {
+    .name = "avahi-common",
+    .sonames = mdns_avahi_common_sonames,
+    .syms = mdns_avahi_common_syms
+};
+
+static dll mdns_avahi_client_dll = {
+    .name = "avahi-client",
+    .sonames = mdns_avahi_client_sonames,
+    .syms = mdns_avahi_client_syms
+};
+
+static dll mdns_avahi_glib_dll = {
+    .name = "avahi-glib",
+    .sonames = mdns_avahi_glib_sonames,
+    .syms = mdns_avahi_glib_syms
+};
+
 /* Forward declarations
  */
 static void
@@ -107,7 +181,7 @@ static void
 mdns_perror (const char *name, AvahiProtocol protocol, const char *action)
 {
     mdns_debug(name, protocol, action,
-            avahi_strerror(avahi_client_errno(mdns_avahi_client)));
+            mdns_avahi_strerror(mdns_avahi_client_errno(mdns_avahi_client)));
 }
 
 /* Get MDNS_SERVICE name
@@ -324,7 +398,7 @@ static void
 mdns_finding_kill_resolvers (mdns_finding *mdns)
 {
     while (mdns->resolvers->len > 0) {
-        avahi_service_resolver_free(mdns->resolvers->pdata[0]);
+        mdns_avahi_service_resolver_free(mdns->resolvers->pdata[0]);
         g_ptr_array_remove_index(mdns->resolvers, 0);
     }
 }
@@ -375,12 +449,12 @@ mdns_make_escl_endpoint (ZEROCONF_METHOD method, const AvahiAddress *addr,
     }
 
     if (addr->proto == AVAHI_PROTO_INET) {
-        avahi_address_snprint(str_addr, sizeof(str_addr), addr);
+        mdns_avahi_address_snprint(str_addr, sizeof(str_addr), addr);
     } else {
         size_t      len;
 
         str_addr[0] = '[';
-        avahi_address_snprint(str_addr + 1, sizeof(str_addr) - 2, addr);
+        mdns_avahi_address_snprint(str_addr + 1, sizeof(str_addr) - 2, addr);
         len = strlen(str_addr);
 
         /* Connect to link-local address requires explicit scope */
@@ -444,12 +518,12 @@ mdns_avahi_resolver_found (mdns_finding *mdns, MDNS_SERVICE service,
     ZEROCONF_METHOD   method = mdns->finding.method;
 
     /* Decode TXT record */
-    s = avahi_string_list_find(txt, "ty");
+    s = mdns_avahi_string_list_find(txt, "ty");
     if (s != NULL && s->size > 3) {
         txt_ty = (char*) s->text + 3;
     }
 
-    s = avahi_string_list_find(txt, "uuid");
+    s = mdns_avahi_string_list_find(txt, "uuid");
     if (s != NULL && s->size > 5) {
         txt_uuid = (char*) s->text + 5;
     }
@@ -457,7 +531,7 @@ mdns_avahi_resolver_found (mdns_finding *mdns, MDNS_SERVICE service,
     switch (service) {
     case MDNS_SERVICE_IPP_TCP:
     case MDNS_SERVICE_IPPS_TCP:
-        s = avahi_string_list_find(txt, "scan");
+        s = mdns_avahi_string_list_find(txt, "scan");
         if (s != NULL && s->size > 5) {
             txt_scan = (char*) s->text + 5;
         }
@@ -470,7 +544,7 @@ mdns_avahi_resolver_found (mdns_finding *mdns, MDNS_SERVICE service,
     switch (service) {
     case MDNS_SERVICE_USCAN_TCP:
     case MDNS_SERVICE_USCANS_TCP:
-        s = avahi_string_list_find(txt, "rs");
+        s = mdns_avahi_string_list_find(txt, "rs");
         if (s != NULL && s->size > 3) {
             txt_rs = (char*) s->text + 3;
         }
@@ -629,7 +703,7 @@ mdns_avahi_browser_callback (AvahiServiceBrowser *b, AvahiIfIndex interface,
 
         /* Initiate resolver */
         AvahiServiceResolver *r;
-        r = avahi_service_resolver_new(mdns_avahi_client, interface,
+        r = mdns_avahi_service_resolver_new(mdns_avahi_client, interface,
                 protocol, name, type, domain, AVAHI_PROTO_UNSPEC, 0,
                 mdns_avahi_resolver_callback, mdns);
 
@@ -675,15 +749,15 @@ mdns_avahi_browser_start_for_type (MDNS_SERVICE service, const char *type)
 
     log_assert(NULL, mdns_avahi_browser[service] == NULL);
 
-    mdns_avahi_browser[service] = avahi_service_browser_new(mdns_avahi_client,
-            AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, type, NULL,
+    mdns_avahi_browser[service] = mdns_avahi_service_browser_new(
+            mdns_avahi_client, AVAHI_IF_UNSPEC, AVAHI_PROTO_UNSPEC, type, NULL,
             0, mdns_avahi_browser_callback, (void*) service);
 
     ok = mdns_avahi_browser[service] != NULL;
 
     if (!ok) {
         log_debug(NULL, "MDNS: avahi_service_browser_new(%s): %s",
-            type, avahi_strerror(avahi_client_errno(mdns_avahi_client)));
+            type, mdns_avahi_strerror(mdns_avahi_client_errno(mdns_avahi_client)));
     }
 
     if (ok && mdns_initscan[service]) {
@@ -721,7 +795,7 @@ mdns_avahi_browser_stop (void)
 
     for (service = 0; service < NUM_MDNS_SERVICE; service ++) {
         if (mdns_avahi_browser[service] != NULL) {
-            avahi_service_browser_free(mdns_avahi_browser[service]);
+            mdns_avahi_service_browser_free(mdns_avahi_browser[service]);
             mdns_avahi_browser[service] = NULL;
             if (mdns_initscan[service]) {
                 mdns_initscan_count_dec(mdns_service_to_method(service));
@@ -748,7 +822,7 @@ mdns_avahi_client_callback (AvahiClient *client, AvahiClientState state,
     case AVAHI_CLIENT_S_REGISTERING:
     case AVAHI_CLIENT_S_RUNNING:
     case AVAHI_CLIENT_S_COLLISION:
-        /* Note, first callback may come before avahi_client_new()
+        /* Note, first callback may come before mdns_avahi_client_new()
          * return, so mdns_avahi_client may be still unset.
          * Fix it here
          */
@@ -787,7 +861,7 @@ static void
 mdns_avahi_client_stop (void)
 {
     if (mdns_avahi_client != NULL) {
-        avahi_client_free(mdns_avahi_client);
+        mdns_avahi_client_free(mdns_avahi_client);
         mdns_avahi_client = NULL;
     }
 }
@@ -801,7 +875,7 @@ mdns_avahi_client_start (void)
 
     log_assert(NULL, mdns_avahi_client == NULL);
 
-    mdns_avahi_client = avahi_client_new (mdns_avahi_poll,
+    mdns_avahi_client = mdns_avahi_client_new (mdns_avahi_poll,
         AVAHI_CLIENT_NO_FAIL, mdns_avahi_client_callback, NULL, &error);
 }
 
@@ -820,20 +894,50 @@ mdns_avahi_client_restart_defer (void)
     mdns_avahi_poll->timeout_update(mdns_avahi_restart_timer, &tv);
 }
 
+/* Load Avahi libraries
+ */
+static error
+mdns_avahi_load (void)
+{
+    error err;
+
+    err = dll_load(&mdns_avahi_common_dll);
+    if (err == NULL) {
+        err = dll_load(&mdns_avahi_client_dll);
+    }
+    if (err == NULL) {
+        err = dll_load(&mdns_avahi_glib_dll);
+    }
+
+    return err;
+}
+
+/* Disable MDNS discovery, reporting initial scan as done
+ */
+static void
+mdns_disable (void)
+{
+    log_debug(NULL, "MDNS: devices discovery disabled");
+    zeroconf_finding_done(ZEROCONF_MDNS_HINT);
+    zeroconf_finding_done(ZEROCONF_USCAN_TCP);
+    zeroconf_finding_done(ZEROCONF_USCANS_TCP);
+}
+
 /* Initialize MDNS
+ *
+ * Discovery itself is started later, by mdns_start()
  */
 SANE_Status
 mdns_init (void)
 {
-    int i;
+    int   i;
 
     ll_init(&mdns_finding_list);
+    mdns_started = false;
 
     if (!conf.discovery) {
-        log_debug(NULL, "MDNS: devices discovery disabled");
-        zeroconf_finding_done(ZEROCONF_MDNS_HINT);
-        zeroconf_finding_done(ZEROCONF_USCAN_TCP);
-        zeroconf_finding_done(ZEROCONF_USCANS_TCP);
+        mdns_started = true;
+        mdns_disable();
         return SANE_STATUS_GOOD;
     }
 
@@ -845,27 +949,56 @@ mdns_init (void)
         mdns_initscan_count[i] = 0;
     }
 
-    mdns_avahi_glib_poll = eloop_new_avahi_poll();
+    return SANE_STATUS_GOOD;
+}
+
+/* Start MDNS discovery, if not started yet
+ *
+ * Avahi libraries are loaded here, on the first call, so applications
+ * that never look for network scanners don't load them at all.
+ * Returns true, if discovery was started by this call
+ */
+bool
+mdns_start (void)
+{
+    error err;
+
+    if (mdns_started) {
+        return false;
+    }
+
+    mdns_started = true;
+
+    err = mdns_avahi_load();
+    if (err != NULL) {
+        log_debug(NULL, "MDNS: %s", ESTRING(err));
+        mdns_disable();
+        return true;
+    }
+
+    mdns_avahi_glib_poll = eloop_new_avahi_poll(mdns_avahi_glib_poll_new);
     if (mdns_avahi_glib_poll == NULL) {
-        return SANE_STATUS_NO_MEM;
+        mdns_disable();
+        return true;
     }
 
-    mdns_avahi_poll = avahi_glib_poll_get(mdns_avahi_glib_poll);
+    mdns_avahi_poll = mdns_avahi_glib_poll_get(mdns_avahi_glib_poll);
 
     mdns_avahi_restart_timer =
             mdns_avahi_poll->timeout_new(mdns_avahi_poll, NULL,
                 mdns_avahi_restart_timer_callback, NULL);
 
-    if (mdns_avahi_restart_timer == NULL) {
-        return SANE_STATUS_NO_MEM;
+    if (mdns_avahi_restart_timer != NULL) {
+        mdns_avahi_client_start();
     }
 
-    mdns_avahi_client_start();
     if (mdns_avahi_client == NULL) {
-        return SANE_STATUS_NO_MEM;
+        mdns_cleanup();
+        mdns_started = true;
+        mdns_disable();
     }
 
-    return SANE_STATUS_GOOD;
+    return true;
 }
 
 /* Cleanup MDNS
@@ -883,10 +1016,12 @@ mdns_cleanup (void)
             mdns_avahi_restart_timer = NULL;
         }
 
-        avahi_glib_poll_free(mdns_avahi_glib_poll);
+        mdns_avahi_glib_poll_free(mdns_avahi_glib_poll);
         mdns_avahi_poll = NULL;
         mdns_avahi_glib_poll = NULL;
     }
+
+    mdns_started = false;
 }
 
 /* vim:ts=8:sw=4:et
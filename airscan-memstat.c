@@ -0,0 +1,86 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Memory accounting
+ */
+
+#include "airscan.h"
+
+/* Per-subsystem counters
+ */
+typedef struct {
+    size_t current; /* Currently allocated bytes */
+    size_t peak;    /* Peak of current */
+    size_t count;   /* Total count of allocations */
+} memstat_counters;
+
+/* Static variables
+ */
+static memstat_counters memstat_table[NUM_MEMSTAT];
+
+/* Subsystem names, for dumping
+ */
+static const char *memstat_names[NUM_MEMSTAT] = {
+    [MEMSTAT_HTTP]     = "http",
+    [MEMSTAT_XML]      = "xml",
+    [MEMSTAT_DEVICE]   = "device",
+    [MEMSTAT_ZEROCONF] = "zeroconf",
+    [MEMSTAT_WSDD]     = "wsdd"
+};
+
+/* Account allocation of size bytes by the subsystem
+ */
+void
+memstat_alloc (MEMSTAT tag, size_t size)
+{
+    memstat_counters *c = &memstat_table[tag];
+    size_t           current, peak;
+
+    current = __atomic_add_fetch(&c->current, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->count, 1, __ATOMIC_RELAXED);
+
+    peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+    while (current > peak &&
+           !__atomic_compare_exchange_n(&c->peak, &peak, current, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        ;
+    }
+}
+
+/* Account release of size bytes by the subsystem
+ */
+void
+memstat_free (MEMSTAT tag, size_t size)
+{
+    __atomic_sub_fetch(&memstat_table[tag].current, size, __ATOMIC_RELAXED);
+}
+
+/* Dump memory accounting counters to the log and to the protocol trace
+ */
+void
+memstat_dump (log_ctx *log)
+{
+    trace *t = log != NULL ? log_ctx_trace(log) : NULL;
+    int   i;
+
+    trace_printf(t, "-----");
+    for (i = 0; i < NUM_MEMSTAT; i ++) {
+        memstat_counters *c = &memstat_table[i];
+        size_t           current, peak, count;
+
+        current = __atomic_load_n(&c->current, __ATOMIC_RELAXED);
+        peak = __atomic_load_n(&c->peak, __ATOMIC_RELAXED);
+        count = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+
+        log_debug(log, "memory: %-8s current=%zu peak=%zu allocs=%zu",
+            memstat_names[i], current, peak, count);
+        trace_printf(t, "Memory %-8s current=%zu peak=%zu allocs=%zu",
+            memstat_names[i], current, peak, count);
+    }
+    trace_printf(t, "");
+}
+
+/* vim:ts=8:sw=4:et
+ */
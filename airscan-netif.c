@@ -8,6 +8,7 @@
 
 #include "airscan.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -256,6 +257,92 @@ netif_diff_compute (netif_addr *list1, netif_addr *list2)
     return diff;
 }
 
+/* Get speed of the network link, used to reach the given
+ * address, in Mbit/s
+ *
+ * The outgoing interface is found by connecting an UDP socket to
+ * the address (no packets are sent) and looking up the local address
+ * it is bound to. Returns -1, if speed cannot be determined (say,
+ * on wireless interfaces, which don't report it)
+ */
+int
+netif_link_speed (const struct sockaddr *addr)
+{
+    struct sockaddr_storage local;
+    socklen_t               len = sizeof(local);
+    struct ifaddrs          *ifa, *ifp;
+    char                    path[128] = "";
+    int                     fd, rc, speed = -1;
+    FILE                    *fp;
+
+    /* Find local address */
+    fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    rc = connect(fd, addr, addr->sa_family == AF_INET6 ?
+        sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+    if (rc == 0) {
+        rc = getsockname(fd, (struct sockaddr*) &local, &len);
+    }
+    close(fd);
+
+    if (rc < 0) {
+        return -1;
+    }
+
+    /* Find interface with this address */
+    if (getifaddrs(&ifa) < 0) {
+        return -1;
+    }
+
+    for (ifp = ifa; ifp != NULL && path[0] == '\0'; ifp = ifp->ifa_next) {
+        bool match = false;
+
+        if (ifp->ifa_addr == NULL ||
+            ifp->ifa_addr->sa_family != local.ss_family) {
+            continue;
+        }
+
+        switch (local.ss_family) {
+        case AF_INET:
+            match = !memcmp(&((struct sockaddr_in*) ifp->ifa_addr)->sin_addr,
+                &((struct sockaddr_in*) &local)->sin_addr,
+                sizeof(struct in_addr));
+            break;
+
+        case AF_INET6:
+            match = !memcmp(&((struct sockaddr_in6*) ifp->ifa_addr)->sin6_addr,
+                &((struct sockaddr_in6*) &local)->sin6_addr,
+                sizeof(struct in6_addr));
+            break;
+        }
+
+        if (match) {
+            snprintf(path, sizeof(path), "/sys/class/net/%s/speed",
+                ifp->ifa_name);
+        }
+    }
+
+    freeifaddrs(ifa);
+
+    /* Read the link speed */
+    if (path[0] == '\0') {
+        return -1;
+    }
+
+    fp = fopen(path, "r");
+    if (fp != NULL) {
+        if (fscanf(fp, "%d", &speed) != 1 || speed <= 0) {
+            speed = -1;
+        }
+        fclose(fp);
+    }
+
+    return speed;
+}
+
 /* Network interfaces addresses change notifier
  */
 struct netif_notifier {
@@ -0,0 +1,276 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * PDF image decoder
+ *
+ * Scanner-produced PDF files are very simple: each page is a single
+ * image XObject, typically DCT-compressed. So instead of using a real
+ * PDF engine, we just locate the JPEG stream of the image and hand it
+ * over to the JPEG decoder
+ */
+#define _GNU_SOURCE
+#include <string.h>
+
+#include "airscan.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+/* PDF image decoder
+ */
+typedef struct {
+    image_decoder decoder; /* Base class */
+    image_decoder *jpeg;   /* JPEG decoder for the embedded image */
+} image_decoder_pdf;
+
+/* Find string within the memory range. Returns NULL if not found
+ */
+static const char*
+pdf_find (const char *beg, const char *end, const char *s)
+{
+    return memmem(beg, end - beg, s, strlen(s));
+}
+
+/* Find the last occurrence of string within the memory range
+ */
+static const char*
+pdf_find_last (const char *beg, const char *end, const char *s)
+{
+    size_t len = strlen(s);
+    const char *p;
+
+    for (p = end - len; p >= beg; p --) {
+        if (!memcmp(p, s, len)) {
+            return p;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get direct integer value of the dictionary entry, or -1, if entry
+ * is missed or its value is an indirect reference
+ */
+static long
+pdf_dict_int (const char *dict, const char *end, const char *key)
+{
+    const char *p = pdf_find(dict, end, key);
+    char       *next;
+    long       val;
+
+    if (p == NULL) {
+        return -1;
+    }
+
+    p += strlen(key);
+    if (p >= end || isalnum((unsigned char) *p)) {
+        return -1;
+    }
+
+    val = strtol(p, &next, 10);
+    if (next == p || val < 0) {
+        return -1;
+    }
+
+    /* "N G R" is an indirect reference */
+    p = next;
+    while (p < end && isspace((unsigned char) *p)) {
+        p ++;
+    }
+
+    if (p < end && isdigit((unsigned char) *p)) {
+        return -1;
+    }
+
+    return val;
+}
+
+/* Locate the JPEG stream of the largest DCT-compressed image
+ * within the PDF file
+ */
+static error
+pdf_find_jpeg (const char *data, size_t size,
+        const char **jpeg_out, size_t *jpeg_size_out)
+{
+    const char *end = data + size;
+    const char *p = data;
+    const char *jpeg = NULL;
+    size_t     jpeg_size = 0;
+
+    if (size < 5 || memcmp(data, "%PDF-", 5)) {
+        return ERROR("PDF: invalid header");
+    }
+
+    while ((p = pdf_find(p, end, "stream")) != NULL) {
+        const char *dict, *beg, *stop;
+        long       len;
+
+        /* Skip "endstream" */
+        if (p - data >= 3 && !memcmp(p - 3, "end", 3)) {
+            p += 6;
+            continue;
+        }
+
+        /* Find the stream dictionary */
+        dict = pdf_find_last(data, p, " obj");
+        if (dict == NULL) {
+            dict = data;
+        }
+
+        /* Find the stream data */
+        beg = p + 6;
+        if (beg < end && *beg == '\r') {
+            beg ++;
+        }
+        if (beg < end && *beg == '\n') {
+            beg ++;
+        }
+
+        len = pdf_dict_int(dict, p, "/Length");
+        if (len >= 0 && len <= end - beg) {
+            stop = beg + len;
+        } else {
+            stop = pdf_find(beg, end, "endstream");
+            if (stop == NULL) {
+                break;
+            }
+        }
+
+        /* Check it is the image we are looking for */
+        if (pdf_find(dict, p, "/Image") != NULL &&
+            pdf_find(dict, p, "/DCTDecode") != NULL &&
+            (size_t) (stop - beg) > jpeg_size) {
+            jpeg = beg;
+            jpeg_size = stop - beg;
+        }
+
+        p = stop;
+    }
+
+    if (jpeg == NULL) {
+        return ERROR("PDF: DCT-compressed image not found");
+    }
+
+    *jpeg_out = jpeg;
+    *jpeg_size_out = jpeg_size;
+
+    return NULL;
+}
+
+/* Free PDF decoder
+ */
+static void
+image_decoder_pdf_free (image_decoder *decoder)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    image_decoder_free(pdf->jpeg);
+    g_free(pdf);
+}
+
+/* Begin PDF decoding
+ */
+static error
+image_decoder_pdf_begin (image_decoder *decoder, const void *data,
+        size_t size)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+    const char        *jpeg;
+    size_t            jpeg_size;
+    error             err;
+
+    err = pdf_find_jpeg(data, size, &jpeg, &jpeg_size);
+    if (err == NULL) {
+        err = image_decoder_begin(pdf->jpeg, jpeg, jpeg_size);
+    }
+
+    return err;
+}
+
+/* Reset PDF decoder
+ */
+static void
+image_decoder_pdf_reset (image_decoder *decoder)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    image_decoder_reset(pdf->jpeg);
+}
+
+/* Get bytes count per pixel
+ */
+static int
+image_decoder_pdf_get_bytes_per_pixel (image_decoder *decoder)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    return image_decoder_get_bytes_per_pixel(pdf->jpeg);
+}
+
+/* Get image parameters
+ */
+static void
+image_decoder_pdf_get_params (image_decoder *decoder, SANE_Parameters *params)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    image_decoder_get_params(pdf->jpeg, params);
+}
+
+/* Set clipping window
+ */
+static error
+image_decoder_pdf_set_window (image_decoder *decoder, image_window *win)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    return image_decoder_set_window(pdf->jpeg, win);
+}
+
+/* Set decoding profile
+ */
+static void
+image_decoder_pdf_set_profile (image_decoder *decoder,
+        ID_DECODE_PROFILE profile)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    image_decoder_set_profile(pdf->jpeg, profile);
+}
+
+/* Read next line of image
+ */
+static error
+image_decoder_pdf_read_line (image_decoder *decoder, void *buffer)
+{
+    image_decoder_pdf *pdf = (image_decoder_pdf*) decoder;
+
+    return image_decoder_read_line(pdf->jpeg, buffer);
+}
+
+/* Create PDF image decoder
+ */
+image_decoder*
+image_decoder_pdf_new (void)
+{
+    image_decoder_pdf *pdf = g_new0(image_decoder_pdf, 1);
+
+    pdf->decoder.content_type = "application/pdf";
+    pdf->decoder.free = image_decoder_pdf_free;
+    pdf->decoder.begin = image_decoder_pdf_begin;
+    pdf->decoder.reset = image_decoder_pdf_reset;
+    pdf->decoder.get_bytes_per_pixel = image_decoder_pdf_get_bytes_per_pixel;
+    pdf->decoder.get_params = image_decoder_pdf_get_params;
+    pdf->decoder.set_window = image_decoder_pdf_set_window;
+    pdf->decoder.read_line = image_decoder_pdf_read_line;
+    pdf->decoder.set_profile = image_decoder_pdf_set_profile;
+
+    pdf->jpeg = image_decoder_jpeg_new();
+
+    return &pdf->decoder;
+}
+
+/* vim:ts=8:sw=4:et
+ */
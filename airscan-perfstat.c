@@ -0,0 +1,645 @@
+/* AirScan (a.k.a. eSCL) backend for SANE
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Per-device performance statistics
+ *
+ * For each device, job setup latency, page time and some other
+ * metrics are measured separately for each protocol, and kept as
+ * moving averages. When device speaks both eSCL and WSD, these
+ * statistics are used to choose the faster protocol. Protocol, not
+ * measured enough yet, is tried first, and the slower protocol is
+ * periodically measured again, so the choice follows changes of the
+ * device behavior
+ *
+ * Statistics is kept in the performance history file, so it survives
+ * backend restarts and is shared between processes, using the backend
+ * at the same time. The file has fixed size and layout (see airscan.h),
+ * and is mmap()-ed and updated in place. If file cannot be used, the
+ * statistics is kept in memory only
+ */
+
+#include "airscan.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Count of pages, measured before protocol statistics is trusted
+ */
+#define PERFSTAT_MIN_PAGES      3
+
+/* Weight of the new sample in moving averages is 1/PERFSTAT_EWMA_DIV
+ */
+#define PERFSTAT_EWMA_DIV       4
+
+/* The slower protocol is measured again once per this count of
+ * protocol choices, in average
+ */
+#define PERFSTAT_REPROBE        20
+
+/* Protocol, that failed this many probes or jobs in a row, is
+ * neither measured first nor preferred anymore, until it delivers
+ * a page again
+ */
+#define PERFSTAT_MAX_FAILURES   3
+
+/* If device was not used for this time, in seconds, it is considered
+ * sleeping, and setup latency of the next job is accounted as wake-up
+ */
+#define PERFSTAT_IDLE_TIME      300
+
+/* Name of the performance history file, in the user cache directory
+ */
+#define PERFSTAT_FILE           "sane-airscan/perf-history"
+
+/* Size of the performance history file
+ */
+#define PERFSTAT_FILE_SIZE                              \
+    (sizeof(perfstat_header) +                          \
+     PERFSTAT_MAX_DEVICES * sizeof(perfstat_record))
+
+/* Static variables
+ */
+static int             perfstat_fd = -1;
+static void            *perfstat_map;
+static perfstat_record *perfstat_records;
+
+/* Forward declarations
+ */
+static void
+perfstat_load (void);
+
+/* Lock performance history file. Operation is LOCK_SH for
+ * reading and LOCK_EX for update
+ *
+ * The file is opened here, on the first use, so processes that
+ * never probe network devices don't touch it at all
+ */
+static void
+perfstat_lock (int operation)
+{
+    if (perfstat_records == NULL) {
+        perfstat_load();
+    }
+
+    if (perfstat_fd >= 0) {
+        while (flock(perfstat_fd, operation) < 0 && errno == EINTR)
+            ;
+    }
+}
+
+/* Unlock performance history file
+ */
+static void
+perfstat_unlock (void)
+{
+    if (perfstat_fd >= 0) {
+        flock(perfstat_fd, LOCK_UN);
+    }
+}
+
+/* Get current time, in seconds since Epoch
+ */
+static int64_t
+perfstat_now (void)
+{
+    return g_get_real_time() / 1000000;
+}
+
+/* Find device record. Must be called with file locked
+ */
+static perfstat_record*
+perfstat_find (uuid u)
+{
+    unsigned int i;
+
+    for (i = 0; i < PERFSTAT_MAX_DEVICES; i ++) {
+        perfstat_record *rec = &perfstat_records[i];
+        if (rec->used != 0 && uuid_equal(rec->uuid, u)) {
+            return rec;
+        }
+    }
+
+    return NULL;
+}
+
+/* Begin update of the device record. If device has no record yet,
+ * the free or least recently used one is taken
+ */
+static perfstat_record*
+perfstat_update_begin (uuid u)
+{
+    perfstat_record *rec;
+    unsigned int    i;
+    bool            new = false;
+
+    perfstat_lock(LOCK_EX);
+
+    rec = perfstat_find(u);
+    if (rec == NULL) {
+        rec = &perfstat_records[0];
+        for (i = 1; i < PERFSTAT_MAX_DEVICES; i ++) {
+            if (perfstat_records[i].used < rec->used) {
+                rec = &perfstat_records[i];
+            }
+        }
+
+        if (rec->used != 0) {
+            log_debug(NULL, "perfstat: %s: evicted by %s",
+                rec->uuid.text, u.text);
+        }
+
+        new = true;
+    }
+
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_SEQ_CST);
+
+    if (new) {
+        memset((char*) rec + sizeof(rec->seq), 0,
+            sizeof(*rec) - sizeof(rec->seq));
+        rec->uuid = u;
+    }
+
+    return rec;
+}
+
+/* Finish update of the device record
+ */
+static void
+perfstat_update_end (perfstat_record *rec)
+{
+    rec->used = perfstat_now();
+    __atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_SEQ_CST);
+    perfstat_unlock();
+}
+
+/* Update moving average
+ */
+static void
+perfstat_avg_update (double *avg, double sample, unsigned int count)
+{
+    if (count == 1) {
+        *avg = sample;
+    } else {
+        *avg += (sample - *avg) / PERFSTAT_EWMA_DIV;
+    }
+}
+
+/* Get protocol cost, compared to the other protocol: expected time
+ * of the single-page job, in milliseconds
+ *
+ * Average page time depends on resolution, color mode and format of
+ * the pages, each protocol happened to scan. So to compare like with
+ * like, page time is estimated from the throughput, measured by both
+ * protocols for the same color mode and format, for the same page
+ * size. If there are no such combinations, only setup latency is
+ * compared
+ */
+static double
+perfstat_proto_cost (const perfstat_proto *p, const perfstat_proto *other)
+{
+    double bytes = (p->page_bytes + other->page_bytes) / 2;
+    double page_ms = 0;
+    int    colormode, format, n = 0;
+
+    for (colormode = 0; colormode < NUM_ID_COLORMODE; colormode ++) {
+        for (format = 0; format < NUM_ID_FORMAT; format ++) {
+            double bps = p->page_bps[colormode][format];
+
+            if (bps > 0 && other->page_bps[colormode][format] > 0) {
+                page_ms += bytes * 1000 / bps;
+                n ++;
+            }
+        }
+    }
+
+    return p->setup_ms + (n != 0 ? page_ms / n : 0);
+}
+
+/* Check if protocol keeps failing
+ */
+static bool
+perfstat_proto_failing (const perfstat_proto *p)
+{
+    return p->failures >= PERFSTAT_MAX_FAILURES;
+}
+
+/* Record capabilities query RTT
+ */
+void
+perfstat_probe (uuid u, ID_PROTO proto, int ms)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+    perfstat_proto  *p = &rec->proto[proto];
+
+    p->probes ++;
+    perfstat_avg_update(&p->probe_ms, ms, p->probes);
+
+    perfstat_update_end(rec);
+}
+
+/* Record job setup latency
+ *
+ * If device was idle for a long time, latency above the average
+ * is accounted as the wake-up penalty instead
+ */
+void
+perfstat_job_setup (uuid u, ID_PROTO proto, int ms)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+    perfstat_proto  *p = &rec->proto[proto];
+    int64_t         now = perfstat_now();
+
+    if (p->jobs != 0 && now - rec->last_job > PERFSTAT_IDLE_TIME) {
+        p->wakes ++;
+        perfstat_avg_update(&p->wake_ms, MAX(ms - p->setup_ms, 0),
+            p->wakes);
+    } else {
+        p->jobs ++;
+        perfstat_avg_update(&p->setup_ms, ms, p->jobs);
+    }
+
+    rec->last_job = now;
+
+    perfstat_update_end(rec);
+}
+
+/* Record time from job start to the first page
+ */
+void
+perfstat_first_page (uuid u, ID_PROTO proto, int ms)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+    perfstat_proto  *p = &rec->proto[proto];
+
+    /* p->pages is updated by the subsequent perfstat_page() */
+    perfstat_avg_update(&p->first_page_ms, ms, p->pages + 1);
+
+    perfstat_update_end(rec);
+}
+
+/* Record page transfer
+ */
+void
+perfstat_page (uuid u, ID_PROTO proto, ID_COLORMODE colormode,
+        ID_FORMAT format, size_t bytes, int ms)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+    perfstat_proto  *p = &rec->proto[proto];
+
+    p->pages ++;
+    p->failures = 0;
+    perfstat_avg_update(&p->page_ms, ms, p->pages);
+    perfstat_avg_update(&p->page_bytes, bytes, p->pages);
+
+    if (colormode != ID_COLORMODE_UNKNOWN && format != ID_FORMAT_UNKNOWN) {
+        double *bps = &p->page_bps[colormode][format];
+        double sample = bytes * 1000.0 / MAX(ms, 1);
+
+        if (*bps == 0) {
+            *bps = sample;
+        } else {
+            *bps += (sample - *bps) / PERFSTAT_EWMA_DIV;
+        }
+    }
+
+    perfstat_update_end(rec);
+}
+
+/* Record status retry
+ */
+void
+perfstat_retry (uuid u, ID_PROTO proto)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+
+    rec->proto[proto].retries ++;
+
+    perfstat_update_end(rec);
+}
+
+/* Record failed probe or job
+ */
+void
+perfstat_failure (uuid u, ID_PROTO proto)
+{
+    perfstat_record *rec = perfstat_update_begin(u);
+
+    rec->proto[proto].failures ++;
+
+    perfstat_update_end(rec);
+}
+
+/* Get copy of the device performance history record
+ */
+bool
+perfstat_get (uuid u, perfstat_record *rec)
+{
+    perfstat_record *found;
+
+    perfstat_lock(LOCK_SH);
+    found = perfstat_find(u);
+    if (found != NULL) {
+        *rec = *found;
+    }
+    perfstat_unlock();
+
+    return found != NULL;
+}
+
+/* Choose protocol for the device
+ *
+ * protocols is the set of protocols, supported by device, as
+ * (1 << ID_PROTO) bits. Returns ID_PROTO_UNKNOWN if set is empty
+ */
+ID_PROTO
+perfstat_choose_proto (uuid u, unsigned int protocols)
+{
+    perfstat_record rec;
+    perfstat_proto  *p;
+    ID_PROTO        proto, best = ID_PROTO_UNKNOWN, other;
+
+    /* Handle trivial cases */
+    if (protocols == 0) {
+        return ID_PROTO_UNKNOWN;
+    }
+
+    if (conf.protocol != ID_PROTO_UNKNOWN &&
+        (protocols & (1 << conf.protocol)) != 0) {
+        return conf.protocol;
+    }
+
+    for (proto = 0; proto < NUM_ID_PROTO; proto ++) {
+        if (protocols == (1u << proto)) {
+            return proto;
+        }
+    }
+
+    /* Measure protocols, not measured yet */
+    if (!perfstat_get(u, &rec)) {
+        memset(&rec, 0, sizeof(rec));
+    }
+
+    for (proto = 0; proto < NUM_ID_PROTO; proto ++) {
+        p = &rec.proto[proto];
+        if ((protocols & (1 << proto)) != 0 &&
+            p->pages < PERFSTAT_MIN_PAGES && !perfstat_proto_failing(p)) {
+            log_debug(NULL, "perfstat: %s: measuring %s", u.text,
+                id_proto_name(proto));
+            return proto;
+        }
+    }
+
+    /* Choose the fastest protocol. Protocols that keep failing
+     * are chosen only if all protocols do
+     */
+    other = ID_PROTO_UNKNOWN;
+    for (proto = 0; proto < NUM_ID_PROTO; proto ++) {
+        if ((protocols & (1 << proto)) == 0) {
+            continue;
+        }
+
+        p = &rec.proto[proto];
+        log_debug(NULL, "perfstat: %s: %s: setup=%.0f ms, page=%.0f ms, "
+            "%.0f bytes/page, %u failures", u.text, id_proto_name(proto),
+            p->setup_ms, p->page_ms, p->page_bytes, p->failures);
+
+        if (best == ID_PROTO_UNKNOWN) {
+            best = proto;
+        } else if (perfstat_proto_failing(p) !=
+                   perfstat_proto_failing(&rec.proto[best])) {
+            if (!perfstat_proto_failing(p)) {
+                other = best;
+                best = proto;
+            } else {
+                other = proto;
+            }
+        } else if (perfstat_proto_cost(p, &rec.proto[best]) <
+                   perfstat_proto_cost(&rec.proto[best], p)) {
+            other = best;
+            best = proto;
+        } else {
+            other = proto;
+        }
+    }
+
+    /* Periodically re-measure the slower protocol */
+    if (other != ID_PROTO_UNKNOWN &&
+        !perfstat_proto_failing(&rec.proto[other]) &&
+        g_random_int_range(0, PERFSTAT_REPROBE) == 0) {
+        log_debug(NULL, "perfstat: %s: re-measuring %s", u.text,
+            id_proto_name(other));
+        return other;
+    }
+
+    log_debug(NULL, "perfstat: %s: using %s", u.text, id_proto_name(best));
+
+    return best;
+}
+
+/* Check if performance history file header is valid
+ */
+static bool
+perfstat_header_valid (const perfstat_header *hdr)
+{
+    return !memcmp(hdr->magic, PERFSTAT_MAGIC, sizeof(hdr->magic)) &&
+           hdr->version == PERFSTAT_VERSION &&
+           hdr->record_size == sizeof(perfstat_record) &&
+           hdr->num_records == PERFSTAT_MAX_DEVICES;
+}
+
+/* Create the new performance history file
+ *
+ * The file is built under a temporary name and then renamed over
+ * the old one, so processes that still have the old file mapped
+ * are not affected
+ */
+static bool
+perfstat_create (const char *path)
+{
+    char            *tmp = g_strconcat(path, ".XXXXXX", NULL);
+    int             fd = mkstemp(tmp);
+    perfstat_header hdr;
+    bool            ok = false;
+
+    if (fd < 0) {
+        log_debug(NULL, "perfstat: %s: %s", tmp, strerror(errno));
+        g_free(tmp);
+        return false;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PERFSTAT_MAGIC, sizeof(hdr.magic));
+    hdr.version = PERFSTAT_VERSION;
+    hdr.record_size = sizeof(perfstat_record);
+    hdr.num_records = PERFSTAT_MAX_DEVICES;
+
+    if (fchmod(fd, 0644) == 0 &&
+        ftruncate(fd, PERFSTAT_FILE_SIZE) == 0 &&
+        pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+        rename(tmp, path) == 0) {
+        log_debug(NULL, "perfstat: %s: created", path);
+        ok = true;
+    } else {
+        log_debug(NULL, "perfstat: %s: %s", path, strerror(errno));
+        unlink(tmp);
+    }
+
+    close(fd);
+    g_free(tmp);
+
+    return ok;
+}
+
+/* Open and map the existing performance history file. Returns
+ * false, if file is missed, invalid or cannot be used
+ *
+ * The file is never truncated or rewritten here, as other processes
+ * may have it mapped
+ */
+static bool
+perfstat_map_file (const char *path)
+{
+    struct stat     st;
+    perfstat_header *hdr;
+    unsigned int    i;
+
+    perfstat_fd = open(path, O_RDWR | O_CLOEXEC);
+    if (perfstat_fd < 0) {
+        if (errno != ENOENT) {
+            log_debug(NULL, "perfstat: %s: %s", path, strerror(errno));
+        }
+        return false;
+    }
+
+    perfstat_lock(LOCK_EX);
+
+    if (fstat(perfstat_fd, &st) < 0 ||
+        (size_t) st.st_size != PERFSTAT_FILE_SIZE) {
+        log_debug(NULL, "perfstat: %s: invalid size", path);
+        goto FAIL;
+    }
+
+    perfstat_map = mmap(NULL, PERFSTAT_FILE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_SHARED, perfstat_fd, 0);
+    if (perfstat_map == MAP_FAILED) {
+        log_debug(NULL, "perfstat: %s: mmap: %s", path, strerror(errno));
+        perfstat_map = NULL;
+        goto FAIL;
+    }
+
+    hdr = perfstat_map;
+    if (!perfstat_header_valid(hdr)) {
+        log_debug(NULL, "perfstat: %s: invalid header", path);
+        goto FAIL;
+    }
+
+    perfstat_records = (perfstat_record*) (hdr + 1);
+
+    /* Drop records, left incomplete by crashed writer */
+    for (i = 0; i < PERFSTAT_MAX_DEVICES; i ++) {
+        perfstat_record *rec = &perfstat_records[i];
+        if ((rec->seq & 1) != 0) {
+            memset(rec, 0, sizeof(*rec));
+        }
+    }
+
+    perfstat_unlock();
+    log_debug(NULL, "perfstat: using %s", path);
+
+    return true;
+
+FAIL:
+    if (perfstat_map != NULL) {
+        munmap(perfstat_map, PERFSTAT_FILE_SIZE);
+        perfstat_map = NULL;
+    }
+
+    perfstat_records = NULL;
+    perfstat_unlock();
+    close(perfstat_fd);
+    perfstat_fd = -1;
+
+    return false;
+}
+
+/* Open and map performance history file, creating or replacing
+ * it, if needed. Returns false on error
+ */
+static bool
+perfstat_open (const char *path)
+{
+    char *dir = g_path_get_dirname(path);
+
+    g_mkdir_with_parents(dir, 0755);
+    g_free(dir);
+
+    if (perfstat_map_file(path)) {
+        return true;
+    }
+
+    return perfstat_create(path) && perfstat_map_file(path);
+}
+
+/* Get path to the performance history file, according to
+ * configuration. Returns NULL, if history is disabled. The
+ * returned string must be released with g_free()
+ */
+char*
+perfstat_path (void)
+{
+    if (conf.perf_history == NULL) {
+        return g_build_filename(g_get_user_cache_dir(), PERFSTAT_FILE, NULL);
+    }
+
+    if (conf.perf_history[0] != '\0') {
+        return g_strdup(conf.perf_history);
+    }
+
+    return NULL;
+}
+
+/* Load performance history. Called on the first use
+ */
+static void
+perfstat_load (void)
+{
+    char *path = perfstat_path();
+
+    if (path == NULL || !perfstat_open(path)) {
+        perfstat_records = g_new0(perfstat_record, PERFSTAT_MAX_DEVICES);
+    }
+
+    g_free(path);
+}
+
+/* Cleanup performance statistics
+ */
+void
+perfstat_cleanup (void)
+{
+    if (perfstat_map != NULL) {
+        munmap(perfstat_map, PERFSTAT_FILE_SIZE);
+        perfstat_map = NULL;
+    } else {
+        g_free(perfstat_records);
+    }
+
+    if (perfstat_fd >= 0) {
+        close(perfstat_fd);
+        perfstat_fd = -1;
+    }
+
+    perfstat_records = NULL;
+}
+
+/* vim:ts=8:sw=4:et
+ */
@@ -23,6 +23,34 @@ typedef struct {
     tsize_t                       size_file;    /* Size of the tiff file. */
 } image_decoder_tiff;
 
+/* libtiff entry points. libtiff is not linked directly,
+ * but loaded on demand, when TIFF decoding is started
+ */
+static __typeof__(TIFFClientOpen)   *tiff_TIFFClientOpen;
+static __typeof__(TIFFClose)        *tiff_TIFFClose;
+static __typeof__(TIFFCleanup)      *tiff_TIFFCleanup;
+static __typeof__(TIFFGetField)     *tiff_TIFFGetField;
+static __typeof__(TIFFReadScanline) *tiff_TIFFReadScanline;
+
+static const char * const tiff_sonames[] = {
+    "libtiff.so.6", "libtiff.so.5", NULL
+};
+
+static const dll_sym tiff_syms[] = {
+    {"TIFFClientOpen", (void**) &tiff_TIFFClientOpen},
+    {"TIFFClose", (void**) &tiff_TIFFClose},
+    {"TIFFCleanup", (void**) &tiff_TIFFCleanup},
+    {"TIFFGetField", (void**) &tiff_TIFFGetField},
+    {"TIFFReadScanline", (void**) &tiff_TIFFReadScanline},
+    {NULL, NULL}
+};
+
+static dll tiff_dll = {
+    .name = "libtiff",
+    .sonames = tiff_sonames,
+    .syms = tiff_syms
+};
+
 static void
 airscan_dummy_unmap_proc (thandle_t fd, tdata_t base, toff_t size)
 {
@@ -149,7 +177,7 @@ image_decoder_tiff_free (image_decoder *decoder)
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
 
     if (tiff->tif)
-       TIFFClose(tiff->tif);
+       tiff_TIFFClose(tiff->tif);
     g_free(tiff);
 }
 
@@ -160,13 +188,20 @@ image_decoder_tiff_begin (image_decoder *decoder, const void *data,
         size_t size)
 {
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
+    error              err;
+
+    /* Load libtiff, if not loaded yet */
+    err = dll_load(&tiff_dll);
+    if (err != NULL) {
+        return err;
+    }
 
     /* Set the TiffClientOpen interface to read a file from memory. */
     tiff->mem_file = (unsigned char*)data;
     tiff->offset_file = 0;
     tiff->size_file = size;
 
-    tiff->tif = TIFFClientOpen("airscan TIFF Interface", 
+    tiff->tif = tiff_TIFFClientOpen("airscan TIFF Interface", 
          "r", (image_decoder_tiff*)(tiff),
         airscan_read_proc, airscan_write_proc,
         airscan_seek_proc, airscan_close_proc,
@@ -174,7 +209,7 @@ image_decoder_tiff_begin (image_decoder *decoder, const void *data,
 	if (tiff->tif == NULL) {
 		 return ERROR("TIFF: invalid open memory");
 	}
-    if (TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &tiff->num_lines))
+    if (tiff_TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &tiff->num_lines))
         return NULL;
     return ERROR("TIFF: invalid header");;
 }
@@ -185,7 +220,10 @@ static void
 image_decoder_tiff_reset (image_decoder *decoder)
 {
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
-    TIFFCleanup(tiff->tif);
+    if (tiff->tif != NULL) {
+        tiff_TIFFCleanup(tiff->tif);
+        tiff->tif = NULL;
+    }
     tiff->offset_file = 0;
 }
 
@@ -196,7 +234,7 @@ image_decoder_tiff_get_bytes_per_pixel (image_decoder *decoder)
 {
     int componment = 0;
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
-    TIFFGetField(tiff->tif, TIFFTAG_SAMPLESPERPIXEL, &componment);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_SAMPLESPERPIXEL, &componment);
     return componment;
 }
 
@@ -207,9 +245,9 @@ image_decoder_tiff_get_params (image_decoder *decoder, SANE_Parameters *params)
 {
     int w, h, componment;
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
-    TIFFGetField(tiff->tif, TIFFTAG_IMAGEWIDTH, &w);
-    TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &h);
-    TIFFGetField(tiff->tif, TIFFTAG_SAMPLESPERPIXEL, &componment);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_IMAGEWIDTH, &w);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &h);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_SAMPLESPERPIXEL, &componment);
 
     params->last_frame = SANE_TRUE;
     params->pixels_per_line = w;
@@ -233,8 +271,8 @@ image_decoder_tiff_set_window (image_decoder *decoder, image_window *win)
     image_decoder_tiff *tiff = (image_decoder_tiff*) decoder;
 // #if     1
     win->x_off = win->y_off = 0;
-    TIFFGetField(tiff->tif, TIFFTAG_IMAGEWIDTH, &win->wid);
-    TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &win->hei);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_IMAGEWIDTH, &win->wid);
+    tiff_TIFFGetField(tiff->tif, TIFFTAG_IMAGELENGTH, &win->hei);
     return NULL;
 /*
 #else
@@ -271,7 +309,7 @@ image_decoder_tiff_read_line (image_decoder *decoder, void *buffer)
         return ERROR("TIFF: end of file");
     }
 
-    if (TIFFReadScanline(tiff->tif, buf, tiff->current_line, 0) == -1) {
+    if (tiff_TIFFReadScanline(tiff->tif, buf, tiff->current_line, 0) == -1) {
        return ERROR("TIFF: read scanline error");
     }
     tiff->current_line ++;
@@ -162,6 +162,8 @@ wsd_devcaps_parse_formats (proto_handler_wsd *wsd,
                 wsd->exif = true;
             } else if (!strcmp(v, "pdf-a")) {
                 *formats |= 1 << ID_FORMAT_PDF;
+            } else if (!strcmp(v, "dib")) {
+                *formats |= 1 << ID_FORMAT_BMP;
             }
         }
 
@@ -368,6 +370,7 @@ wsd_devcaps_parse_configuration (proto_handler_wsd *wsd,
     size_t       prefixlen = strlen(xml_rd_node_path(xml));
     bool         adf = false, duplex = false;
     unsigned int formats = 0;
+    unsigned int intents = 0;
     int          i;
 
     /* Parse configuration */
@@ -376,6 +379,16 @@ wsd_devcaps_parse_configuration (proto_handler_wsd *wsd,
 
         if (!strcmp(path, "/scan:DeviceSettings/scan:FormatsSupported")) {
             err = wsd_devcaps_parse_formats(wsd, caps, xml, &formats);
+        } else if (!strcmp(path, "/scan:DeviceSettings/scan:ContentTypesSupported"
+                "/scan:ContentTypeValue")) {
+            const char *v = xml_rd_node_value(xml);
+            if (!strcmp(v, "Text")) {
+                intents |= DEVCAPS_SOURCE_INTENT_DOCUMENT;
+            } else if (!strcmp(v, "Mixed")) {
+                intents |= DEVCAPS_SOURCE_INTENT_TXT_AND_GRAPH;
+            } else if (!strcmp(v, "Photo")) {
+                intents |= DEVCAPS_SOURCE_INTENT_PHOTO;
+            }
         } else if (!strcmp(path, "/scan:Platen")) {
             err = wsd_devcaps_parse_source(caps, xml, ID_SOURCE_PLATEN);
         } else if (!strcmp(path, "/scan:ADF/scan:ADFFront")) {
@@ -403,6 +416,7 @@ wsd_devcaps_parse_configuration (proto_handler_wsd *wsd,
 
         if (src != NULL) {
             src->formats = formats;
+            src->flags |= intents;
             src->win_x_range_mm.min = src->win_y_range_mm.min = 0;
             src->win_x_range_mm.max = math_px2mm_res(src->max_wid_px, 1000);
             src->win_y_range_mm.max = math_px2mm_res(src->max_hei_px, 1000);
@@ -600,6 +614,7 @@ wsd_scan_query (const proto_ctx *ctx)
     xml_wr                  *xml = xml_wr_begin("s:Envelope", wsd_ns_wr);
     const char              *source = NULL;
     const char              *colormode = NULL;
+    const char              *content_type = NULL;
     static const char       *sides_simplex[] = {"scan:MediaFront", NULL};
     static const char       *sides_duplex[] = {"scan:MediaFront", "scan:MediaBack", NULL};
     const char              **sides;
@@ -626,6 +641,16 @@ wsd_scan_query (const proto_ctx *ctx)
         log_internal_error(ctx->log);
     }
 
+    /* Note, WSD has no notion of preview intent */
+    switch (params->scanintent) {
+    case ID_SCANINTENT_DOCUMENT:      content_type = "Text"; break;
+    case ID_SCANINTENT_TXT_AND_GRAPH: content_type = "Mixed"; break;
+    case ID_SCANINTENT_PHOTO:         content_type = "Photo"; break;
+
+    default:
+        break;
+    }
+
     /* Create scan request */
     wsd_make_request_header(ctx, xml, WSD_ACTION_CREATE_SCAN_JOB);
 
@@ -640,8 +665,11 @@ wsd_scan_query (const proto_ctx *ctx)
 
     xml_wr_enter(xml, "scan:DocumentParameters");
 
-    // FIXME -- JPEG hardcoded for now
-    if (wsd->jfif) {
+    if (params->format == ID_FORMAT_PDF) {
+        xml_wr_add_text(xml, "scan:Format", "pdf-a");
+    } else if (params->format == ID_FORMAT_BMP) {
+        xml_wr_add_text(xml, "scan:Format", "dib");
+    } else if (wsd->jfif) {
         xml_wr_add_text(xml, "scan:Format", "jfif"); // FIXME
     } else if (wsd->exif) {
         xml_wr_add_text(xml, "scan:Format", "exif"); // FIXME
@@ -659,6 +687,9 @@ wsd_scan_query (const proto_ctx *ctx)
     xml_wr_leave(xml); // scan:InputSize
 
     xml_wr_add_text(xml, "scan:InputSource", source);
+    if (content_type != NULL) {
+        xml_wr_add_text(xml, "scan:ContentType", content_type);
+    }
 
     xml_wr_enter(xml, "scan:MediaSides");
     for (i = 0; sides[i] != NULL; i ++) {
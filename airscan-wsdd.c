@@ -25,6 +25,11 @@
 #define WSDD_RETRANSMIT_MAX     250     /* Max retransmit time */
 #define WSDD_DISCOVERY_TIME     2500    /* Overall discovery time */
 
+/* Duplicate datagrams suppression parameters
+ */
+#define WSDD_DEDUP_SIZE         64      /* Max remembered messages */
+#define WSDD_DEDUP_TIME         10000   /* How long to remember, ms */
+
 /* wsdd_resolver represents a per-interface WSDD resolver
  */
 typedef struct {
@@ -65,6 +70,16 @@ typedef enum {
     WSDD_ACTION_PROBEMATCHES
 } WSDD_ACTION;
 
+/* wsdd_dedup_entry represents a recently received message,
+ * remembered for duplicates suppression
+ */
+typedef struct {
+    uint64_t hash;    /* Hash of MessageID (or entire datagram) */
+    int      ifindex; /* Interface index */
+    bool     ipv6;    /* Received via IPv6 */
+    gint64   time;    /* When received, g_get_monotonic_time() */
+} wsdd_dedup_entry;
+
 /* wsdd_message represents a parsed WSDD message
  */
 typedef struct {
@@ -98,6 +113,8 @@ static char                wsdd_buf[65536];
 static struct sockaddr_in  wsdd_mcast_ipv4;
 static struct sockaddr_in6 wsdd_mcast_ipv6;
 static ll_head             wsdd_finding_list;
+static wsdd_dedup_entry    wsdd_dedup[WSDD_DEDUP_SIZE];
+static int                 wsdd_dedup_len;
 
 /* WS-DD Probe template
  */
@@ -150,6 +167,7 @@ static wsdd_xaddr*
 wsdd_xaddr_new (http_uri *uri)
 {
     wsdd_xaddr *xaddr = g_new0(wsdd_xaddr, 1);
+    memstat_alloc(MEMSTAT_WSDD, sizeof(wsdd_xaddr));
     xaddr->uri = uri;
     return xaddr;
 }
@@ -160,6 +178,7 @@ static void
 wsdd_xaddr_free (wsdd_xaddr *xaddr)
 {
     http_uri_free(xaddr->uri);
+    memstat_free(MEMSTAT_WSDD, sizeof(wsdd_xaddr));
     g_free(xaddr);
 }
 
@@ -208,6 +227,7 @@ wsdd_finding_new (int ifindex, const char *address)
 {
     wsdd_finding *wsdd = g_new0(wsdd_finding, 1);
 
+    memstat_alloc(MEMSTAT_WSDD, sizeof(wsdd_finding));
     wsdd->address = g_strdup(address);
     wsdd->finding.uuid = uuid_parse(address);
     if (!uuid_valid(wsdd->finding.uuid)) {
@@ -233,6 +253,7 @@ wsdd_finding_free (wsdd_finding *wsdd)
     wsdd_xaddr_list_purge(&wsdd->xaddrs);
     g_free((char*) wsdd->finding.model);
     g_free((char*) wsdd->finding.name);
+    memstat_free(MEMSTAT_WSDD, sizeof(wsdd_finding));
     g_free(wsdd);
 }
 
@@ -467,6 +488,7 @@ wsdd_finding_get_metadata (wsdd_finding *wsdd, int ifindex, wsdd_xaddr *xaddr)
         "POST", g_strdup(wsdd_buf), "application/soap+xml; charset=utf-8");
 
     http_query_set_uintptr(q, ifindex);
+    http_query_set_priority(q, HTTP_PRIORITY_DISCOVERY);
     http_query_submit(q, wsdd_finding_get_metadata_callback);
 }
 
@@ -526,6 +548,7 @@ wsdd_message_parse (const char *xml_text, size_t xml_len)
     xml_rd       *xml;
     error        err;
 
+    memstat_alloc(MEMSTAT_WSDD, sizeof(wsdd_message));
     ll_init(&msg->xaddrs);
 
     err = xml_rd_begin(&xml, xml_text, xml_len, wsdd_ns_rules);
@@ -576,6 +599,7 @@ wsdd_message_free (wsdd_message *msg)
     if (msg != NULL) {
         g_free((char*) msg->address);
         wsdd_xaddr_list_purge(&msg->xaddrs);
+        memstat_free(MEMSTAT_WSDD, sizeof(wsdd_message));
         g_free(msg);
     }
 }
@@ -651,6 +675,94 @@ wsdd_resolver_message_dispatch (wsdd_resolver *resolver, wsdd_message *msg)
     wsdd_message_free(msg);
 }
 
+/******************** Duplicates suppression ********************/
+/* Compute FNV-1a hash of the memory range
+ */
+static uint64_t
+wsdd_dedup_hash (const char *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t   i;
+
+    for (i = 0; i < size; i ++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/* Compute the message hash for duplicates suppression.
+ *
+ * WS-Discovery senders repeat each UDP message several times, with
+ * the same MessageID. So MessageID is located by simple byte scanning,
+ * without XML parsing, and hashed. If MessageID is not found, the entire
+ * datagram is hashed
+ */
+static uint64_t
+wsdd_dedup_message_hash (const char *data, size_t size)
+{
+    const char *end = data + size;
+    const char *beg, *p;
+
+    p = memmem(data, size, "MessageID", 9);
+    if (p != NULL) {
+        beg = memchr(p, '>', end - p);
+        if (beg != NULL) {
+            beg ++;
+            p = memchr(beg, '<', end - beg);
+            if (p != NULL) {
+                return wsdd_dedup_hash(beg, p - beg);
+            }
+        }
+    }
+
+    return wsdd_dedup_hash(data, size);
+}
+
+/* Check if message is a duplicate of recently received one.
+ * Remembers the message, if it is not
+ *
+ * Entries are kept in the most recently used first order; expired
+ * entries and entries, pushed out of the table, are forgotten
+ */
+static bool
+wsdd_dedup_check (const char *data, size_t size, int ifindex, bool ipv6)
+{
+    uint64_t         hash = wsdd_dedup_message_hash(data, size);
+    gint64           now = g_get_monotonic_time();
+    wsdd_dedup_entry ent = {hash, ifindex, ipv6, now};
+    bool             dup = false;
+    int              i;
+
+    /* Drop expired entries from the tail */
+    while (wsdd_dedup_len > 0 &&
+           now - wsdd_dedup[wsdd_dedup_len - 1].time >
+               (gint64) WSDD_DEDUP_TIME * 1000) {
+        wsdd_dedup_len --;
+    }
+
+    /* Lookup the table */
+    for (i = 0; i < wsdd_dedup_len && !dup; i ++) {
+        dup = wsdd_dedup[i].hash == hash &&
+              wsdd_dedup[i].ifindex == ifindex &&
+              wsdd_dedup[i].ipv6 == ipv6;
+    }
+
+    /* Move found entry (or the new one) to the head */
+    if (dup) {
+        i --;
+    } else if (wsdd_dedup_len < WSDD_DEDUP_SIZE) {
+        wsdd_dedup_len ++;
+    } else {
+        i = WSDD_DEDUP_SIZE - 1;
+    }
+
+    memmove(&wsdd_dedup[1], &wsdd_dedup[0], i * sizeof(wsdd_dedup[0]));
+    wsdd_dedup[0] = ent;
+
+    return dup;
+}
 
 /* Resolver read callback
  */
@@ -713,6 +825,12 @@ wsdd_resolver_read_callback (int fd, void *data, ELOOP_FDPOLL_MASK mask)
         return;
     }
 
+    /* Drop repeated copies of the same message */
+    if (wsdd_dedup_check(wsdd_buf, rc, ifindex, from.ss_family == AF_INET6)) {
+        log_trace(wsdd_log, "duplicate message dropped");
+        return;
+    }
+
     /* Parse and dispatch the message */
     msg = wsdd_message_parse(wsdd_buf, rc);
     if (msg != NULL) {
@@ -804,6 +922,8 @@ wsdd_resolver_new (const netif_addr *addr)
     int           rc;
     static int    no = 0, yes = 1;
 
+    memstat_alloc(MEMSTAT_WSDD, sizeof(wsdd_resolver));
+
     /* Build resolver structure */
     resolver->ifindex = addr->ifindex;
 
@@ -920,6 +1040,7 @@ wsdd_resolver_free (wsdd_resolver *resolver)
         eloop_timer_cancel(resolver->timer);
     }
 
+    memstat_free(MEMSTAT_WSDD, sizeof(wsdd_resolver));
     g_free(resolver);
 }
 
@@ -1235,6 +1356,7 @@ wsdd_cleanup (void)
     }
 
     netif_addr_free(wsdd_netif_addr_list);
+    wsdd_dedup_len = 0;
 
     if (wsdd_mcsock_ipv4 >= 0) {
         close(wsdd_mcsock_ipv4);
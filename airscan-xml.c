@@ -29,6 +29,7 @@ struct xml_rd {
                                      replaced by exact-matching strings */
     size_t        subst_cache_len;/* Count of subst_cache elements */
     size_t        subst_cache_cap;/* subst_cache capacity */
+    size_t        memsize;        /* Accounted memory size */
 };
 
 /* Forward declarations */
@@ -126,6 +127,12 @@ xml_rd_begin (xml_rd **xml, const char *xml_text, size_t xml_len,
     (*xml)->pathlen = g_malloc(sizeof(*(*xml)->pathlen) * (*xml)->pathlen_cap);
     (*xml)->subst_rules = ns;
 
+    /* Size of libxml2 tree is not known, so approximate
+     * it by the size of the source text
+     */
+    (*xml)->memsize = sizeof(xml_rd) + xml_len;
+    memstat_alloc(MEMSTAT_XML, (*xml)->memsize);
+
     xml_rd_skip_dummy(*xml);
     xml_rd_node_switched(*xml);
 
@@ -153,6 +160,7 @@ xml_rd_finish (xml_rd **xml)
 
         g_free((*xml)->pathlen);
         g_string_free((*xml)->path, TRUE);
+        memstat_free(MEMSTAT_XML, (*xml)->memsize);
         g_free(*xml);
         *xml = NULL;
     }
@@ -390,6 +398,7 @@ static xml_wr_node*
 xml_wr_node_new (const char *name, const char *value, const xml_attr *attrs)
 {
     xml_wr_node *node = g_new0(xml_wr_node, 1);
+    memstat_alloc(MEMSTAT_XML, sizeof(xml_wr_node));
     node->name = g_strdup(name);
     node->attrs = attrs;
     if (value != NULL) {
@@ -405,6 +414,7 @@ xml_wr_node_free (xml_wr_node *node)
 {
     g_free((char*) node->name);
     g_free((char*) node->value);
+    memstat_free(MEMSTAT_XML, sizeof(xml_wr_node));
     g_free(node);
 }
 
@@ -427,6 +437,7 @@ xml_wr*
 xml_wr_begin (const char *root, const xml_ns *ns)
 {
     xml_wr *xml = g_new0(xml_wr, 1);
+    memstat_alloc(MEMSTAT_XML, sizeof(xml_wr));
     xml->root = xml_wr_node_new(root, NULL, NULL);
     xml->current = xml->root;
     xml->ns = ns;
@@ -556,6 +567,7 @@ xml_wr_finish_internal (xml_wr *xml, bool compact)
     xml_wr_format_node(xml, buf, xml->root, 0, compact);
 
     xml_wr_node_free_recursive(xml->root);
+    memstat_free(MEMSTAT_XML, sizeof(xml_wr));
     g_free(xml);
 
     return g_string_free(buf, false);
@@ -51,6 +51,11 @@ typedef struct {
 static ll_head zeroconf_device_list;
 static GCond zeroconf_initscan_cond;
 static int zeroconf_initscan_bits;
+static bool zeroconf_initscan_timedout;
+static eloop_timer *zeroconf_initscan_timer;
+static GPtrArray *zeroconf_initscan_events;
+static unsigned int zeroconf_device_list_generation;
+static pollable *zeroconf_device_list_pollable;
 
 /******************** Forward declarations *********************/
 static zeroconf_endpoint*
@@ -105,6 +110,7 @@ static zeroconf_device*
 zeroconf_device_add (uuid uuid)
 {
     zeroconf_device *device = g_new0(zeroconf_device, 1);
+    memstat_alloc(MEMSTAT_ZEROCONF, sizeof(zeroconf_device));
 
     device->uuid = uuid;
     ll_init(&device->findings);
@@ -123,6 +129,7 @@ zeroconf_device_del (zeroconf_device *device)
 {
     g_free(device->ifaces);
     ll_del(&device->node_list);
+    memstat_free(MEMSTAT_ZEROCONF, sizeof(zeroconf_device));
     g_free(device);
 }
 
@@ -314,6 +321,7 @@ zeroconf_endpoint*
 zeroconf_endpoint_new (ID_PROTO proto, http_uri *uri)
 {
     zeroconf_endpoint *endpoint = g_new0(zeroconf_endpoint, 1);
+    memstat_alloc(MEMSTAT_ZEROCONF, sizeof(zeroconf_endpoint));
 
     endpoint->proto = proto;
     endpoint->uri = uri;
@@ -327,6 +335,7 @@ static zeroconf_endpoint*
 zeroconf_endpoint_copy_single (const zeroconf_endpoint *endpoint)
 {
     zeroconf_endpoint *endpoint2 = g_new0(zeroconf_endpoint, 1);
+    memstat_alloc(MEMSTAT_ZEROCONF, sizeof(zeroconf_endpoint));
 
     *endpoint2 = *endpoint;
     endpoint2->uri = http_uri_clone(endpoint->uri);
@@ -341,6 +350,7 @@ static void
 zeroconf_endpoint_free_single (zeroconf_endpoint *endpoint)
 {
     http_uri_free(endpoint->uri);
+    memstat_free(MEMSTAT_ZEROCONF, sizeof(zeroconf_endpoint));
     g_free(endpoint);
 }
 
@@ -533,6 +543,118 @@ zeroconf_find_static_by_ident (const char *ident)
     return NULL;
 }
 
+/******************** Change notifications *********************/
+/* Notify that list of devices has changed
+ */
+static void
+zeroconf_device_list_changed (void)
+{
+    zeroconf_device_list_generation ++;
+    pollable_signal(zeroconf_device_list_pollable);
+}
+
+/* Get generation counter of the list of devices. It is incremented
+ * every time the list is changed
+ */
+unsigned int
+zeroconf_device_list_gen (void)
+{
+    return zeroconf_device_list_generation;
+}
+
+/* Get file descriptor, that becomes readable when list of devices
+ * changes. It remains readable until zeroconf_device_list_ack()
+ */
+int
+zeroconf_device_list_get_fd (void)
+{
+    mdns_start();
+    return pollable_get_fd(zeroconf_device_list_pollable);
+}
+
+/* Acknowledge changes of the list of devices, making the
+ * file descriptor not readable until the next change
+ */
+void
+zeroconf_device_list_ack (void)
+{
+    pollable_reset(zeroconf_device_list_pollable);
+}
+
+/******************** Initial scan notifications *********************/
+/* Check if initial scan is done, or we gave up waiting for it
+ */
+static bool
+zeroconf_initscan_done (void)
+{
+    return zeroconf_initscan_bits == 0 || zeroconf_initscan_timedout;
+}
+
+/* Trigger all events, registered by zeroconf_initscan_notify()
+ */
+static void
+zeroconf_initscan_trigger (void)
+{
+    unsigned int i;
+
+    if (zeroconf_initscan_timer != NULL) {
+        eloop_timer_cancel(zeroconf_initscan_timer);
+        zeroconf_initscan_timer = NULL;
+    }
+
+    for (i = 0; i < zeroconf_initscan_events->len; i ++) {
+        eloop_event_trigger(g_ptr_array_index(zeroconf_initscan_events, i));
+    }
+
+    g_ptr_array_set_size(zeroconf_initscan_events, 0);
+}
+
+/* Initial scan timeout callback
+ */
+static void
+zeroconf_initscan_timer_callback (void *data)
+{
+    (void) data;
+
+    log_debug(NULL, "zeroconf: initial scan timed out");
+
+    zeroconf_initscan_timer = NULL;
+    zeroconf_initscan_timedout = true;
+    zeroconf_initscan_trigger();
+}
+
+/* Request notification when initial scan is done (or timed out).
+ * The event is triggered only once; if initial scan is already
+ * done, it is triggered immediately. MDNS discovery is started,
+ * if not started yet
+ */
+void
+zeroconf_initscan_notify (eloop_event *event)
+{
+    mdns_start();
+
+    if (zeroconf_initscan_done()) {
+        eloop_event_trigger(event);
+        return;
+    }
+
+    g_ptr_array_add(zeroconf_initscan_events, event);
+
+    if (zeroconf_initscan_timer == NULL) {
+        zeroconf_initscan_timer = eloop_timer_new(
+            ZEROCONF_READY_TIMEOUT * 1000,
+            zeroconf_initscan_timer_callback, NULL);
+    }
+}
+
+/* Cancel notification, requested by zeroconf_initscan_notify()
+ */
+void
+zeroconf_initscan_notify_cancel (eloop_event *event)
+{
+    g_ptr_array_remove(zeroconf_initscan_events, event);
+}
+
 /******************** Events from discovery providers *********************/
 /* Publish the zeroconf_finding.
  */
@@ -572,6 +694,7 @@ zeroconf_finding_publish (zeroconf_finding *finding)
     }
 
     zeroconf_device_add_finding(device, finding);
+    zeroconf_device_list_changed();
 }
 
 /* Withdraw the finding
@@ -591,6 +714,7 @@ zeroconf_finding_withdraw (zeroconf_finding *finding)
     device = zeroconf_device_find(finding->uuid);
     if (device != NULL) {
         zeroconf_device_del_finding(device, finding);
+        zeroconf_device_list_changed();
     }
 }
 
@@ -605,6 +729,10 @@ zeroconf_finding_done (ZEROCONF_METHOD method)
 
     zeroconf_initscan_bits &= ~(1 << method);
     g_cond_broadcast(&zeroconf_initscan_cond);
+
+    if (zeroconf_initscan_bits == 0) {
+        zeroconf_initscan_trigger();
+    }
 }
 
 /******************** Support for SANE API *********************/
@@ -615,6 +743,10 @@ zeroconf_initscan_wait (void)
 {
     gint64            timeout;
 
+    if (zeroconf_initscan_timedout) {
+        return;
+    }
+
     timeout = g_get_monotonic_time() +
         ZEROCONF_READY_TIMEOUT * G_TIME_SPAN_SECOND;
 
@@ -642,6 +774,7 @@ zeroconf_device_list_get (void)
     ll_node             *node;
 
     /* Wait until device table is ready */
+    mdns_start();
     zeroconf_initscan_wait();
 
     /* Compute table size */
@@ -730,16 +863,14 @@ zeroconf_device_list_free (const SANE_Device **dev_list)
     }
 }
 
-/* Lookup device by ident (ident is reported as SANE_Device::name)
- * by zeroconf_device_list_get())
- *
- * Caller becomes owner of resources (name and list of endpoints),
- * referred by the returned zeroconf_devinfo
- *
- * Caller must free these resources, using zeroconf_devinfo_free()
+/* Lookup device by ident. If wait is true, waits for the initial
+ * scan, if device is not found and MDNS discovery is just started.
+ * Otherwise, doesn't wait, but sets *pending to true, if device is
+ * not found, but may appear until initial scan is done
  */
-zeroconf_devinfo*
-zeroconf_devinfo_lookup (const char *ident)
+static zeroconf_devinfo*
+zeroconf_devinfo_lookup_internal (const char *ident, bool wait,
+        bool *pending)
 {
     conf_device      *dev_conf = NULL;
     zeroconf_device  *device = NULL;
@@ -749,13 +880,26 @@ zeroconf_devinfo_lookup (const char *ident)
     dev_conf = zeroconf_find_static_by_ident(ident);
     if (dev_conf == NULL) {
         device = zeroconf_device_find_by_ident(ident);
+
+        /* If MDNS discovery was not started yet, device
+         * cannot be found before it is done
+         */
+        if (device == NULL && mdns_start() && wait) {
+            zeroconf_initscan_wait();
+            device = zeroconf_device_find_by_ident(ident);
+        }
+
         if (device == NULL) {
+            if (!wait && pending != NULL) {
+                *pending = !zeroconf_initscan_done();
+            }
             return NULL;
         }
     }
 
     /* Build a zeroconf_devinfo */
     devinfo = g_new0(zeroconf_devinfo, 1);
+    memstat_alloc(MEMSTAT_ZEROCONF, sizeof(zeroconf_devinfo));
     if (dev_conf != NULL) {
         http_uri *uri = http_uri_clone(dev_conf->uri);
 
@@ -765,28 +909,106 @@ zeroconf_devinfo_lookup (const char *ident)
 
         devinfo->uuid = dev_conf->uuid;
         devinfo->name = g_strdup(dev_conf->name);
+        devinfo->model = g_strdup(dev_conf->name);
         devinfo->endpoints = zeroconf_endpoint_new(dev_conf->proto, uri);
     } else {
         const zeroconf_finding *finding;
 
+        zeroconf_endpoint *ep, *other = NULL;
+        ID_PROTO          proto;
+
         finding = zeroconf_device_name_model_source(device);
         log_assert(NULL, finding != NULL);
 
+        /* Endpoints of the preferred protocol go first, so other
+         * protocol is used only if they all fail
+         */
+        proto = perfstat_choose_proto(device->uuid, device->protocols);
+        if (proto == ID_PROTO_WSD) {
+            other = zeroconf_device_endpoints(device, ID_PROTO_ESCL);
+        } else {
+            proto = ID_PROTO_ESCL;
+            other = zeroconf_device_endpoints(device, ID_PROTO_WSD);
+        }
+
         devinfo->uuid = device->uuid;
         devinfo->name = g_strdup(finding->name);
-        devinfo->endpoints = zeroconf_device_endpoints(device, ID_PROTO_ESCL);
+        devinfo->model = g_strdup(conf.model_is_netname ?
+            finding->name : finding->model);
+        devinfo->endpoints = zeroconf_device_endpoints(device, proto);
+
+        if (devinfo->endpoints == NULL) {
+            devinfo->endpoints = other;
+        } else {
+            for (ep = devinfo->endpoints; ep->next != NULL; ep = ep->next)
+                ;
+            ep->next = other;
+        }
     }
 
     return devinfo;
 }
 
+/* Lookup device by ident (ident is reported as SANE_Device::name)
+ * by zeroconf_device_list_get())
+ *
+ * Caller becomes owner of resources (name and list of endpoints),
+ * referred by the returned zeroconf_devinfo
+ *
+ * Caller must free these resources, using zeroconf_devinfo_free()
+ */
+zeroconf_devinfo*
+zeroconf_devinfo_lookup (const char *ident)
+{
+    return zeroconf_devinfo_lookup_internal(ident, true, NULL);
+}
+
+/* Lookup device by ident without waiting for the initial scan
+ *
+ * If device is not found, but may appear until initial scan is
+ * done, NULL is returned and *pending is set to true. Use
+ * zeroconf_initscan_notify() to retry when it is done
+ */
+zeroconf_devinfo*
+zeroconf_devinfo_lookup_nowait (const char *ident, bool *pending)
+{
+    *pending = false;
+    return zeroconf_devinfo_lookup_internal(ident, false, pending);
+}
+
+/* Get ident of the first device in the list, returned by
+ * zeroconf_device_list_get(), without waiting for the initial
+ * scan. Returns NULL, if there are no devices (yet). The returned
+ * string must be released with g_free()
+ */
+char*
+zeroconf_device_first_ident (void)
+{
+    const SANE_Device **dev_list;
+    char              *ident = NULL;
+
+    if (!zeroconf_initscan_done()) {
+        return NULL;
+    }
+
+    dev_list = zeroconf_device_list_get();
+    if (dev_list[0] != NULL) {
+        ident = g_strdup(dev_list[0]->name);
+    }
+    zeroconf_device_list_free(dev_list);
+
+    return ident;
+}
+
 /* Free zeroconf_devinfo, returned by zeroconf_devinfo_lookup()
  */
 void
 zeroconf_devinfo_free (zeroconf_devinfo *devinfo)
 {
     g_free((char*) devinfo->name);
+    g_free((char*) devinfo->model);
     zeroconf_endpoint_list_free(devinfo->endpoints);
+    memstat_free(MEMSTAT_ZEROCONF, sizeof(zeroconf_devinfo));
     g_free(devinfo);
 }
 
@@ -798,9 +1020,16 @@ zeroconf_init (void)
 {
     ll_init(&zeroconf_device_list);
 
+    zeroconf_device_list_pollable = pollable_new();
+    if (zeroconf_device_list_pollable == NULL) {
+        return SANE_STATUS_NO_MEM;
+    }
+
     zeroconf_initscan_bits = (1 << ZEROCONF_MDNS_HINT) |
                              (1 << ZEROCONF_USCAN_TCP) |
                              (1 << ZEROCONF_USCANS_TCP);
+    zeroconf_initscan_timedout = false;
+    zeroconf_initscan_events = g_ptr_array_new();
 
     return SANE_STATUS_GOOD;
 }
@@ -810,6 +1039,20 @@ zeroconf_init (void)
 void
 zeroconf_cleanup (void)
 {
+    if (zeroconf_device_list_pollable != NULL) {
+        pollable_free(zeroconf_device_list_pollable);
+        zeroconf_device_list_pollable = NULL;
+    }
+
+    if (zeroconf_initscan_timer != NULL) {
+        eloop_timer_cancel(zeroconf_initscan_timer);
+        zeroconf_initscan_timer = NULL;
+    }
+
+    if (zeroconf_initscan_events != NULL) {
+        g_ptr_array_free(zeroconf_initscan_events, TRUE);
+        zeroconf_initscan_events = NULL;
+    }
 }
 
 
@@ -11,6 +11,7 @@
 /* Static variables
  */
 static const SANE_Device **sane_device_list;
+static unsigned int      sane_device_list_gen;
 
 /* Initialize the backend
  */
@@ -39,6 +40,7 @@ sane_init (SANE_Int *version_code, SANE_Auth_Callback authorize)
         http_init();
     }
     if (status == SANE_STATUS_GOOD) {
+        decpool_init();
         device_management_init();
     }
     if (status == SANE_STATUS_GOOD) {
@@ -80,6 +82,8 @@ sane_exit (void)
     wsdd_cleanup();
     zeroconf_cleanup();
     device_management_cleanup();
+    perfstat_cleanup();
+    decpool_cleanup();
     http_cleanup();
     eloop_cleanup();
     zeroconf_device_list_free(sane_device_list);
@@ -104,8 +108,15 @@ sane_get_devices (const SANE_Device ***device_list, SANE_Bool local_only)
     } else {
         eloop_mutex_lock();
 
-        zeroconf_device_list_free(sane_device_list);
-        sane_device_list = zeroconf_device_list_get();
+        /* Rebuild the list only if it has changed */
+        zeroconf_device_list_ack();
+        if (sane_device_list == NULL ||
+            sane_device_list_gen != zeroconf_device_list_gen()) {
+            zeroconf_device_list_free(sane_device_list);
+            sane_device_list = zeroconf_device_list_get();
+            sane_device_list_gen = zeroconf_device_list_gen();
+        }
+
         *device_list = sane_device_list;
 
         eloop_mutex_unlock();
@@ -120,33 +131,22 @@ SANE_Status
 sane_open (SANE_String_Const name, SANE_Handle *handle)
 {
     SANE_Status         status;
-    device              *dev;
-    const SANE_Device   **dev_list = NULL;
+    SANE_Handle         h = NULL;
 
-    eloop_mutex_lock();
-
-    /* If name is not set, open the first device
-     */
-    if (name == NULL || *name == '\0') {
-        dev_list = zeroconf_device_list_get();
-        if (dev_list[0] != NULL) {
-            name = dev_list[0]->name;
-        }
+    status = sane_airscan_open_async(name, &h, NULL);
+    if (status == SANE_STATUS_GOOD) {
+        status = sane_airscan_open_finish(h, SANE_TRUE);
     }
 
-    dev = device_open(name, &status);
-
-    eloop_mutex_unlock();
-
-    if (dev != NULL) {
-        *handle = (SANE_Handle) dev;
+    if (status == SANE_STATUS_GOOD) {
+        *handle = h;
+    } else {
+        h = NULL;
     }
 
-    log_debug(device_log_ctx(dev), "sane_open(\"%s\"): %s", name ? name : "",
+    log_debug(device_log_ctx(h), "sane_open(\"%s\"): %s", name ? name : "",
             sane_strstatus(status));
 
-    zeroconf_device_list_free(dev_list);
-
     return status;
 }
 
@@ -334,6 +334,115 @@ sane_get_select_fd (SANE_Handle handle, SANE_Int *fd)
     return status;
 }
 
+/******************** Extension API ********************/
+/* Get the whole next page as a sealed memfd
+ */
+SANE_Status
+sane_airscan_get_page_memfd (SANE_Handle handle, SANE_Bool compressed,
+        int *fd, SANE_Parameters *params)
+{
+    device      *dev = handle;
+    SANE_Status status;
+
+    eloop_mutex_lock();
+    status = device_read_page_memfd(dev, compressed, fd, params);
+    eloop_mutex_unlock();
+
+    if (status != SANE_STATUS_GOOD) {
+        log_debug(device_log_ctx(dev),
+            "sane_airscan_get_page_memfd(): %s", sane_strstatus(status));
+    }
+
+    return status;
+}
+
+/* Get thumbnail of the current page
+ */
+SANE_Status
+sane_airscan_get_thumbnail (SANE_Handle handle, SANE_Parameters *params,
+        SANE_Byte *data, SANE_Int max_len)
+{
+    device      *dev = handle;
+    SANE_Status status;
+
+    eloop_mutex_lock();
+    status = device_get_thumbnail(dev, params, data, max_len);
+    eloop_mutex_unlock();
+
+    if (status != SANE_STATUS_GOOD) {
+        log_debug(device_log_ctx(dev),
+            "sane_airscan_get_thumbnail(): %s", sane_strstatus(status));
+    }
+
+    return status;
+}
+
+/* Get file descriptor, signalled when list of devices changes
+ */
+SANE_Status
+sane_airscan_get_devices_fd (SANE_Int *fd)
+{
+    eloop_mutex_lock();
+    *fd = zeroconf_device_list_get_fd();
+    eloop_mutex_unlock();
+
+    return SANE_STATUS_GOOD;
+}
+
+/* Get generation counter of the list of devices
+ */
+SANE_Word
+sane_airscan_get_devices_generation (void)
+{
+    SANE_Word gen;
+
+    eloop_mutex_lock();
+    gen = (SANE_Word) zeroconf_device_list_gen();
+    eloop_mutex_unlock();
+
+    return gen;
+}
+
+/* Start opening a device without waiting for probing
+ */
+SANE_Status
+sane_airscan_open_async (SANE_String_Const name, SANE_Handle *handle,
+        SANE_Int *fd)
+{
+    SANE_Status         status;
+    device              *dev;
+
+    eloop_mutex_lock();
+
+    /* If name is not set, the first device is opened */
+    dev = device_open_start(name, &status);
+    if (dev != NULL) {
+        *handle = (SANE_Handle) dev;
+        if (fd != NULL) {
+            *fd = device_open_get_fd(dev);
+        }
+    }
+
+    eloop_mutex_unlock();
+
+    return status;
+}
+
+/* Finish opening a device, started by sane_airscan_open_async()
+ */
+SANE_Status
+sane_airscan_open_finish (SANE_Handle handle, SANE_Bool wait)
+{
+    device      *dev = handle;
+    SANE_Status status;
+
+    eloop_mutex_lock();
+    status = device_open_finish(dev, wait);
+    eloop_mutex_unlock();
+
+    return status;
+}
+
 /******************** API aliases for libsane-dll ********************/
 SANE_Status __attribute__ ((alias ("sane_init")))
 sane_airscan_init (SANE_Int *version_code, SANE_Auth_Callback authorize);
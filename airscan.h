@@ -39,6 +39,7 @@
 /* Environment variables
  */
 #define CONFIG_ENV_AIRSCAN_DEBUG        "SANE_DEBUG_AIRSCAN"
+#define CONFIG_ENV_AIRSCAN_FAKE_PROTO   "SANE_AIRSCAN_FAKE_PROTO"
 
 /* Default resolution, DPI
  */
@@ -267,6 +268,70 @@ ESTRING (error err)
     return (const char*) err;
 }
 
+/******************** Loading of optional libraries ********************/
+/* Heavy libraries, which are not needed by every user of the
+ * backend (avahi, libtiff) are not linked directly, but loaded
+ * with dlopen() on a first use
+ *
+ * dll_sym describes a symbol to be resolved
+ */
+typedef struct {
+    const char *name; /* Symbol name */
+    void       **ptr; /* Where to save its address */
+} dll_sym;
+
+/* dll represents the library, loaded on demand. Typically,
+ * it is statically initialized by its user:
+ *
+ *     static dll foo_dll = {
+ *         .name = "foo", .sonames = foo_sonames, .syms = foo_syms
+ *     };
+ */
+typedef struct {
+    const char         *name;       /* Library name, for logging */
+    const char * const *sonames;    /* NULL-terminated, preferred first */
+    const dll_sym      *syms;       /* Terminated by {NULL, NULL} */
+    void               *handle;     /* dlopen() handle */
+    char               errbuf[256]; /* Load error, if any */
+} dll;
+
+/* Load the library on demand and resolve all its symbols.
+ * Safe to call from any thread. If loading fails, the
+ * failure is remembered, and next calls fail immediately
+ */
+error
+dll_load (dll *lib);
+
+/******************** Memory accounting ********************/
+/* Subsystems, that own accounted memory
+ */
+typedef enum {
+    MEMSTAT_HTTP,       /* HTTP queries, bodies and multipart parts */
+    MEMSTAT_XML,        /* XML readers and writers */
+    MEMSTAT_DEVICE,     /* Devices and their read buffers */
+    MEMSTAT_ZEROCONF,   /* Discovery tables */
+    MEMSTAT_WSDD,       /* WS-Discovery messages, findings and resolvers */
+
+    NUM_MEMSTAT
+} MEMSTAT;
+
+/* Account allocation of size bytes by the subsystem.
+ * Safe to call from any thread
+ */
+void
+memstat_alloc (MEMSTAT tag, size_t size);
+
+/* Account release of size bytes by the subsystem.
+ * Safe to call from any thread
+ */
+void
+memstat_free (MEMSTAT tag, size_t size);
+
+/* Dump memory accounting counters to the log and to the protocol trace
+ */
+void
+memstat_dump (log_ctx *log);
+
 /******************** Various identifiers ********************/
 /* ID_PROTO represents protocol identifier
  */
@@ -336,6 +401,54 @@ id_colormode_sane_name (ID_COLORMODE id);
 ID_COLORMODE
 id_colormode_by_sane_name (const char *name);
 
+/* ID_DECODE_PROFILE represents image decoding profile
+ */
+typedef enum {
+    ID_DECODE_PROFILE_UNKNOWN = -1,
+    ID_DECODE_PROFILE_ACCURATE, /* Best quality, libjpeg defaults */
+    ID_DECODE_PROFILE_FAST,     /* Less CPU, slightly lower quality */
+
+    NUM_ID_DECODE_PROFILE
+} ID_DECODE_PROFILE;
+
+/* id_decode_profile_sane_name returns SANE name for the decode profile
+ * For unknown ID returns NULL
+ */
+const char*
+id_decode_profile_sane_name (ID_DECODE_PROFILE id);
+
+/* id_decode_profile_by_sane_name returns ID_DECODE_PROFILE by its SANE name
+ * For unknown name returns ID_DECODE_PROFILE_UNKNOWN
+ */
+ID_DECODE_PROFILE
+id_decode_profile_by_sane_name (const char *name);
+
+/* ID_SCANINTENT represents scan intent, i.e., kind of document
+ * being scanned, so device may choose an appropriate processing
+ */
+typedef enum {
+    ID_SCANINTENT_UNKNOWN = -1,
+    ID_SCANINTENT_AUTO,          /* Not specified, device default */
+    ID_SCANINTENT_DOCUMENT,      /* Text document */
+    ID_SCANINTENT_TXT_AND_GRAPH, /* Document with graphics */
+    ID_SCANINTENT_PHOTO,         /* Photo */
+    ID_SCANINTENT_PREVIEW,       /* Preview scan */
+
+    NUM_ID_SCANINTENT
+} ID_SCANINTENT;
+
+/* id_scanintent_sane_name returns SANE name for the scan intent
+ * For unknown ID returns NULL
+ */
+const char*
+id_scanintent_sane_name (ID_SCANINTENT id);
+
+/* id_scanintent_by_sane_name returns ID_SCANINTENT by its SANE name
+ * For unknown name returns ID_SCANINTENT_UNKNOWN
+ */
+ID_SCANINTENT
+id_scanintent_by_sane_name (const char *name);
+
 /* ID_FORMAT represents image format
  */
 typedef enum {
@@ -343,6 +456,7 @@ typedef enum {
     ID_FORMAT_JPEG,
     ID_FORMAT_TIFF,
     ID_FORMAT_PDF,
+    ID_FORMAT_BMP,
 
     NUM_ID_FORMAT
 } ID_FORMAT;
@@ -358,6 +472,24 @@ id_format_mime_name (ID_FORMAT id);
 ID_FORMAT
 id_format_by_mime_name (const char *name);
 
+/* id_format_sane_name returns SANE name for the transfer format
+ * For unknown ID returns NULL
+ */
+const char*
+id_format_sane_name (ID_FORMAT id);
+
+/* id_format_by_sane_name returns ID_FORMAT by its SANE name
+ * For unknown name returns ID_FORMAT_UNKNOWN
+ */
+ID_FORMAT
+id_format_by_sane_name (const char *name);
+
+/* id_format_detect detects image format by its signature
+ * For unrecognized data returns ID_FORMAT_UNKNOWN
+ */
+ID_FORMAT
+id_format_detect (const void *data, size_t size);
+
 /******************** UUID utilities ********************/
 /* Type uuid represents a random UUID string.
  *
@@ -409,6 +541,11 @@ uuid_equal (uuid u1, uuid u2)
  */
 #define CONF_DEVICE_DISABLE     "disable"
 
+/* Default directory for AF_UNIX sockets of unix://socket/path
+ * device URLs
+ */
+#define CONF_SOCKET_DIR         "/var/run"
+
 /* Device configuration, for manually added devices
  */
 typedef struct conf_device conf_device;
@@ -420,17 +557,56 @@ struct conf_device {
     conf_device *next; /* Next device in the list */
 };
 
+/* Performance profile of the device model, loaded from the
+ * [profile] section. Profiles are generated by the perf-profile tool
+ */
+typedef struct conf_profile conf_profile;
+struct conf_profile {
+    const char        *model;              /* Device model */
+    bool              transfer_format_set; /* transfer_format is set */
+    ID_FORMAT         transfer_format;     /* Preferred image format,
+                                              ID_FORMAT_UNKNOWN for auto */
+    ID_DECODE_PROFILE decode_profile;      /* Decoding profile,
+                                              ID_DECODE_PROFILE_UNKNOWN
+                                              if not set */
+    conf_profile      *next;               /* Next profile in the list */
+};
+
 /* Backend configuration
  */
 typedef struct {
-    bool        dbg_enabled;      /* Debugging enabled */
-    const char  *dbg_trace;       /* Trace directory */
-    conf_device *devices;         /* Manually configured devices */
-    bool        discovery;        /* Scanners discovery enabled */
-    bool        model_is_netname; /* Use network name instead of model */
+    bool              dbg_enabled;      /* Debugging enabled */
+    const char        *dbg_trace;       /* Trace directory */
+    conf_device       *devices;         /* Manually configured devices */
+    conf_profile      *profiles;        /* Per-model performance profiles */
+    bool              discovery;        /* Scanners discovery enabled */
+    bool              model_is_netname; /* Use network name instead of model */
+    ID_DECODE_PROFILE decode_profile;   /* Default image decoding profile */
+    bool              continuous_adf;   /* Continuous ADF scanning */
+    ID_FORMAT         transfer_format;  /* Preferred image format,
+                                           ID_FORMAT_UNKNOWN for auto */
+    int               decode_threads;   /* Decode pool threads, 0 if
+                                           disabled, -1 for auto */
+    const char        *socket_dir;      /* Directory of AF_UNIX sockets,
+                                           NULL for CONF_SOCKET_DIR */
+    uint64_t          bandwidth_total;  /* Total image transfer rate limit,
+                                           bytes per second, 0 if none */
+    uint64_t          bandwidth_device; /* Per-device rate limit, the same */
+    ID_PROTO          protocol;         /* Preferred protocol, if device
+                                           supports many of them,
+                                           ID_PROTO_UNKNOWN for auto */
+    const char        *perf_history;    /* Performance history file,
+                                           NULL for default, "" if
+                                           disabled */
+    int               retry_after_max;  /* Upper bound of the Retry-After
+                                           hints, ms, 0 to ignore them */
 } conf_data;
 
-#define CONF_INIT { false, NULL, NULL, true, true }
+#define CONF_INIT {                                             \
+        false, NULL, NULL, NULL, true, true, ID_DECODE_PROFILE_ACCURATE, \
+        false, ID_FORMAT_JPEG, 0, NULL, 0, 0, ID_PROTO_UNKNOWN, NULL, \
+        30000                                                   \
+    }
 
 extern conf_data conf;
 
@@ -445,6 +621,12 @@ conf_load (void);
 void
 conf_unload (void);
 
+/* Find performance profile by device model. Returns NULL,
+ * if profile not found
+ */
+const conf_profile*
+conf_profile_lookup (const char *model);
+
 /******************** Utility functions for IP addresses ********************/
 /* Address string, wrapped into structure so can
  * be passed by value
@@ -527,6 +709,12 @@ typedef struct {
 netif_diff
 netif_diff_compute (netif_addr *list1, netif_addr *list2);
 
+/* Get speed of the network link, used to reach the given
+ * address, in Mbit/s. Returns -1, if speed is unknown
+ */
+int
+netif_link_speed (const struct sockaddr *addr);
+
 /* Network interfaces addresses change notifier
  */
 typedef struct netif_notifier netif_notifier;
@@ -640,9 +828,12 @@ bool
 eloop_cond_wait_until (GCond *cond, gint64 timeout);
 
 /* Create AvahiGLibPoll that runs in context of the event loop
+ *
+ * As libavahi-glib is loaded on demand, caller provides
+ * the avahi_glib_poll_new() entry point
  */
 AvahiGLibPoll*
-eloop_new_avahi_poll (void);
+eloop_new_avahi_poll (__typeof__(avahi_glib_poll_new) *glib_poll_new);
 
 /* Call function on a context of event loop thread
  */
@@ -743,11 +934,25 @@ error
 eloop_eprintf(const char *fmt, ...);
 
 /******************** HTTP Client ********************/
-/* Create new URI, by parsing URI string
+/* Create new URI, by parsing URI string. Only http and https
+ * schemes are accepted
  */
 http_uri*
 http_uri_new (const char *str, bool strip_fragment);
 
+/* Create new URI of the locally configured device
+ *
+ * Besides http and https, the unix://socket/path form is accepted.
+ * HTTP requests to such URI are sent via the AF_UNIX socket, named
+ * by the host part of URI (a plain file name within the socket-dir
+ * directory, see CONF_SOCKET_DIR)
+ *
+ * Use it only for URIs from the trusted sources, i.e. configuration
+ * file, never for URIs, received from the network
+ */
+http_uri*
+http_uri_new_local (const char *str, bool strip_fragment);
+
 /* Clone an URI
  */
 http_uri*
@@ -925,6 +1130,40 @@ http_query_new_relative(http_client *client,
 void
 http_query_submit (http_query *q, void (*callback)(void *ptr, http_query *q));
 
+/* HTTP_PRIORITY represents priority class of the query. When
+ * connections to the host are exhausted, queries of the higher
+ * class are sent first
+ */
+typedef enum {
+    HTTP_PRIORITY_DISCOVERY,    /* Discovery metadata queries */
+    HTTP_PRIORITY_IMAGE,        /* Image transfer */
+    HTTP_PRIORITY_STATUS,       /* Status polls and capabilities
+                                   (the default) */
+    HTTP_PRIORITY_CONTROL       /* Scan start, cancel and cleanup */
+} HTTP_PRIORITY;
+
+/* Set query priority class. Must be called before http_query_submit()
+ *
+ * Transfer of HTTP_PRIORITY_IMAGE queries responses is paced
+ * according to the bandwidth-total and bandwidth-per-device
+ * options. Other classes are never delayed
+ */
+void
+http_query_set_priority (http_query *q, HTTP_PRIORITY prio);
+
+/* Make query to be completed locally, without any network activity.
+ *
+ * When submitted, such a query completes after the specified delay,
+ * in milliseconds, with the specified HTTP status and response body.
+ * Used by the fake protocol handler.
+ *
+ * Query takes ownership on body (if not NULL), which must be
+ * allocated by g_malloc(). The content_type assumed to be constant string.
+ */
+void
+http_query_set_local_response (http_query *q, int status, int delay,
+        const char *content_type, void *body, size_t size);
+
 /* Set uintptr_t parameter, associated with query.
  * Completion callback may later use http_query_get_uintptr()
  * to fetch this value
@@ -989,6 +1228,13 @@ http_query_get_request_header (const http_query *q, const char *name);
 const char*
 http_query_get_response_header (const http_query *q, const char *name);
 
+/* Get Retry-After hint of the response, in milliseconds. Both
+ * delay-seconds and HTTP-date forms are understood. Returns -1,
+ * if response has no valid Retry-After header
+ */
+int
+http_query_retry_after (const http_query *q);
+
 /* Get request data
  *
  * You need to http_data_ref(), if you want data to remain valid
@@ -1037,6 +1283,7 @@ http_query_foreach_response_header (const http_query *q,
 enum {
     HTTP_STATUS_OK                  = 200,
     HTTP_STATUS_CREATED             = 201,
+    HTTP_STATUS_TOO_MANY_REQUESTS   = 429,
     HTTP_STATUS_SERVICE_UNAVAILABLE = 503
 };
 
@@ -1385,6 +1632,9 @@ enum {
     OPT_SCAN_RESOLUTION,
     OPT_SCAN_COLORMODE,         /* I.e. color/grayscale etc */
     OPT_SCAN_SOURCE,            /* Platem/ADF/ADF Duplex */
+    OPT_SCAN_INTENT,            /* Document/Photo etc */
+    OPT_DECODE_PROFILE,         /* Accurate/fast image decoding */
+    OPT_TRANSFER_FORMAT,        /* Image format, used for transfer */
 
     /* Geometry options group */
     OPT_GROUP_GEOMETRY,
@@ -1404,6 +1654,32 @@ enum {
 #define OPTVAL_SOURCE_ADF_SIMPLEX "ADF"
 #define OPTVAL_SOURCE_ADF_DUPLEX  "ADF Duplex"
 
+/* Name and values of the image decoding profile option
+ * (this is our own option, not a standard one)
+ */
+#define OPTNAME_DECODE_PROFILE          "decode-profile"
+#define OPTVAL_DECODE_PROFILE_ACCURATE  "accurate"
+#define OPTVAL_DECODE_PROFILE_FAST      "fast"
+
+/* Name and values of the transfer format option
+ * (this is our own option, not a standard one)
+ */
+#define OPTNAME_TRANSFER_FORMAT         "transfer-format"
+#define OPTVAL_TRANSFER_FORMAT_AUTO     "auto"
+#define OPTVAL_TRANSFER_FORMAT_JPEG     "jpeg"
+#define OPTVAL_TRANSFER_FORMAT_PDF      "pdf"
+#define OPTVAL_TRANSFER_FORMAT_BMP      "bmp"
+
+/* Name and values of the scan intent option
+ * (this is our own option, not a standard one)
+ */
+#define OPTNAME_SCAN_INTENT             "scan-intent"
+#define OPTVAL_SCAN_INTENT_AUTO         "Auto"
+#define OPTVAL_SCAN_INTENT_DOCUMENT     "Document"
+#define OPTVAL_SCAN_INTENT_TXT_AND_GRAPH "Text and Graphic"
+#define OPTVAL_SCAN_INTENT_PHOTO        "Photo"
+#define OPTVAL_SCAN_INTENT_PREVIEW      "Preview"
+
 /******************** Device Capabilities ********************/
 /* Source flags
  */
@@ -1440,12 +1716,15 @@ enum {
 /* Supported image formats
  */
 #define DEVCAPS_FORMATS_SUPPORTED       \
-    ((1 << ID_FORMAT_JPEG))
+    ((1 << ID_FORMAT_JPEG) |            \
+     (1 << ID_FORMAT_PDF)  |            \
+     (1 << ID_FORMAT_BMP))
 
 /* Supported color modes
  *
- * Note, currently the only image format we support is JPEG
- * With JPEG, ID_COLORMODE_BW1 cannot be supported
+ * Note, currently we support only JPEG images, either directly or
+ * embedded into PDF, and 8/24-bit BMP. So ID_COLORMODE_BW1 cannot be
+ * supported
  */
 #define DEVCAPS_COLORMODES_SUPPORTED    \
     ((1 << ID_COLORMODE_COLOR) |        \
@@ -1537,11 +1816,18 @@ typedef struct {
     ID_SOURCE              src;               /* Current source */
     ID_COLORMODE           colormode;         /* Current color mode */
     SANE_Word              resolution;        /* Current resolution */
+    ID_DECODE_PROFILE      decode_profile;    /* Current decode profile */
+    ID_FORMAT              transfer_format;   /* Current transfer format,
+                                                 ID_FORMAT_UNKNOWN for auto */
+    ID_SCANINTENT          scanintent;        /* Current scan intent */
     SANE_Fixed             tl_x, tl_y;        /* Top-left x/y */
     SANE_Fixed             br_x, br_y;        /* Bottom-right x/y */
     SANE_Parameters        params;            /* Scan parameters */
     SANE_String            *sane_sources;     /* Sources, in SANE format */
     SANE_String            *sane_colormodes;  /* Color modes in SANE format */
+    SANE_String            *sane_scanintents; /* Scan intents in SANE format */
+    SANE_String            *sane_transfer_formats; /* Transfer formats,
+                                                      in SANE format */
 } devopt;
 
 /* Initialize device options
@@ -1556,9 +1842,12 @@ devopt_cleanup (devopt *opt);
 
 /* Set default option values. Before call to this function,
  * devopt.caps needs to be properly filled.
+ *
+ * If profile is not NULL, it overrides defaults, set by
+ * configuration
  */
 void
-devopt_set_defaults (devopt *opt);
+devopt_set_defaults (devopt *opt, const conf_profile *profile);
 
 /* Set device option
  */
@@ -1648,6 +1937,8 @@ zeroconf_finding_done (ZEROCONF_METHOD method);
 typedef struct {
     uuid              uuid;       /* Device UUID */
     const char        *name;      /* Device name */
+    const char        *model;     /* Device model, as reported
+                                     by sane_get_devices() */
     zeroconf_endpoint *endpoints; /* Device endpoints */
 } zeroconf_devinfo;
 
@@ -1666,6 +1957,24 @@ zeroconf_cleanup (void);
 const SANE_Device**
 zeroconf_device_list_get (void);
 
+/* Get generation counter of the list of devices. It is incremented
+ * every time the list is changed
+ */
+unsigned int
+zeroconf_device_list_gen (void);
+
+/* Get file descriptor, that becomes readable when list of devices
+ * changes. It remains readable until zeroconf_device_list_ack()
+ */
+int
+zeroconf_device_list_get_fd (void);
+
+/* Acknowledge changes of the list of devices, making the
+ * file descriptor not readable until the next change
+ */
+void
+zeroconf_device_list_ack (void);
+
 /* Free list of devices, returned by zeroconf_device_list_get()
  */
 void
@@ -1682,6 +1991,36 @@ zeroconf_device_list_free (const SANE_Device **dev_list);
 zeroconf_devinfo*
 zeroconf_devinfo_lookup (const char *ident);
 
+/* Lookup device by ident without waiting for the initial scan
+ *
+ * If device is not found, but may appear until initial scan is
+ * done, NULL is returned and *pending is set to true. Use
+ * zeroconf_initscan_notify() to retry when it is done
+ */
+zeroconf_devinfo*
+zeroconf_devinfo_lookup_nowait (const char *ident, bool *pending);
+
+/* Get ident of the first device in the list, returned by
+ * zeroconf_device_list_get(), without waiting for the initial
+ * scan. Returns NULL, if there are no devices (yet). The returned
+ * string must be released with g_free()
+ */
+char*
+zeroconf_device_first_ident (void);
+
+/* Request notification when initial scan is done (or timed out).
+ * The event is triggered only once; if initial scan is already
+ * done, it is triggered immediately. MDNS discovery is started,
+ * if not started yet
+ */
+void
+zeroconf_initscan_notify (eloop_event *event);
+
+/* Cancel notification, requested by zeroconf_initscan_notify()
+ */
+void
+zeroconf_initscan_notify_cancel (eloop_event *event);
+
 /* Free zeroconf_devinfo, returned by zeroconf_devinfo_lookup()
  */
 void
@@ -1724,6 +2063,13 @@ zeroconf_endpoint_list_sort_dedup (zeroconf_endpoint *list);
 SANE_Status
 mdns_init (void);
 
+/* Start MDNS discovery, if not started yet. Must be called
+ * with eloop mutex held. Returns true, if discovery was
+ * started by this call
+ */
+bool
+mdns_start (void);
+
 /* Cleanup MDNS
  */
 void
@@ -1745,10 +2091,34 @@ wsdd_cleanup (void);
  */
 typedef struct device device;
 
-/* Open a device
+/* Start opening a device. If name is NULL or empty, the first
+ * device is opened
+ *
+ * On success, returns device in the probing state. Use
+ * device_open_finish() to wait for completion of probing
+ *
+ * This function never waits for the initial scan for devices:
+ * if device cannot be found yet, its lookup is deferred and
+ * performed by the event loop, when the initial scan is done
  */
 device*
-device_open (const char *name, SANE_Status *status);
+device_open_start (const char *name, SANE_Status *status);
+
+/* Get file descriptor, that becomes readable when probing,
+ * started by device_open_start(), is finished
+ */
+int
+device_open_get_fd (device *dev);
+
+/* Finish opening a device
+ *
+ * If wait is true, waits until probing is finished. Otherwise,
+ * returns SANE_STATUS_DEVICE_BUSY if it is still in progress.
+ * If lookup or probing has failed, device is destroyed and error
+ * status is returned
+ */
+SANE_Status
+device_open_finish (device *dev, bool wait);
 
 /* Close the device
  */
@@ -1803,6 +2173,18 @@ device_get_select_fd (device *dev, SANE_Int *fd);
 SANE_Status
 device_read (device *dev, SANE_Byte *data, SANE_Int max_len, SANE_Int *len);
 
+/* Read the whole next page into the sealed memfd
+ */
+SANE_Status
+device_read_page_memfd (device *dev, SANE_Bool compressed,
+        int *fd_out, SANE_Parameters *params);
+
+/* Get thumbnail of the last page
+ */
+SANE_Status
+device_get_thumbnail (device *dev, SANE_Parameters *params,
+        SANE_Byte *data, SANE_Int max_len);
+
 /* Initialize device management
  */
 SANE_Status
@@ -1813,6 +2195,209 @@ device_management_init (void);
 void
 device_management_cleanup (void);
 
+/******************** Performance statistics ********************/
+/* Performance history file layout
+ *
+ * The file consists of the perfstat_header, followed by the
+ * PERFSTAT_MAX_DEVICES fixed-size records, so it can be mmap()-ed
+ * and used directly. If file doesn't match, the new file is created and
+ * renamed over it, so mappings of the old file remain valid
+ *
+ * Writers hold flock(LOCK_EX) on the file while updating a record,
+ * and keep record's seq odd during update. Readers that don't take
+ * the lock must retry, if seq is odd or changed while reading
+ */
+#define PERFSTAT_MAGIC          "AIRSCNPH"
+#define PERFSTAT_VERSION        1
+#define PERFSTAT_MAX_DEVICES    64
+
+/* Performance history file header
+ */
+typedef struct {
+    char              magic[8];       /* PERFSTAT_MAGIC, not terminated */
+    uint32_t          version;        /* PERFSTAT_VERSION */
+    uint32_t          record_size;    /* sizeof(perfstat_record) */
+    uint32_t          num_records;    /* PERFSTAT_MAX_DEVICES */
+    uint32_t          reserved;
+} perfstat_header;
+
+/* Statistics of the device, using the particular protocol. Times
+ * are moving averages, in milliseconds
+ */
+typedef struct {
+    uint32_t          probes;         /* Probes measured */
+    uint32_t          jobs;           /* Jobs measured */
+    uint32_t          pages;          /* Pages measured */
+    uint32_t          wakes;          /* Wake-ups measured */
+    uint32_t          retries;        /* Total count of status retries */
+    uint32_t          failures;       /* Failed probes and jobs since
+                                         the last received page */
+    double            probe_ms;       /* Capabilities query RTT */
+    double            setup_ms;       /* Job setup latency */
+    double            first_page_ms;  /* Time from job start to 1st page */
+    double            page_ms;        /* Page time */
+    double            page_bytes;     /* Page size */
+    double            wake_ms;        /* Extra setup latency of the first
+                                         job after PERFSTAT_IDLE_TIME */
+    double            page_bps[NUM_ID_COLORMODE][NUM_ID_FORMAT];
+                                      /* Page throughput, bytes/second */
+} perfstat_proto;
+
+/* Performance history record of the device
+ */
+typedef struct {
+    uint32_t          seq;            /* Odd while record is updated */
+    uint32_t          reserved;
+    int64_t           used;           /* Last update time, seconds since
+                                         Epoch, 0 if record is free */
+    int64_t           last_job;       /* Last job time, the same */
+    uuid              uuid;           /* Device UUID */
+    perfstat_proto    proto[NUM_ID_PROTO]; /* Per-protocol statistics */
+} perfstat_record;
+
+/* Get path to the performance history file, according to
+ * configuration. Returns NULL, if history is disabled. The
+ * returned string must be released with g_free()
+ */
+char*
+perfstat_path (void);
+
+/* Cleanup performance statistics. The performance history is
+ * opened on demand, by the first call of any other perfstat function
+ * that needs it, so there is no perfstat_init()
+ */
+void
+perfstat_cleanup (void);
+
+/* Record capabilities query RTT of the device, using the protocol
+ */
+void
+perfstat_probe (uuid u, ID_PROTO proto, int ms);
+
+/* Record job setup latency of the device, using the protocol
+ */
+void
+perfstat_job_setup (uuid u, ID_PROTO proto, int ms);
+
+/* Record time from job start to the first page
+ */
+void
+perfstat_first_page (uuid u, ID_PROTO proto, int ms);
+
+/* Record page transfer of the device, using the protocol
+ */
+void
+perfstat_page (uuid u, ID_PROTO proto, ID_COLORMODE colormode,
+        ID_FORMAT format, size_t bytes, int ms);
+
+/* Record status retry of the device, using the protocol
+ */
+void
+perfstat_retry (uuid u, ID_PROTO proto);
+
+/* Record failed probe or job of the device, using the protocol
+ */
+void
+perfstat_failure (uuid u, ID_PROTO proto);
+
+/* Get copy of the device performance history record. Returns
+ * false, if device has no history yet
+ */
+bool
+perfstat_get (uuid u, perfstat_record *rec);
+
+/* Choose protocol for the device
+ *
+ * protocols is the set of protocols, supported by device, as
+ * (1 << ID_PROTO) bits. Returns ID_PROTO_UNKNOWN if set is empty
+ */
+ID_PROTO
+perfstat_choose_proto (uuid u, unsigned int protocols);
+
+/******************** Extension API ********************/
+/* These entry points are not part of the SANE API. They are exported
+ * from the backend for frontends that link with it directly (or
+ * resolve them with dlsym()), and are not available via libsane-dll
+ */
+
+/* Get the whole next page as a sealed memfd
+ *
+ * May be called after sane_start() instead of sane_read(). On success,
+ * the caller owns the returned file descriptor and may mmap() it
+ * read-only. Params are the same as returned by sane_get_parameters().
+ * If compressed is true, the page is returned as received from the
+ * device (i.e., JPEG), without decoding, so its actual geometry may
+ * slightly differ from params. Otherwise, the page is decoded
+ *
+ * This call always blocks and consumes the whole page, so sane_start()
+ * needs to be called for the next one
+ */
+SANE_Status
+sane_airscan_get_page_memfd (SANE_Handle handle, SANE_Bool compressed,
+        int *fd, SANE_Parameters *params);
+
+/* Get thumbnail of the current page
+ *
+ * Thumbnails are not produced, until this function is called for
+ * the first time on the device handle, so frontends, that want them,
+ * should call it once after sane_open() (the call fails, as there
+ * is no thumbnail yet)
+ *
+ * Thumbnail is produced while the page is decoded and becomes
+ * available as soon as the last line of the page is read (by
+ * sane_read() or sane_airscan_get_page_memfd()). It remains
+ * available until decoding of the next page begins. Thumbnail
+ * has the same format as the page, and its longest side doesn't
+ * exceed 160 pixels
+ *
+ * Returns SANE_STATUS_INVAL if thumbnail is not available and
+ * SANE_STATUS_NO_MEM if max_len is too small to hold the thumbnail.
+ * In the latter case, params are filled anyway, so the caller can
+ * allocate a buffer of bytes_per_line * lines bytes and try again
+ */
+SANE_Status
+sane_airscan_get_thumbnail (SANE_Handle handle, SANE_Parameters *params,
+        SANE_Byte *data, SANE_Int max_len);
+
+/* Get file descriptor, that becomes readable, when list of devices,
+ * returned by sane_get_devices(), changes, so frontend may poll() it
+ * instead of polling sane_get_devices(). It remains readable until
+ * the next sane_get_devices() call
+ */
+SANE_Status
+sane_airscan_get_devices_fd (SANE_Int *fd);
+
+/* Get generation counter of the list of devices. It changes every
+ * time the list of devices changes. sane_get_devices() rebuilds the
+ * list only if its generation has changed since the previous call
+ */
+SANE_Word
+sane_airscan_get_devices_generation (void);
+
+/* Start opening a device without waiting for completion of
+ * device probing, so several devices can be probed in parallel.
+ * If device cannot be found until initial scan for network devices
+ * is done, its lookup is deferred as well
+ *
+ * On success, handle is returned immediately, and fd (if not NULL)
+ * is set to the file descriptor, that becomes readable when probing
+ * is finished. Until sane_airscan_open_finish() returns
+ * SANE_STATUS_GOOD, the handle may only be passed to
+ * sane_airscan_open_finish() or sane_close()
+ */
+SANE_Status
+sane_airscan_open_async (SANE_String_Const name, SANE_Handle *handle,
+        SANE_Int *fd);
+
+/* Finish opening a device, started by sane_airscan_open_async()
+ *
+ * If wait is SANE_TRUE, waits until device probing is finished.
+ * Otherwise, returns SANE_STATUS_DEVICE_BUSY if it is still in
+ * progress. On any other error, handle becomes invalid
+ */
+SANE_Status
+sane_airscan_open_finish (SANE_Handle handle, SANE_Bool wait);
+
 /******************** Scan Protocol handling ********************/
 /* PROTO_OP represents operation
  */
@@ -1834,6 +2419,8 @@ typedef struct {
     int           x_res, y_res; /* X/Y resolution */
     ID_SOURCE     src;          /* Desired source */
     ID_COLORMODE  colormode;    /* Desired color mode */
+    ID_FORMAT     format;       /* Desired image format */
+    ID_SCANINTENT scanintent;   /* Scan intent */
 } proto_scan_params;
 
 /* proto_ctx represents request context
@@ -1855,6 +2442,7 @@ typedef struct {
     /* Extra context for status_decode callback */
     PROTO_OP             failed_op;          /* Failed operation */
     int                  failed_http_status; /* Its HTTP status */
+    int                  failed_retry_after; /* Its Retry-After, ms, or -1 */
     int                  failed_attempt;     /* Retry count, 0-based */
 } proto_ctx;
 
@@ -1910,6 +2498,24 @@ struct proto_handler {
     /* Cancel scan in progress
      */
     http_query*  (*cancel_query) (const proto_ctx *ctx);
+
+    /* Decode result of status_query, made while device is idle,
+     * for the continuous ADF mode. Optional, may be NULL.
+     *
+     * Returns SANE_STATUS_GOOD, if device is idle and documents
+     * are loaded into the ADF, SANE_STATUS_UNSUPPORTED, if device
+     * doesn't report ADF state, or other status otherwise
+     */
+    SANE_Status  (*adf_status_decode) (const proto_ctx *ctx);
+
+    /* Decode result of status_query, made before the next job is
+     * started, while cleanup of the previous job is still in
+     * progress. Optional, may be NULL.
+     *
+     * Returns SANE_STATUS_GOOD, if device is idle, and other
+     * status otherwise
+     */
+    SANE_Status  (*idle_status_decode) (const proto_ctx *ctx);
 };
 
 /* proto_handler_escl_new creates new eSCL protocol handler
@@ -1922,11 +2528,30 @@ proto_handler_escl_new (void);
 proto_handler*
 proto_handler_wsd_new (void);
 
+/* proto_handler_fake_new creates new fake protocol handler, that
+ * completes all operations locally, following the script, taken
+ * from the SANE_AIRSCAN_FAKE_PROTO environment variable.
+ *
+ * Returns NULL, if this variable is not set
+ */
+proto_handler*
+proto_handler_fake_new (void);
+
 /* proto_handler_new creates new protocol handler by protocol ID
+ *
+ * If fake protocol is enabled, it replaces all real protocols. This
+ * is a test hook, that allows to exercise device state machinery
+ * without real devices
  */
 static inline proto_handler*
 proto_handler_new (ID_PROTO proto)
 {
+    proto_handler *fake = proto_handler_fake_new();
+
+    if (fake != NULL) {
+        return fake;
+    }
+
     switch (proto) {
     case ID_PROTO_ESCL:
         return proto_handler_escl_new();
@@ -1959,6 +2584,7 @@ struct image_decoder {
     void  (*get_params) (image_decoder *decoder, SANE_Parameters *params);
     error (*set_window) (image_decoder *decoder, image_window *win);
     error (*read_line) (image_decoder *decoder, void *buffer);
+    void  (*set_profile) (image_decoder *decoder, ID_DECODE_PROFILE profile);
 };
 
 /* Create JPEG image decoder
@@ -1966,6 +2592,21 @@ struct image_decoder {
 image_decoder*
 image_decoder_jpeg_new (void);
 
+/* Create PDF image decoder
+ */
+image_decoder*
+image_decoder_pdf_new (void);
+
+/* Create BMP image decoder
+ */
+image_decoder*
+image_decoder_bmp_new (void);
+
+/* Create TIFF image decoder
+ */
+image_decoder*
+image_decoder_tiff_new (void);
+
 /* Free image decoder
  */
 static inline void
@@ -1982,6 +2623,18 @@ image_content_type (image_decoder *decoder)
     return decoder->content_type;
 }
 
+/* Set decoding profile. It affects images, decoding of which is
+ * started after this call. Decoders that don't have a faster, but
+ * less accurate mode, leave set_profile method NULL
+ */
+static inline void
+image_decoder_set_profile (image_decoder *decoder, ID_DECODE_PROFILE profile)
+{
+    if (decoder->set_profile != NULL) {
+        decoder->set_profile(decoder, profile);
+    }
+}
+
 /* Begin image decoding. Decoder may assume that provided data
  * buffer remains valid during a whole decoding cycle
  */
@@ -2046,6 +2699,133 @@ image_decoder_read_line (image_decoder *decoder, void *buffer)
     return decoder->read_line(decoder, buffer);
 }
 
+/******************** Decode thread pool ********************/
+/* decpool_queue represents per-device queue of decode tasks
+ */
+typedef struct decpool_queue decpool_queue;
+
+/* decpool_task represents decoding of a single page
+ */
+typedef struct decpool_task decpool_task;
+
+/* Initialize decode pool
+ */
+void
+decpool_init (void);
+
+/* Cleanup decode pool
+ */
+void
+decpool_cleanup (void);
+
+/* Create per-device queue of decode tasks. Returns NULL, if
+ * decode pool is disabled
+ */
+decpool_queue*
+decpool_queue_new (void);
+
+/* Free the queue. Pending tasks are dropped
+ */
+void
+decpool_queue_free (decpool_queue *q);
+
+/* Submit page for decoding. The image is referenced by the task
+ */
+void
+decpool_queue_submit (decpool_queue *q, http_data *image,
+        ID_DECODE_PROFILE profile);
+
+/* Drop all tasks from the queue
+ */
+void
+decpool_queue_purge (decpool_queue *q);
+
+/* Detach task for the image from the queue. Returns NULL, if
+ * there is no task for this image
+ */
+decpool_task*
+decpool_queue_take (decpool_queue *q, http_data *image);
+
+/* Wait for the task completion. If task is not taken by the pool
+ * yet, it is decoded by the calling thread
+ *
+ * On success, data and size are set to the decoded image, suitable
+ * for the raw image decoder. Data remains valid until the task is freed
+ */
+error
+decpool_task_wait (decpool_task *task, const void **data, size_t *size);
+
+/* Free the task, detached by decpool_queue_take()
+ */
+void
+decpool_task_free (decpool_task *task);
+
+/* Dump pool statistics
+ */
+void
+decpool_stats_dump (log_ctx *log);
+
+/* Create raw image decoder, for images, decoded by the pool
+ */
+image_decoder*
+image_decoder_raw_new (void);
+
+/******************** Line filters ********************/
+/* filter represents a single stage of the line filter chain
+ *
+ * Decoded lines are passed through the whole chain one by one, so
+ * each line is processed by all stages while it is still in cache.
+ * Filters work in place; output line may be shorter than the input
+ * line (i.e., with color to gray conversion), but never longer
+ */
+typedef struct filter filter;
+struct filter {
+    filter *next;                                /* Next filter in chain */
+    bool   active;                               /* Active for this image */
+    void   (*free) (filter *f);                  /* Free the filter */
+    bool   (*begin) (filter *f,                  /* Start new image */
+                     SANE_Parameters *params);
+    void   (*apply) (filter *f, uint8_t *line,   /* Filter the line */
+                     int pixels);
+};
+
+/* Append filter to the end of chain. Returns updated chain
+ */
+filter*
+filter_chain_push (filter *chain, filter *f);
+
+/* Free the chain. Returns NULL
+ */
+filter*
+filter_chain_free (filter *chain);
+
+/* Prepare the chain for the new image
+ *
+ * On input, params describe the decoded image; on output they
+ * describe the image, produced by the chain. Each filter chooses
+ * kernel for its input format here; filters, that have nothing to
+ * do with the image, are deactivated
+ */
+void
+filter_chain_begin (filter *chain, SANE_Parameters *params);
+
+/* Pass the line through the chain
+ */
+void
+filter_chain_apply (filter *chain, uint8_t *line, int pixels);
+
+/* Create color to grayscale conversion filter
+ */
+filter*
+filter_gray_new (void);
+
+/* Create tap filter, that passes each line to the callback
+ * without modification
+ */
+filter*
+filter_tap_new (void (*callback) (void *ptr, const uint8_t *line, size_t len),
+        void *ptr);
+
 /******************** Mathematical Functions ********************/
 /* Find greatest common divisor of two positive integers
  */
@@ -2179,6 +2959,12 @@ log_configure (void);
 log_ctx*
 log_ctx_new (const char *name);
 
+/* log_ctx_set_name changes name of the logging context. The
+ * associated trace, if any, is reopened under the new name
+ */
+void
+log_ctx_set_name (log_ctx *log, const char *name);
+
 /* log_ctx_free destroys logging context
  */
 void
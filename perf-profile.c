@@ -0,0 +1,682 @@
+/* sane-airscan device performance profiler
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Runs a matrix of scans (resolutions x modes x sources x transfer
+ * formats) against the device, measures each of them and writes
+ * the performance profile of the device model:
+ *
+ *   ./perf-profile -r 150,300 -f jpeg,pdf,bmp -o model.conf "Device"
+ *
+ * The profile may be placed into the airscan.d directory, and then
+ * the backend will use it to choose defaults of the decode-profile
+ * and transfer-format options for all devices of this model.
+ *
+ * For each scan the following is measured:
+ *   - setup:  time of the first sane_start() call, i.e., job creation
+ *             and waiting for the first page
+ *   - page:   time of reading each page, subsequent sane_start()
+ *             calls included
+ *   - bytes:  bytes per page, as returned by sane_read()
+ *   - cpu:    CPU time, consumed by the process while reading each
+ *             page. It is dominated by image decoding
+ *
+ * It works with the fake protocol as well (see SANE_AIRSCAN_FAKE_PROTO
+ * in sane-airscan(5)), which is useful to check the tool itself.
+ *
+ * With the -H option, it prints the performance history, collected by
+ * the backend while scanning (see perfstat_record in airscan.h):
+ *
+ *   ./perf-profile -H [file]
+ *
+ * If file is not given, the file is chosen by the perf-history option
+ * of airscan.conf, as the backend does
+ */
+
+#include <sane/sane.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "airscan.h"
+
+/* Limits
+ */
+#define PP_MAX_VALUES           16      /* Values per matrix axis */
+#define PP_MAX_RESULTS          1024    /* Total scans in the matrix */
+
+/* If decoding takes more than this percentage of page time,
+ * the fast decoding profile is recommended
+ */
+#define PP_FAST_DECODE_PERCENT  50
+
+/* Matrix axis: list of option values
+ */
+typedef struct {
+    const char *values[PP_MAX_VALUES];  /* Option values */
+    int        len;                     /* Count of values */
+} pp_axis;
+
+/* Result of the single scan of the matrix
+ */
+typedef struct {
+    const char *res, *mode, *source, *format; /* Options */
+    bool       ok;                          /* Scan succeeded */
+    long       setup_ms;                    /* Job setup latency */
+    int        pages;                       /* Pages received */
+    long       page_ms;                     /* Total pages time */
+    long       bytes;                       /* Total bytes */
+    long       cpu_ms;                      /* Total CPU time */
+} pp_result;
+
+static SANE_Handle pp_handle;
+static pp_result   pp_results[PP_MAX_RESULTS];
+static int         pp_results_len;
+
+/* Get time of the clock, in milliseconds
+ */
+static long
+pp_clock_ms (clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Parse comma-separated list of values into the axis.
+ * Parsed values point into the string, which is modified
+ */
+static void
+pp_axis_parse (pp_axis *axis, char *s)
+{
+    char *tok, *save = NULL;
+
+    axis->len = 0;
+    for (tok = strtok_r(s, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (axis->len < PP_MAX_VALUES) {
+            axis->values[axis->len ++] = tok;
+        }
+    }
+}
+
+/* Make axis of the single value, if axis is empty
+ */
+static void
+pp_axis_default (pp_axis *axis, const char *value)
+{
+    if (axis->len == 0) {
+        axis->values[0] = value;
+        axis->len = 1;
+    }
+}
+
+/* Check that value is allowed by the option's constraint
+ */
+static bool
+pp_option_allowed (SANE_Int option, const char *value)
+{
+    const SANE_Option_Descriptor *desc;
+    int                          i;
+
+    desc = sane_get_option_descriptor(pp_handle, option);
+    if (desc == NULL || !SANE_OPTION_IS_ACTIVE(desc->cap)) {
+        return false;
+    }
+
+    if (desc->constraint_type != SANE_CONSTRAINT_STRING_LIST) {
+        return true;
+    }
+
+    for (i = 0; desc->constraint.string_list[i] != NULL; i ++) {
+        if (!strcasecmp(desc->constraint.string_list[i], value)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Set string option. Returns false, if value is not supported
+ */
+static bool
+pp_option_set (SANE_Int option, const char *value)
+{
+    char        buf[256];
+    SANE_Status status;
+
+    if (!pp_option_allowed(option, value)) {
+        return false;
+    }
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    status = sane_control_option(pp_handle, option, SANE_ACTION_SET_VALUE,
+        buf, NULL);
+
+    return status == SANE_STATUS_GOOD;
+}
+
+/* Read the whole page. Returns count of bytes read or -1 on error
+ */
+static long
+pp_read_page (void)
+{
+    SANE_Byte   buf[65536];
+    SANE_Int    len;
+    SANE_Status status;
+    long        count = 0;
+
+    for (;;) {
+        status = sane_read(pp_handle, buf, sizeof(buf), &len);
+        if (status != SANE_STATUS_GOOD) {
+            break;
+        }
+
+        count += len;
+    }
+
+    if (status != SANE_STATUS_EOF) {
+        fprintf(stderr, "  sane_read: %s\n", sane_strstatus(status));
+        return -1;
+    }
+
+    return count;
+}
+
+/* Run the single scan of the matrix
+ */
+static void
+pp_scan (pp_result *r)
+{
+    SANE_Word   res = atoi(r->res);
+    SANE_Status status;
+    bool        adf = strcmp(r->source, OPTVAL_SOURCE_PLATEN) != 0;
+    long        start, cpu, bytes;
+
+    /* Set options. Source goes first, as it affects other options */
+    if (!pp_option_set(OPT_SCAN_SOURCE, r->source) ||
+        !pp_option_set(OPT_SCAN_COLORMODE, r->mode) ||
+        !pp_option_set(OPT_TRANSFER_FORMAT, r->format)) {
+        return;
+    }
+
+    status = sane_control_option(pp_handle, OPT_SCAN_RESOLUTION,
+        SANE_ACTION_SET_VALUE, &res, NULL);
+    if (status != SANE_STATUS_GOOD) {
+        return;
+    }
+
+    /* Scan all pages */
+    start = pp_clock_ms(CLOCK_MONOTONIC);
+    status = sane_start(pp_handle);
+    r->setup_ms = pp_clock_ms(CLOCK_MONOTONIC) - start;
+    start += r->setup_ms;
+
+    while (status == SANE_STATUS_GOOD) {
+        cpu = pp_clock_ms(CLOCK_PROCESS_CPUTIME_ID);
+        bytes = pp_read_page();
+        if (bytes < 0) {
+            break;
+        }
+
+        r->pages ++;
+        r->bytes += bytes;
+        r->cpu_ms += pp_clock_ms(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+        r->page_ms += pp_clock_ms(CLOCK_MONOTONIC) - start;
+
+        if (!adf) {
+            break;
+        }
+
+        start = pp_clock_ms(CLOCK_MONOTONIC);
+        status = sane_start(pp_handle);
+    }
+
+    if (status != SANE_STATUS_GOOD && status != SANE_STATUS_NO_DOCS) {
+        fprintf(stderr, "  sane_start: %s\n", sane_strstatus(status));
+    }
+
+    sane_cancel(pp_handle);
+    r->ok = r->pages != 0;
+}
+
+/* Format result line
+ */
+static void
+pp_result_print (FILE *fp, const char *prefix, const pp_result *r)
+{
+    if (!r->ok) {
+        fprintf(fp, "%s%-5s %-8s %-10s %-5s %s\n", prefix,
+            r->res, r->mode, r->source, r->format, "failed");
+        return;
+    }
+
+    fprintf(fp, "%s%-5s %-8s %-10s %-5s %8ld %5d %8ld %10ld %7ld\n", prefix,
+        r->res, r->mode, r->source, r->format, r->setup_ms, r->pages,
+        r->page_ms / r->pages, r->bytes / r->pages, r->cpu_ms / r->pages);
+}
+
+/* Choose transfer format: the one, which is the fastest for the
+ * most of resolution/mode/source combinations. Ties are resolved
+ * by the total page time
+ */
+static const char*
+pp_choose_format (const pp_axis *formats)
+{
+    int        wins[PP_MAX_VALUES] = {0};
+    long       total[PP_MAX_VALUES] = {0};
+    int        i, j, best = -1;
+
+    for (i = 0; i < pp_results_len; i += formats->len) {
+        int  fastest = -1;
+        long fastest_ms = 0;
+
+        for (j = 0; j < formats->len && i + j < pp_results_len; j ++) {
+            const pp_result *r = &pp_results[i + j];
+            long            ms;
+
+            if (!r->ok) {
+                continue;
+            }
+
+            ms = r->page_ms / r->pages;
+            total[j] += ms;
+            if (fastest < 0 || ms < fastest_ms) {
+                fastest = j;
+                fastest_ms = ms;
+            }
+        }
+
+        if (fastest >= 0) {
+            wins[fastest] ++;
+        }
+    }
+
+    for (j = 0; j < formats->len; j ++) {
+        if (wins[j] == 0) {
+            continue;
+        }
+
+        if (best < 0 || wins[j] > wins[best] ||
+            (wins[j] == wins[best] && total[j] < total[best])) {
+            best = j;
+        }
+    }
+
+    return best >= 0 ? formats->values[best] : NULL;
+}
+
+/* Choose decoding profile: fast, if decoding takes significant
+ * part of page time, accurate otherwise
+ */
+static const char*
+pp_choose_decode_profile (void)
+{
+    long page_ms = 0, cpu_ms = 0;
+    int  i;
+
+    for (i = 0; i < pp_results_len; i ++) {
+        if (pp_results[i].ok) {
+            page_ms += pp_results[i].page_ms;
+            cpu_ms += pp_results[i].cpu_ms;
+        }
+    }
+
+    if (page_ms != 0 && cpu_ms * 100 / page_ms > PP_FAST_DECODE_PERCENT) {
+        return OPTVAL_DECODE_PROFILE_FAST;
+    }
+
+    return OPTVAL_DECODE_PROFILE_ACCURATE;
+}
+
+/* Write the performance profile
+ */
+static void
+pp_profile_write (FILE *fp, const char *model, const pp_axis *formats)
+{
+    const char *fmt = pp_choose_format(formats);
+    int        i;
+
+    fprintf(fp, "# Performance profile of \"%s\", made by perf-profile\n", model);
+    fprintf(fp, "#\n");
+    fprintf(fp, "# res   mode     source     fmt   setup,ms pages  page,ms "
+        "bytes/page  cpu,ms\n");
+    for (i = 0; i < pp_results_len; i ++) {
+        pp_result_print(fp, "# ", &pp_results[i]);
+    }
+
+    fprintf(fp, "[profile]\n");
+    fprintf(fp, "model = \"%s\"\n", model);
+    if (fmt != NULL) {
+        fprintf(fp, "transfer-format = %s\n", fmt);
+    }
+    fprintf(fp, "decode-profile = %s\n", pp_choose_decode_profile());
+}
+
+/* Find device model by device name
+ */
+static const char*
+pp_device_model (const char *name)
+{
+    const SANE_Device **list;
+    int               i;
+
+    if (sane_get_devices(&list, SANE_FALSE) != SANE_STATUS_GOOD) {
+        return NULL;
+    }
+
+    for (i = 0; list[i] != NULL; i ++) {
+        if (!strcmp(list[i]->name, name)) {
+            return list[i]->model;
+        }
+    }
+
+    return NULL;
+}
+
+/* Get current value of string option. Returned string is
+ * statically allocated
+ */
+static const char*
+pp_option_get (SANE_Int option)
+{
+    static char buf[8][256];
+    static int  n;
+    char        *s = buf[n ++ % 8];
+
+    if (sane_control_option(pp_handle, option, SANE_ACTION_GET_VALUE,
+            s, NULL) != SANE_STATUS_GOOD) {
+        return "";
+    }
+
+    return s;
+}
+
+/* Copy the performance history record, following the seqlock
+ * protocol of the backend. Returns false, if record keeps changing
+ */
+static bool
+pp_history_record_copy (const perfstat_record *rec, perfstat_record *out)
+{
+    int      attempt;
+    uint32_t seq;
+
+    for (attempt = 0; attempt < 100; attempt ++) {
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_SEQ_CST);
+        if ((seq & 1) == 0) {
+            memcpy(out, rec, sizeof(*out));
+            if (__atomic_load_n(&rec->seq, __ATOMIC_SEQ_CST) == seq) {
+                return true;
+            }
+        }
+
+        usleep(1000);
+    }
+
+    return false;
+}
+
+/* Print the performance history, collected by the backend
+ */
+static int
+pp_history_print (const char *path)
+{
+    char                  *conf_path = NULL;
+    int                   fd, i, p, c, f;
+    size_t                size;
+    struct stat           st;
+    const perfstat_header *hdr;
+    const perfstat_record *recs;
+
+    /* Use the same file, as backend does */
+    if (path == NULL) {
+        log_init();
+        conf_load();
+        conf_path = perfstat_path();
+        conf_unload();
+        log_cleanup();
+
+        if (conf_path == NULL) {
+            fprintf(stderr, "performance history is disabled\n");
+            return 1;
+        }
+
+        path = conf_path;
+    }
+
+    size = sizeof(perfstat_header) +
+        PERFSTAT_MAX_DEVICES * sizeof(perfstat_record);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        g_free(conf_path);
+        return 1;
+    }
+
+    /* Mapping beyond the end of file causes SIGBUS on access */
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < size) {
+        fprintf(stderr, "%s: unsupported file format\n", path);
+        close(fd);
+        g_free(conf_path);
+        return 1;
+    }
+
+    hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (hdr == MAP_FAILED) {
+        perror(path);
+        g_free(conf_path);
+        return 1;
+    }
+
+    if (memcmp(hdr->magic, PERFSTAT_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != PERFSTAT_VERSION ||
+        hdr->record_size != sizeof(perfstat_record) ||
+        hdr->num_records != PERFSTAT_MAX_DEVICES) {
+        fprintf(stderr, "%s: unsupported file format\n", path);
+        munmap((void*) hdr, size);
+        g_free(conf_path);
+        return 1;
+    }
+
+    recs = (const perfstat_record*) (hdr + 1);
+    for (i = 0; i < PERFSTAT_MAX_DEVICES; i ++) {
+        perfstat_record rec;
+        time_t          t;
+
+        if (!pp_history_record_copy(&recs[i], &rec) || rec.used == 0) {
+            continue;
+        }
+
+        t = (time_t) rec.used;
+        printf("%s, updated %s", rec.uuid.text, ctime(&t));
+
+        for (p = 0; p < NUM_ID_PROTO; p ++) {
+            const perfstat_proto *s = &rec.proto[p];
+
+            if (s->probes == 0 && s->jobs == 0 && s->failures == 0) {
+                continue;
+            }
+
+            printf("  %-4s probe: %u x %.0f ms, setup: %u x %.0f ms, "
+                "first page: %.0f ms\n", id_proto_name(p), s->probes,
+                s->probe_ms,
+                s->jobs, s->setup_ms, s->first_page_ms);
+            printf("       page: %u x %.0f ms, %.0f bytes, wake: %u x %.0f ms, "
+                "retries: %u, failures: %u\n", s->pages, s->page_ms,
+                s->page_bytes, s->wakes, s->wake_ms, s->retries, s->failures);
+
+            for (c = 0; c < NUM_ID_COLORMODE; c ++) {
+                for (f = 0; f < NUM_ID_FORMAT; f ++) {
+                    const char *format = id_format_sane_name(f);
+
+                    if (format == NULL) {
+                        format = id_format_mime_name(f);
+                    }
+
+                    if (s->page_bps[c][f] > 0) {
+                        printf("       %s/%s: %.0f KB/s\n",
+                            id_colormode_sane_name(c), format,
+                            s->page_bps[c][f] / 1024);
+                    }
+                }
+            }
+        }
+    }
+
+    munmap((void*) hdr, size);
+    g_free(conf_path);
+    return 0;
+}
+
+/* Print usage and exit
+ */
+static void
+pp_usage (const char *argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options] \"device name\"\n"
+        "       %s -H [history file]\n"
+        "options are:\n"
+        "  -r res,...     resolutions (300)\n"
+        "  -m mode,...    modes (Color,Gray)\n"
+        "  -s source,...  sources (device default)\n"
+        "  -f format,...  transfer formats (jpeg,pdf,bmp)\n"
+        "  -o file        write profile to file (stdout)\n"
+        "  -H             print performance history, collected by backend\n",
+        argv0, argv0);
+    exit(1);
+}
+
+int
+main (int argc, char **argv)
+{
+    pp_axis     res = {{0}, 0}, modes = {{0}, 0};
+    pp_axis     sources = {{0}, 0}, formats = {{0}, 0};
+    const char  *output = NULL, *name, *model;
+    FILE        *fp = stdout;
+    SANE_Status status;
+    bool        history = false;
+    int         c, i, j, k, l;
+
+    while ((c = getopt(argc, argv, "r:m:s:f:o:H")) != -1) {
+        switch (c) {
+        case 'r': pp_axis_parse(&res, optarg); break;
+        case 'm': pp_axis_parse(&modes, optarg); break;
+        case 's': pp_axis_parse(&sources, optarg); break;
+        case 'f': pp_axis_parse(&formats, optarg); break;
+        case 'o': output = optarg; break;
+        case 'H': history = true; break;
+        default:  pp_usage(argv[0]);
+        }
+    }
+
+    if (history) {
+        if (optind < argc - 1) {
+            pp_usage(argv[0]);
+        }
+
+        return pp_history_print(optind < argc ? argv[optind] : NULL);
+    }
+
+    if (optind != argc - 1) {
+        pp_usage(argv[0]);
+    }
+
+    name = argv[optind];
+
+    /* Open the device */
+    status = sane_init(NULL, NULL);
+    if (status == SANE_STATUS_GOOD) {
+        status = sane_open(name, &pp_handle);
+    }
+
+    if (status != SANE_STATUS_GOOD) {
+        fprintf(stderr, "%s: %s\n", name, sane_strstatus(status));
+        return 1;
+    }
+
+    model = pp_device_model(name);
+    if (model == NULL) {
+        model = name;
+    }
+
+    /* Fill defaults */
+    pp_axis_default(&res, "300");
+    if (modes.len == 0) {
+        modes.values[0] = SANE_VALUE_SCAN_MODE_COLOR;
+        modes.values[1] = SANE_VALUE_SCAN_MODE_GRAY;
+        modes.len = 2;
+    }
+    pp_axis_default(&sources, pp_option_get(OPT_SCAN_SOURCE));
+    if (formats.len == 0) {
+        formats.values[0] = OPTVAL_TRANSFER_FORMAT_JPEG;
+        formats.values[1] = OPTVAL_TRANSFER_FORMAT_PDF;
+        formats.values[2] = OPTVAL_TRANSFER_FORMAT_BMP;
+        formats.len = 3;
+    }
+
+    /* Run the matrix. Formats are the innermost axis, so
+     * results of each resolution/mode/source combination
+     * follow each other (see pp_choose_format())
+     */
+    printf("res   mode     source     fmt   setup,ms pages  page,ms "
+        "bytes/page  cpu,ms\n");
+
+    for (i = 0; i < res.len; i ++) {
+        for (j = 0; j < modes.len; j ++) {
+            for (k = 0; k < sources.len; k ++) {
+                for (l = 0; l < formats.len; l ++) {
+                    pp_result *r;
+
+                    if (pp_results_len == PP_MAX_RESULTS) {
+                        continue;
+                    }
+
+                    r = &pp_results[pp_results_len ++];
+                    r->res = res.values[i];
+                    r->mode = modes.values[j];
+                    r->source = sources.values[k];
+                    r->format = formats.values[l];
+
+                    pp_scan(r);
+                    pp_result_print(stdout, "", r);
+                }
+            }
+        }
+    }
+
+    /* Write the profile */
+    if (output != NULL) {
+        fp = fopen(output, "w");
+        if (fp == NULL) {
+            perror(output);
+            fp = stdout;
+        }
+    }
+
+    printf("\n");
+    pp_profile_write(fp, model, &formats);
+
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    sane_close(pp_handle);
+    sane_exit();
+    return 0;
+}
+
+/* vim:ts=8:sw=4:et
+ */
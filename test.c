@@ -6,10 +6,15 @@
 
 #include <sane/sane.h>
 
+#include <dirent.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "airscan.h"
 
@@ -66,8 +71,387 @@ scan_test (void)
     }
 }
 
+/******************** Stress test ********************/
+/* Stress test runs many randomized open/start/read/cancel/close
+ * cycles on several threads, one device per thread, and checks
+ * that memory usage, file descriptors count and latency of
+ * operations don't grow over time.
+ *
+ * It is intended to be used with the fake protocol (see
+ * SANE_AIRSCAN_FAKE_PROTO in sane-airscan(5)) and a few
+ * manually configured devices:
+ *
+ *   SANE_AIRSCAN_FAKE_PROTO="pages=1,delay=5" ./test -stress 5000 4
+ */
+
+/* Limits. Growth is measured relative to the first window
+ */
+#define STRESS_WINDOWS          10      /* Reports per run */
+#define STRESS_RSS_GROWTH_KB    16384   /* Max RSS growth */
+#define STRESS_FD_GROWTH        4       /* Max fd count growth */
+#define STRESS_P99_GROWTH       3       /* Max p99 latency growth, times */
+#define STRESS_P99_SLACK_US     20000   /* Ignore p99 growth below this */
+
+/* Operations we measure
+ */
+enum {
+    STRESS_OP_OPEN,
+    STRESS_OP_START,
+    STRESS_OP_READ,
+    STRESS_OP_CANCEL,
+    STRESS_OP_CLOSE,
+    NUM_STRESS_OP
+};
+
+static const char *stress_op_names[NUM_STRESS_OP] = {
+    "open", "start", "read", "cancel", "close"
+};
+
+/* Stress test state, shared between threads
+ */
+static struct {
+    pthread_mutex_t lock;                   /* Protects everything below */
+    int             cycles_left;            /* Cycles left to run */
+    int             cycles_done;            /* Cycles done */
+    int             errors;                 /* Unexpected statuses */
+    long            *lat[NUM_STRESS_OP];    /* Latencies in the window, us */
+    int             lat_len[NUM_STRESS_OP]; /* Count of latencies */
+    int             lat_cap[NUM_STRESS_OP]; /* Allocated size */
+} stress;
+
+/* Get monotonic time, in microseconds
+ */
+static long
+stress_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Record latency of the operation
+ */
+static void
+stress_lat_add (int op, long started)
+{
+    long lat = stress_now() - started;
+
+    pthread_mutex_lock(&stress.lock);
+    if (stress.lat_len[op] == stress.lat_cap[op]) {
+        stress.lat_cap[op] = stress.lat_cap[op] ? stress.lat_cap[op] * 2 : 256;
+        stress.lat[op] = realloc(stress.lat[op],
+            stress.lat_cap[op] * sizeof(stress.lat[op][0]));
+    }
+    stress.lat[op][stress.lat_len[op] ++] = lat;
+    pthread_mutex_unlock(&stress.lock);
+}
+
+/* Compare latencies, for qsort
+ */
+static int
+stress_lat_cmp (const void *p1, const void *p2)
+{
+    long l1 = *(const long*) p1, l2 = *(const long*) p2;
+    return l1 < l2 ? -1 : (l1 > l2);
+}
+
+/* Get percentile of sorted latencies
+ */
+static long
+stress_lat_percentile (int op, int percent)
+{
+    if (stress.lat_len[op] == 0) {
+        return 0;
+    }
+
+    return stress.lat[op][(stress.lat_len[op] - 1) * percent / 100];
+}
+
+/* Get resident set size, in kilobytes
+ */
+static long
+stress_rss_kb (void)
+{
+    FILE *fp = fopen("/proc/self/statm", "r");
+    long size = 0, resident = 0;
+
+    if (fp != NULL) {
+        if (fscanf(fp, "%ld %ld", &size, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(fp);
+    }
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Get count of open file descriptors
+ */
+static int
+stress_fd_count (void)
+{
+    DIR           *dir = opendir("/proc/self/fd");
+    struct dirent *ent;
+    int           count = 0;
+
+    if (dir != NULL) {
+        while ((ent = readdir(dir)) != NULL) {
+            if (ent->d_name[0] != '.') {
+                count ++;
+            }
+        }
+        closedir(dir);
+    }
+
+    return count;
+}
+
+/* Check status of operation
+ */
+static void
+stress_check (SANE_Status status, const char *dev, int op)
+{
+    switch (status) {
+    case SANE_STATUS_GOOD:
+    case SANE_STATUS_EOF:
+    case SANE_STATUS_CANCELLED:
+    case SANE_STATUS_NO_DOCS:
+        break;
+
+    default:
+        printf("%s: %s: %s\n", dev, stress_op_names[op],
+            sane_strstatus(status));
+        pthread_mutex_lock(&stress.lock);
+        stress.errors ++;
+        pthread_mutex_unlock(&stress.lock);
+    }
+}
+
+/* Run single stress cycle on a device
+ */
+static void
+stress_cycle (const char *dev, unsigned int *seed)
+{
+    SANE_Handle h;
+    SANE_Status s;
+    SANE_Byte   buf[65536];
+    SANE_Int    len;
+    long        started, limit, total = 0;
+
+    started = stress_now();
+    s = sane_open(dev, &h);
+    stress_lat_add(STRESS_OP_OPEN, started);
+    stress_check(s, dev, STRESS_OP_OPEN);
+    if (s != SANE_STATUS_GOOD) {
+        return;
+    }
+
+    started = stress_now();
+    s = sane_start(h);
+    stress_lat_add(STRESS_OP_START, started);
+    stress_check(s, dev, STRESS_OP_START);
+
+    /* Read random amount of data; sometimes all, sometimes nothing */
+    limit = rand_r(seed) % 4 == 0 ? -1 : (long) (rand_r(seed) % (1 << 20));
+    while (s == SANE_STATUS_GOOD && (limit < 0 || total < limit)) {
+        started = stress_now();
+        s = sane_read(h, buf, sizeof(buf), &len);
+        stress_lat_add(STRESS_OP_READ, started);
+        stress_check(s, dev, STRESS_OP_READ);
+        total += len;
+    }
+
+    started = stress_now();
+    sane_cancel(h);
+    stress_lat_add(STRESS_OP_CANCEL, started);
+
+    /* After cancel, sane_read() must complete the job */
+    while (s == SANE_STATUS_GOOD) {
+        s = sane_read(h, buf, sizeof(buf), &len);
+    }
+
+    started = stress_now();
+    sane_close(h);
+    stress_lat_add(STRESS_OP_CLOSE, started);
+}
+
+/* Stress test thread
+ */
+static void*
+stress_thread (void *arg)
+{
+    const char   *dev = arg;
+    unsigned int seed = (unsigned int) (uintptr_t) arg ^ (unsigned int) time(NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&stress.lock);
+        if (stress.cycles_left == 0 || stress.errors != 0) {
+            pthread_mutex_unlock(&stress.lock);
+            break;
+        }
+        stress.cycles_left --;
+        pthread_mutex_unlock(&stress.lock);
+
+        stress_cycle(dev, &seed);
+
+        pthread_mutex_lock(&stress.lock);
+        stress.cycles_done ++;
+        pthread_mutex_unlock(&stress.lock);
+    }
+
+    return NULL;
+}
+
+/* Report the window and check limits. Returns false if limits are exceeded
+ */
+static bool
+stress_report (int window, long base_rss, int base_fds, long *base_p99)
+{
+    long rss = stress_rss_kb();
+    int  fds = stress_fd_count();
+    bool ok = true;
+    int  op;
+
+    pthread_mutex_lock(&stress.lock);
+
+    printf("window %d: cycles=%d rss=%ldK fds=%d",
+        window, stress.cycles_done, rss, fds);
+
+    for (op = 0; op < NUM_STRESS_OP; op ++) {
+        long p99;
+
+        qsort(stress.lat[op], stress.lat_len[op], sizeof(stress.lat[op][0]),
+            stress_lat_cmp);
+        p99 = stress_lat_percentile(op, 99);
+
+        printf(" %s=%ld/%ldus", stress_op_names[op],
+            stress_lat_percentile(op, 50), p99);
+
+        if (window == 0) {
+            base_p99[op] = p99;
+        } else if (p99 > STRESS_P99_SLACK_US &&
+                   p99 > base_p99[op] * STRESS_P99_GROWTH) {
+            printf("\n%s: p99 latency grown from %ldus to %ldus",
+                stress_op_names[op], base_p99[op], p99);
+            ok = false;
+        }
+
+        stress.lat_len[op] = 0;
+    }
+
+    printf("\n");
+    pthread_mutex_unlock(&stress.lock);
+
+    if (rss - base_rss > STRESS_RSS_GROWTH_KB) {
+        printf("RSS grown from %ldK to %ldK\n", base_rss, rss);
+        ok = false;
+    }
+
+    if (fds - base_fds > STRESS_FD_GROWTH) {
+        printf("fd count grown from %d to %d\n", base_fds, fds);
+        ok = false;
+    }
+
+    return ok;
+}
+
+/* Run the stress test
+ */
+static int
+stress_test (int cycles, int threads)
+{
+    const SANE_Device **devices;
+    SANE_Status       status;
+    pthread_t         *tids;
+    long              base_rss = 0, base_p99[NUM_STRESS_OP];
+    int               base_fds = 0, window = 0, ndev, i;
+    bool              ok = true;
+
+    pthread_mutex_init(&stress.lock, NULL);
+    stress.cycles_left = cycles = cycles > 0 ? cycles : 1;
+    threads = threads > 0 ? threads : 1;
+
+    TRY(sane_init, NULL, NULL);
+
+    /* From now on, sane_exit() must be called on every exit path */
+    status = sane_get_devices(&devices, SANE_TRUE);
+    if (status != SANE_STATUS_GOOD) {
+        printf("sane_get_devices: %s\n", sane_strstatus(status));
+        sane_exit();
+        return 1;
+    }
+
+    for (ndev = 0; devices[ndev] != NULL; ndev ++)
+        ;
+
+    if (ndev == 0) {
+        printf("no devices found\n");
+        sane_exit();
+        return 1;
+    }
+
+    if (threads > ndev) {
+        printf("%d devices found, using %d threads\n", ndev, ndev);
+        threads = ndev;
+    }
+
+    tids = calloc(threads, sizeof(*tids));
+    for (i = 0; i < threads; i ++) {
+        pthread_create(&tids[i], NULL, stress_thread,
+            (void*) devices[i]->name);
+    }
+
+    /* Report periodically, until all cycles are done */
+    for (;;) {
+        int  done;
+        bool failed;
+
+        usleep(100000);
+
+        pthread_mutex_lock(&stress.lock);
+        done = stress.cycles_done;
+        failed = stress.errors != 0;
+        pthread_mutex_unlock(&stress.lock);
+
+        if (done >= (window + 1) * cycles / STRESS_WINDOWS ||
+            done == cycles || failed) {
+            if (window == 0) {
+                base_rss = stress_rss_kb();
+                base_fds = stress_fd_count();
+            }
+
+            if (!stress_report(window, base_rss, base_fds, base_p99)) {
+                ok = false;
+            }
+
+            window ++;
+        }
+
+        if (done == cycles || failed) {
+            break;
+        }
+    }
+
+    for (i = 0; i < threads; i ++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    sane_exit();
+
+    if (stress.errors != 0) {
+        printf("%d errors\n", stress.errors);
+        ok = false;
+    }
+
+    printf("stress test %s\n", ok ? "passed" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+/******************** Main test ********************/
 int
-main (void)
+main (int argc, char **argv)
 {
     SANE_Parameters params;
 
@@ -75,6 +459,11 @@ main (void)
         .sa_handler = sigint_handler,
     };
 
+    if (argc > 1 && !strcmp(argv[1], "-stress")) {
+        return stress_test(argc > 2 ? atoi(argv[2]) : 1000,
+            argc > 3 ? atoi(argv[3]) : 1);
+    }
+
     sigaction(SIGINT, &act, NULL);
 
     TRY(sane_init, NULL, NULL);
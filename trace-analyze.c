@@ -0,0 +1,370 @@
+/* sane-airscan protocol trace analyzer
+ *
+ * Copyright (C) 2019 and up by Alexander Pevzner (pzz@apevzner.com)
+ * See LICENSE for license terms and conditions
+ *
+ * Reads the .log part of the protocol trace (see [debug] trace
+ * option in airscan.conf), reconstructs sequence of operations of
+ * each scan job and reports where time went:
+ *
+ *   ./trace-analyze ~/airscan/trace/scanimage-Kyocera.log
+ *
+ * Only timestamped lines, written by the backend's logger, are
+ * used. HTTP dumps, written between them, are ignored.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Anomaly thresholds
+ */
+#define TA_RETRY_STORM          5       /* CHECK requests per job */
+#define TA_LONG_LOAD_MS         30000   /* NextDocument request duration */
+#define TA_LONG_CANCEL_MS       5000    /* Cancel duration */
+
+/* Protocol operations, as named in the log
+ */
+enum {
+    TA_OP_SCAN,
+    TA_OP_LOAD,
+    TA_OP_CHECK,
+    TA_OP_CANCEL,
+    TA_OP_CLEANUP,
+    NUM_TA_OP
+};
+
+static const char *ta_op_names[NUM_TA_OP] = {
+    "PROTO_OP_SCAN",
+    "PROTO_OP_LOAD",
+    "PROTO_OP_CHECK",
+    "PROTO_OP_CANCEL",
+    "PROTO_OP_CLEANUP"
+};
+
+/* Analyzer state
+ */
+typedef struct {
+    const char *file;               /* File name */
+    long       probe_start;         /* Probing start, -1 if none */
+    int        job_num;             /* Jobs counter */
+    bool       job_active;          /* Job is in progress */
+    long       op_submit[NUM_TA_OP];/* Last submit time of each op */
+
+    /* Current job */
+    long       job_start;           /* Job start time */
+    long       scan_ms;             /* ScanJobs request(s) duration */
+    int        pages;               /* Pages received */
+    long       page_ms_total;       /* Total pages transfer time */
+    long       page_ms_max;         /* Longest page transfer */
+    long       last_page;           /* When previous page was received */
+    long       gap_ms_max;          /* Longest interval between pages */
+    int        checks;              /* Count of CHECK requests */
+    int        retries;             /* Count of delayed retries */
+    long       delay_ms;            /* Total retry delays */
+    long       cleanup_ms;          /* Cleanup request duration */
+    long       cancel_at;           /* When cancel was requested, or -1 */
+    char       status[64];          /* Last JOB status */
+    char       anomalies[1024];     /* Anomalies found */
+} ta_state;
+
+/* Parse timestamp at the beginning of line. Returns pointer to the
+ * message text (without device name), or NULL if line has no timestamp
+ */
+static const char*
+ta_parse_line (const char *line, long *ms)
+{
+    int        hour, min, sec, msec, off = 0;
+    const char *s;
+
+    if (sscanf(line, "%d:%d:%d.%d: %n", &hour, &min, &sec, &msec, &off) != 4 ||
+        off == 0) {
+        return NULL;
+    }
+
+    *ms = ((hour * 60L + min) * 60L + sec) * 1000L + msec;
+    line += off;
+
+    /* Skip "device name": prefix */
+    if (*line == '"') {
+        s = strstr(line + 1, "\": ");
+        if (s != NULL) {
+            line = s + 3;
+        }
+    }
+
+    return line;
+}
+
+/* Find operation by name prefix of the message
+ */
+static int
+ta_op_lookup (const char *msg, const char **rest)
+{
+    int i;
+
+    for (i = 0; i < NUM_TA_OP; i ++) {
+        size_t len = strlen(ta_op_names[i]);
+        if (!strncmp(msg, ta_op_names[i], len) && msg[len] == ':') {
+            *rest = msg + len + 1;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/* Add anomaly to the current job
+ */
+static void
+ta_anomaly (ta_state *st, const char *fmt, long v1, long v2)
+{
+    size_t len = strlen(st->anomalies);
+    char   buf[256];
+
+    snprintf(buf, sizeof(buf), fmt, v1, v2);
+    snprintf(st->anomalies + len, sizeof(st->anomalies) - len,
+        "  ANOMALY: %s\n", buf);
+}
+
+/* Format duration
+ */
+static const char*
+ta_fmt (long ms, char *buf)
+{
+    sprintf(buf, "%ld.%3.3lds", ms / 1000, ms % 1000);
+    return buf;
+}
+
+/* Start new job
+ */
+static void
+ta_job_begin (ta_state *st, long t)
+{
+    int i;
+
+    st->job_active = true;
+    st->job_num ++;
+    st->job_start = t;
+    st->scan_ms = 0;
+    st->pages = 0;
+    st->page_ms_total = st->page_ms_max = 0;
+    st->last_page = -1;
+    st->gap_ms_max = 0;
+    st->checks = st->retries = 0;
+    st->delay_ms = 0;
+    st->cleanup_ms = 0;
+    st->cancel_at = -1;
+    strcpy(st->status, "GOOD");
+    st->anomalies[0] = '\0';
+
+    for (i = 0; i < NUM_TA_OP; i ++) {
+        st->op_submit[i] = -1;
+    }
+}
+
+/* Finish the job and print report
+ */
+static void
+ta_job_end (ta_state *st, long t)
+{
+    char b1[32], b2[32];
+
+    st->job_active = false;
+
+    if (st->checks >= TA_RETRY_STORM) {
+        ta_anomaly(st, "retry storm: %ld status requests, %ld delayed retries",
+            st->checks, st->retries);
+    }
+
+    if (st->cancel_at >= 0 && t - st->cancel_at > TA_LONG_CANCEL_MS) {
+        ta_anomaly(st, "slow cancel: %ld ms, requested at %ld ms",
+            t - st->cancel_at, st->cancel_at);
+    }
+
+    printf("%s: job %d, started at %s\n", st->file, st->job_num,
+        ta_fmt(st->job_start, b1));
+    printf("  total:          %s, status=%s\n",
+        ta_fmt(t - st->job_start, b1), st->status);
+    printf("  scan request:   %s\n", ta_fmt(st->scan_ms, b1));
+    printf("  pages:          %d\n", st->pages);
+    if (st->pages > 0) {
+        printf("  page transfer:  %s avg, %s max\n",
+            ta_fmt(st->page_ms_total / st->pages, b1),
+            ta_fmt(st->page_ms_max, b2));
+    }
+    if (st->pages > 1) {
+        printf("  between pages:  %s max\n", ta_fmt(st->gap_ms_max, b1));
+    }
+    if (st->checks != 0) {
+        printf("  retries:        %d status requests, %d delayed, %s waiting\n",
+            st->checks, st->retries, ta_fmt(st->delay_ms, b1));
+    }
+    if (st->cleanup_ms != 0) {
+        printf("  cleanup:        %s\n", ta_fmt(st->cleanup_ms, b1));
+    }
+    if (st->cancel_at >= 0) {
+        printf("  cancel:         %s\n", ta_fmt(t - st->cancel_at, b1));
+    }
+    printf("%s\n", st->anomalies);
+}
+
+/* Handle "PROTO_OP_XXX: decoded: status="..." next=XXX delay=N"
+ */
+static void
+ta_op_decoded (ta_state *st, int op, const char *rest, long t)
+{
+    const char *next = strstr(rest, "next=");
+    const char *delay = strstr(rest, "delay=");
+    long       dur = st->op_submit[op] >= 0 ? t - st->op_submit[op] : 0;
+    long       d;
+
+    if (delay != NULL) {
+        d = atol(delay + 6);
+        if (d > 0) {
+            st->retries ++;
+            st->delay_ms += d;
+        }
+    }
+
+    switch (op) {
+    case TA_OP_SCAN:
+        st->scan_ms += dur;
+        break;
+
+    case TA_OP_LOAD:
+        if (dur > TA_LONG_LOAD_MS) {
+            ta_anomaly(st, "long NextDocument wait: %ld ms, page %ld",
+                dur, st->pages + 1L);
+        }
+
+        if (next != NULL && !strncmp(next + 5, "PROTO_OP_LOAD", 13)) {
+            st->pages ++;
+            st->page_ms_total += dur;
+            if (dur > st->page_ms_max) {
+                st->page_ms_max = dur;
+            }
+            if (st->last_page >= 0 && t - st->last_page > st->gap_ms_max) {
+                st->gap_ms_max = t - st->last_page;
+            }
+            st->last_page = t;
+        }
+        break;
+
+    case TA_OP_CLEANUP:
+        st->cleanup_ms += dur;
+        break;
+    }
+}
+
+/* Handle single log message
+ */
+static void
+ta_message (ta_state *st, const char *msg, long t)
+{
+    const char *rest;
+    int        op;
+    char       b[32];
+
+    if (!strncmp(msg, "state=", 6)) {
+        const char *state = msg + 6;
+
+        if (!strcmp(state, "DEVICE_STM_PROBING")) {
+            st->probe_start = t;
+        } else if (!strcmp(state, "DEVICE_STM_IDLE") ||
+                   !strcmp(state, "DEVICE_STM_PROBING_FAILED")) {
+            if (st->probe_start >= 0) {
+                printf("%s: probe: %s%s\n\n", st->file,
+                    ta_fmt(t - st->probe_start, b),
+                    state[11] == 'P' ? " (failed)" : "");
+                st->probe_start = -1;
+            }
+        } else if (!strcmp(state, "DEVICE_STM_SCANNING")) {
+            ta_job_begin(st, t);
+        } else if (!strcmp(state, "DEVICE_STM_DONE") && st->job_active) {
+            ta_job_end(st, t);
+        }
+        return;
+    }
+
+    if (!st->job_active) {
+        return;
+    }
+
+    if (!strcmp(msg, "cancel requested")) {
+        st->cancel_at = t;
+    } else if (!strncmp(msg, "JOB status=", 11)) {
+        snprintf(st->status, sizeof(st->status), "%s", msg + 11);
+    } else if ((op = ta_op_lookup(msg, &rest)) >= 0) {
+        if (!strncmp(rest, " submitting", 11)) {
+            st->op_submit[op] = t;
+            if (op == TA_OP_CHECK) {
+                st->checks ++;
+            }
+        } else if (!strncmp(rest, " decoded", 8)) {
+            ta_op_decoded(st, op, rest, t);
+        }
+    }
+}
+
+/* Analyze single trace file
+ */
+static int
+ta_file (const char *file)
+{
+    FILE     *fp = fopen(file, "r");
+    char     line[4096];
+    ta_state st;
+    long     t = 0;
+
+    if (fp == NULL) {
+        perror(file);
+        return -1;
+    }
+
+    memset(&st, 0, sizeof(st));
+    st.file = file;
+    st.probe_start = -1;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        const char *msg;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        msg = ta_parse_line(line, &t);
+        if (msg != NULL) {
+            ta_message(&st, msg, t);
+        }
+    }
+
+    if (st.job_active) {
+        size_t len = strlen(st.status);
+        snprintf(st.status + len, sizeof(st.status) - len, " (unfinished)");
+        ta_job_end(&st, t);
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    int i, rc = 0;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s trace.log ...\n", argv[0]);
+        return 1;
+    }
+
+    for (i = 1; i < argc; i ++) {
+        if (ta_file(argv[i]) != 0) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+/* vim:ts=8:sw=4:et
+ */